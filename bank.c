@@ -20,7 +20,9 @@
  */
 
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <strings.h>
 #include <errno.h>
 #include "pod6ctl.h"
 #include "bank.h"
@@ -308,13 +310,15 @@ struct bank_op {
 	int type;
 	int scale;
 	size_t offset;
-	void (*set)(struct bank_op *, struct bank *, int);
-	void (*setp)(struct bank_op *, struct bank *, int);
+	int (*set)(struct bank_op *, struct bank *, int);
+	int (*setp)(struct bank_op *, struct bank *, int);
 	int (*get)(struct bank_op *, struct bank *);
 	int (*getp)(struct bank_op *, struct bank *);
 	const char **sw;
 	const char *units;
 	int (*xfrm)(int, bool);
+	int cc;		/* MIDI controller number, 0 if none */
+	int cc_fine;	/* Controller for the low 7 bits of a 14-bit value */
 };
 
 #define lengthof(x) ((size_t)(sizeof(x) / sizeof(__typeof__(*x))))
@@ -341,20 +345,22 @@ int xfrm_mod_fb(int val, bool xfrmin)
 	return ((val > 0) ? 0x40 | val : -val);
 }
 
-void bank_set_be16(struct bank_op *op, struct bank *b, int val)
+int bank_set_be16(struct bank_op *op, struct bank *b, int val)
 {
 	unsigned char *p = ((unsigned char *)b) + op->offset;
 
 	if (val < op->min || val > op->max)
-		return;
+		return -ERANGE;
 
 	p[0] = val >> 8;
 	p[1] = val & 0xff;
+
+	return 0;
 }
 
-void bank_setp_be16(struct bank_op *op, struct bank *b, int val)
+int bank_setp_be16(struct bank_op *op, struct bank *b, int val)
 {
-	bank_set_be16(op, b, (val * op->max / op->scale));
+	return bank_set_be16(op, b, (val * op->max / op->scale));
 }
 
 int bank_get_be16(struct bank_op *op, struct bank *b)
@@ -372,27 +378,29 @@ int bank_getp_be16(struct bank_op *op, struct bank *b)
 	return ((bank_get_be16(op, b) * op->scale) / op->max);
 }
 
-void bank_set_simple(struct bank_op *op, struct bank *b, int val)
+int bank_set_simple(struct bank_op *op, struct bank *b, int val)
 {
 	char *p = ((char *)b) + op->offset;
 
 	if (val < op->min || val > op->max) {
 		if (verbose)
 			printf("*** out of range *** %d: %d < %d\n", val, op->min, op->max);
-		return;
+		return -ERANGE;
 	}
 
 	*p = val;
+
+	return 0;
 }
 
-void bank_setp_simple(struct bank_op *op, struct bank *b, int val)
+int bank_setp_simple(struct bank_op *op, struct bank *b, int val)
 {
 	if (op->xfrm)
 		val = op->xfrm(val, false);
 	else
 		val = val * op->max / op->scale;
 
-	bank_set_simple(op, b, val);
+	return bank_set_simple(op, b, val);
 }
 
 int bank_get_simple(struct bank_op *op, struct bank *b)
@@ -421,7 +429,7 @@ int bank_getp_simple(struct bank_op *op, struct bank *b)
 #define OP_KNOB 0
 #define OP_SWITCH 1
 
-#define BE16_OP(d, member, _emask, _min, _max, _scale, _units) {\
+#define BE16_OP(d, member, _emask, _min, _max, _scale, _units, _cc, _cc_fine) {\
 	.name = #member,\
 	.desc = d,\
 	.min = _min,\
@@ -435,10 +443,12 @@ int bank_getp_simple(struct bank_op *op, struct bank *b)
 	.getp = bank_getp_be16,\
 	.emask = _emask,\
 	.units = _units,\
+	.cc = _cc,\
+	.cc_fine = _cc_fine,\
 }
-#define BE16_STD_OP(d, member, _emask, _min, _max) BE16_OP(d, member, _emask, _min, _max, 100, "%")
+#define BE16_STD_OP(d, member, _emask, _min, _max, _cc) BE16_OP(d, member, _emask, _min, _max, 100, "%", _cc, 0)
 
-#define U8_OP(d, member, _emask, _min, _max, _scale, _units, _xfrm) {\
+#define U8_OP(d, member, _emask, _min, _max, _scale, _units, _xfrm, _cc) {\
 	.name = #member,\
 	.desc = d,\
 	.min = _min,\
@@ -453,13 +463,14 @@ int bank_getp_simple(struct bank_op *op, struct bank *b)
 	.getp = bank_getp_simple,\
 	.emask = _emask,\
 	.xfrm = _xfrm,\
+	.cc = _cc,\
 }
-#define SIMPLE_RANGED_OP(d, member, _emask, _min, _max, _type) U8_OP(d, member, _emask, _min, _max, 100, "%", NULL)
-#define SIMPLE_7B_OP(d, member) SIMPLE_RANGED_OP(d, member, 0, 0, 0x7f, NULL) 
-#define SIMPLE_6B_OP(d, member) SIMPLE_RANGED_OP(d, member, 0, 0, 0x3f, NULL) 
-#define SIMPLE_6B_DEP_OP(d, member, _emask) SIMPLE_RANGED_OP(d, member, _emask, 0, 0x3f, NULL) 
+#define SIMPLE_RANGED_OP(d, member, _emask, _min, _max, _cc) U8_OP(d, member, _emask, _min, _max, 100, "%", NULL, _cc)
+#define SIMPLE_7B_OP(d, member, _cc) SIMPLE_RANGED_OP(d, member, 0, 0, 0x7f, _cc)
+#define SIMPLE_6B_OP(d, member, _cc) SIMPLE_RANGED_OP(d, member, 0, 0, 0x3f, _cc)
+#define SIMPLE_6B_DEP_OP(d, member, _emask, _cc) SIMPLE_RANGED_OP(d, member, _emask, 0, 0x3f, _cc)
 
-#define SWITCH_DEP_OP(d, member, s, _emask) {\
+#define SWITCH_DEP_OP(d, member, s, _emask, _cc) {\
 	.name = #member,\
 	.desc = d,\
 	.min = 0,\
@@ -470,68 +481,70 @@ int bank_getp_simple(struct bank_op *op, struct bank *b)
 	.set = bank_set_simple,\
 	.get = bank_get_simple,\
 	.emask = _emask,\
+	.cc = _cc,\
 }
 
-#define SWITCH_OP(d, member, s) SWITCH_DEP_OP(d, member, s, 0)
-#define SIMPLE_SWITCH_OP(d, member) SWITCH_OP(d, member, simple_switch)
-#define SIMPLE_SWITCH_DEP_OP(d, member, _emask) SWITCH_DEP_OP(d, member, simple_switch, _emask)
+#define SWITCH_OP(d, member, s, _cc) SWITCH_DEP_OP(d, member, s, 0, _cc)
+#define SIMPLE_SWITCH_OP(d, member, _cc) SWITCH_OP(d, member, simple_switch, _cc)
+#define SIMPLE_SWITCH_DEP_OP(d, member, _emask, _cc) SWITCH_DEP_OP(d, member, simple_switch, _emask, _cc)
 
+/* Controller numbers follow the POD 2.x MIDI controller chart */
 struct bank_op bank_ops[] = {
-	SWITCH_OP("Amp Model", amp_model, amp_models),
-	SWITCH_OP("Cabinet Model", cabinet, cabinets),
-	SIMPLE_6B_OP("A.I.R. (acoustically integrated recording) Ambience Level", air),
-	SWITCH_OP("Volume Pedal Position", volpos, volpos_switch),
-
-	SIMPLE_6B_OP("Channel Volume", chan_vol),
-	SIMPLE_6B_OP("Drive", drive),
-	SIMPLE_6B_DEP_OP("Drive 2", drive2, AMP_DRIVE2),
-	SIMPLE_6B_OP("Bass", bass),
-	SIMPLE_6B_OP("Middle", middle),
-	SIMPLE_6B_OP("Treble", treble),
-	SIMPLE_6B_DEP_OP("Presence", presence, AMP_PRESENCE),
-
-	SIMPLE_SWITCH_OP("Distortion", distortion),
-	SIMPLE_SWITCH_OP("Drive/Boost", drive_boost),
-	SIMPLE_SWITCH_OP("EQ", eq),
-	SIMPLE_SWITCH_DEP_OP("Bright", bright, AMP_BRIGHT),
-
-	SIMPLE_SWITCH_OP("Delay", delay),
-	BE16_OP("Delay Time", delay_time, 0, 0x0000, 0x7ffa, 3150, "ms"),
-	SIMPLE_6B_OP("Delay Repeats", delay_repeats),
-	SIMPLE_6B_OP("Delay Level", delay_level),
-
-	SIMPLE_SWITCH_OP("Reverb", reverb),
-	SWITCH_OP("Reverb Type", reverb_type, reverb_switch),
-	SIMPLE_6B_OP("Reverb Level", reverb_level),
-	SIMPLE_6B_OP("Reverb Decay", reverb_decay),
-	SIMPLE_6B_OP("Reverb Tone", reverb_tone),
-	SIMPLE_6B_OP("Reverb Diffusion", reverb_diffusion),
-	SIMPLE_6B_OP("Reverb Density", reverb_density),
-
-	SIMPLE_SWITCH_OP("Noise Gate", noise_gate),
-	U8_OP("Gate Threshold", gate_threshold, 0, 0, 96, 0, "dB", xfrm_gate_threshold),
-	SIMPLE_6B_OP("Gate Decay", gate_decay),
+	SWITCH_OP("Amp Model", amp_model, amp_models, 12),
+	SWITCH_OP("Cabinet Model", cabinet, cabinets, 71),
+	SIMPLE_6B_OP("A.I.R. (acoustically integrated recording) Ambience Level", air, 72),
+	SWITCH_OP("Volume Pedal Position", volpos, volpos_switch, 47),
+
+	SIMPLE_6B_OP("Channel Volume", chan_vol, 17),
+	SIMPLE_6B_OP("Drive", drive, 13),
+	SIMPLE_6B_DEP_OP("Drive 2", drive2, AMP_DRIVE2, 20),
+	SIMPLE_6B_OP("Bass", bass, 14),
+	SIMPLE_6B_OP("Middle", middle, 15),
+	SIMPLE_6B_OP("Treble", treble, 16),
+	SIMPLE_6B_DEP_OP("Presence", presence, AMP_PRESENCE, 21),
+
+	SIMPLE_SWITCH_OP("Distortion", distortion, 25),
+	SIMPLE_SWITCH_OP("Drive/Boost", drive_boost, 26),
+	SIMPLE_SWITCH_OP("EQ", eq, 27),
+	SIMPLE_SWITCH_DEP_OP("Bright", bright, AMP_BRIGHT, 73),
+
+	SIMPLE_SWITCH_OP("Delay", delay, 28),
+	BE16_OP("Delay Time", delay_time, 0, 0x0000, 0x7ffa, 3150, "ms", 30, 62),
+	SIMPLE_6B_OP("Delay Repeats", delay_repeats, 32),
+	SIMPLE_6B_OP("Delay Level", delay_level, 34),
+
+	SIMPLE_SWITCH_OP("Reverb", reverb, 36),
+	SWITCH_OP("Reverb Type", reverb_type, reverb_switch, 37),
+	SIMPLE_6B_OP("Reverb Level", reverb_level, 18),
+	SIMPLE_6B_OP("Reverb Decay", reverb_decay, 38),
+	SIMPLE_6B_OP("Reverb Tone", reverb_tone, 39),
+	SIMPLE_6B_OP("Reverb Diffusion", reverb_diffusion, 40),
+	SIMPLE_6B_OP("Reverb Density", reverb_density, 41),
+
+	SIMPLE_SWITCH_OP("Noise Gate", noise_gate, 22),
+	U8_OP("Gate Threshold", gate_threshold, 0, 0, 96, 0, "dB", xfrm_gate_threshold, 23),
+	SIMPLE_6B_OP("Gate Decay", gate_decay, 24),
 	
-	SIMPLE_7B_OP("Wah Bottom Frequency", wah_bottom),
-	SIMPLE_7B_OP("Wah Top Frequency", wah_top),
+	SIMPLE_7B_OP("Wah Bottom Frequency", wah_bottom, 44),
+	SIMPLE_7B_OP("Wah Top Frequency", wah_top, 45),
 	
-	SWITCH_OP("Effect Type", effect_type, effects),
+	SWITCH_OP("Effect Type", effect_type, effects, 19),
 
-	SIMPLE_SWITCH_OP("Modulator (Chorus/Rotary/Tremolo)", mod),
+	SIMPLE_SWITCH_OP("Modulator (Chorus/Rotary/Tremolo)", mod, 50),
 
-	SWITCH_DEP_OP("Rotary Speed", rotary.speed, rotary_switch, EFFECT_ROTARY),
-	BE16_STD_OP("Rotary Max Speed", rotary.max_speed, EFFECT_ROTARY, 0x0064, 0x0b4e),
-	BE16_STD_OP("Rotary Min Speed", rotary.min_speed, EFFECT_ROTARY, 0x0064, 0x0b4e),
+	SWITCH_DEP_OP("Rotary Speed", rotary.speed, rotary_switch, EFFECT_ROTARY, 55),
+	BE16_STD_OP("Rotary Max Speed", rotary.max_speed, EFFECT_ROTARY, 0x0064, 0x0b4e, 56),
+	BE16_STD_OP("Rotary Min Speed", rotary.min_speed, EFFECT_ROTARY, 0x0064, 0x0b4e, 57),
 
-	SWITCH_DEP_OP("Compression Ratio", compression.ratio, compression_ratios, EFFECT_COMP),
+	SWITCH_DEP_OP("Compression Ratio", compression.ratio, compression_ratios, EFFECT_COMP, 42),
 
-	SIMPLE_6B_DEP_OP("Volume Swell Time", volume.swell_time, EFFECT_VOL),
-	U8_OP("Modulator Feedback", modulator.feedback, EFFECT_FLANGE | EFFECT_CHORUS, 0, 0x7f, 0, "%", xfrm_mod_fb),
-	BE16_STD_OP("Modulator Predelay", modulator.predelay, EFFECT_MOD, 0x0000, 0x0306),
-	BE16_STD_OP("Tremolo Speed", modulator.speed, EFFECT_TREM, 0x0019, 0x0c67),
-	BE16_STD_OP("Tremolo Depth", modulator.depth, EFFECT_TREM, 0x0038, 0x7f38),
-	BE16_STD_OP("Flange/Chorus Speed", modulator.speed, EFFECT_FLANGE | EFFECT_CHORUS, 0x0032, 0x18ce),
-	BE16_STD_OP("Flange/Chorus Depth", modulator.depth, EFFECT_FLANGE | EFFECT_CHORUS, 0x0000, 0x0138),
+	SIMPLE_6B_DEP_OP("Volume Swell Time", volume.swell_time, EFFECT_VOL, 0),
+	U8_OP("Modulator Feedback", modulator.feedback, EFFECT_FLANGE | EFFECT_CHORUS, 0, 0x7f, 0, "%", xfrm_mod_fb, 53),
+	BE16_STD_OP("Modulator Predelay", modulator.predelay, EFFECT_MOD, 0x0000, 0x0306, 54),
+	BE16_STD_OP("Tremolo Speed", modulator.speed, EFFECT_TREM, 0x0019, 0x0c67, 58),
+	BE16_STD_OP("Tremolo Depth", modulator.depth, EFFECT_TREM, 0x0038, 0x7f38, 59),
+	BE16_STD_OP("Flange/Chorus Speed", modulator.speed, EFFECT_FLANGE | EFFECT_CHORUS, 0x0032, 0x18ce, 51),
+	BE16_STD_OP("Flange/Chorus Depth", modulator.depth, EFFECT_FLANGE | EFFECT_CHORUS, 0x0000, 0x0138, 52),
 };
 
 static const char *bank_get_switch(struct bank_op *ops, int val)
@@ -575,6 +588,11 @@ void print_bank_ops()
 				break;
 			}
 
+			if (p->cc_fine)
+				printf(" MIDI Controller: %d (fine: %d)\n", p->cc, p->cc_fine);
+			else if (p->cc)
+				printf(" MIDI Controller: %d\n", p->cc);
+
 			if (test_bit(p->emask, EFFECT_COMP))
 				printf(" Effective with compression\n");
 			if (test_bit(p->emask, EFFECT_VOL))
@@ -646,9 +664,9 @@ void print_bank(struct bank *b)
 	printf("\n");
 }
 
-static void set_bank_param_v(struct bank *b, const char *cmd, const char *arg, bool v)
+static int set_bank_param_v(struct bank *b, const char *cmd, const char *arg, bool v)
 {
-	int i;
+	int i, err;
 	int val;
 
 	for (i = 0; i < lengthof(bank_ops) - 1; i++) {
@@ -657,29 +675,635 @@ static void set_bank_param_v(struct bank *b, const char *cmd, const char *arg, b
 		if (strcmp(cmd, p->name) == 0) {
 			val = strtol(arg, NULL, 0);
 			if (v) {
-				if (p->setp)
-					p->setp(p, b, val);
-				else
+				if (!p->setp) {
 					fprintf(stderr, "Error: no percentual setting possible for '%s'\n", cmd);
+					return -EINVAL;
+				}
+				err = p->setp(p, b, val);
 			} else {
-				if (p->set)
-					p->set(p, b, val);
-				else
+				if (!p->set) {
 					fprintf(stderr, "Error: no setting possible for '%s'\n", cmd);
+					return -EINVAL;
+				}
+				err = p->set(p, b, val);
 			}
-			return;
+
+			if (err)
+				fprintf(stderr, "Error: value out of range for '%s': %s\n", cmd, arg);
+			return err;
 		}
 	}
 	fprintf(stderr, "Error: unknown command '%s'\n", cmd);
+
+	return -EINVAL;
+}
+
+int set_direct_bank_param(struct bank *b, const char *cmd, const char *arg)
+{
+	return set_bank_param_v(b, cmd, arg, false);
 }
 
-void set_direct_bank_param(struct bank *b, const char *cmd, const char *arg)
+int set_scaled_bank_param(struct bank *b, const char *cmd, const char *arg)
 {
-	set_bank_param_v(b, cmd, arg, false);
+	return set_bank_param_v(b, cmd, arg, true);
 }
 
-void set_scaled_bank_param(struct bank *b, const char *cmd, const char *arg)
+/* Whether an attribute is in effect with the bank's amp model and effect */
+static bool bank_op_applies(struct bank_op *p, struct bank *b)
 {
-	set_bank_param_v(b, cmd, arg, true);
+	return p->emask == 0 || ((effect_type(b) | amp_features(b)) & p->emask) != 0;
+}
+
+/*
+ * Machine-readable output. A record is formatted whole into the
+ * caller's buffer, so that it can be written at once:
+ *
+ *   json  a line per bank: {"source", "bank", "name", "attributes":
+ *         [{"attr", "value", "raw", "text"}, ...]}, or per attribute
+ *   csv   a row per attribute in effect: source,bank,name,attr,value,
+ *   tsv   raw,text (after a header row); or a row per attribute for attr
+ *
+ * value is scaled as set takes it, raw is the device value and text is
+ * what list shows. Columns and keys are only ever added at the end.
+ */
+struct fmt_out {
+	char *buf;
+	size_t size;
+	size_t len;
+};
+
+static const char *bank_formats[] = {
+	[FORMAT_TEXT] = "text",
+	[FORMAT_JSON] = "json",
+	[FORMAT_CSV] = "csv",
+	[FORMAT_TSV] = "tsv",
+};
+
+int format_strton(const char *s)
+{
+	int i;
+
+	for (i = 0; i < lengthof(bank_formats); i++) {
+		if (strcmp(s, bank_formats[i]) == 0)
+			return i;
+	}
+
+	return -EINVAL;
+}
+
+static void fmt_printf(struct fmt_out *o, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	o->len += vsnprintf(o->buf + o->len, (o->len < o->size) ? o->size - o->len : 0, fmt, ap);
+	va_end(ap);
+}
+
+static void fmt_char(struct fmt_out *o, char c)
+{
+	if (o->len + 1 < o->size)
+		o->buf[o->len] = c;
+	o->len++;
+}
+
+/* A field separator, or the start of a JSON key */
+static void fmt_key(struct fmt_out *o, int fmt, bool first, const char *key)
+{
+	if (fmt == FORMAT_JSON)
+		fmt_printf(o, "%s\"%s\":", first ? "" : ",", key);
+	else if (!first)
+		fmt_char(o, (fmt == FORMAT_TSV) ? '\t' : ',');
+}
+
+/* A string quoted for the format; TSV has no quoting, so tabs become spaces */
+static void fmt_string(struct fmt_out *o, int fmt, const char *s)
+{
+	bool quote = (fmt == FORMAT_JSON) || (fmt == FORMAT_CSV && strpbrk(s, ",\"\n"));
+
+	if (quote)
+		fmt_char(o, '"');
+
+	for (; *s; s++) {
+		if (fmt == FORMAT_JSON && (*s == '"' || *s == '\\'))
+			fmt_char(o, '\\');
+		else if (fmt == FORMAT_CSV && *s == '"')
+			fmt_char(o, '"');
+
+		if (fmt == FORMAT_JSON && (unsigned char)*s < 0x20)
+			fmt_printf(o, "\\u%04x", *s);
+		else if (fmt == FORMAT_TSV && (*s == '\t' || *s == '\n'))
+			fmt_char(o, ' ');
+		else
+			fmt_char(o, *s);
+	}
+
+	if (quote)
+		fmt_char(o, '"');
+}
+
+static void fmt_end(struct fmt_out *o)
+{
+	if (o->size)
+		o->buf[(o->len < o->size) ? o->len : o->size - 1] = 0;
+}
+
+int sprint_bank_header(char *buf, size_t size, int fmt)
+{
+	static const char *cols[] = { "source", "bank", "name", "attr", "value", "raw", "text" };
+	struct fmt_out o = { buf, size, 0 };
+	int i;
+
+	if (fmt == FORMAT_CSV || fmt == FORMAT_TSV) {
+		for (i = 0; i < lengthof(cols); i++) {
+			fmt_key(&o, fmt, i == 0, cols[i]);
+			fmt_string(&o, fmt, cols[i]);
+		}
+		fmt_char(&o, '\n');
+	}
+	fmt_end(&o);
+
+	return o.len;
+}
+
+/* Formats bank n of source as one record (JSON) or a row per attribute in effect */
+int sprint_bank_fmt(char *buf, size_t size, int fmt, const char *source, int n, struct bank *b)
+{
+	struct fmt_out o = { buf, size, 0 };
+	char name[BANK_NAME_LEN + 1], text[64];
+	bool first = true;
+	int i, len, raw, val;
+
+	bank_name_str(name, b);
+	for (len = strlen(name); len > 0 && name[len - 1] == ' '; len--)
+		name[len - 1] = 0;
+
+	if (fmt == FORMAT_JSON) {
+		fmt_char(&o, '{');
+		fmt_key(&o, fmt, true, "source");
+		fmt_string(&o, fmt, source);
+		fmt_key(&o, fmt, false, "bank");
+		fmt_string(&o, fmt, bank_ntostr(n));
+		fmt_key(&o, fmt, false, "name");
+		fmt_string(&o, fmt, name);
+		fmt_key(&o, fmt, false, "attributes");
+		fmt_char(&o, '[');
+	}
+
+	for (i = 0; i < lengthof(bank_ops); i++) {
+		struct bank_op *p = &bank_ops[i];
+
+		if (!bank_op_applies(p, b))
+			continue;
+
+		raw = p->get(p, b);
+		val = p->getp ? p->getp(p, b) : raw;
+		if (p->type == OP_SWITCH)
+			snprintf(text, sizeof(text), "%s", bank_get_switch(p, raw));
+		else
+			snprintf(text, sizeof(text), "%d%s", val, p->units);
+
+		if (fmt == FORMAT_JSON) {
+			fmt_printf(&o, "%s{", first ? "" : ",");
+		} else {
+			fmt_string(&o, fmt, source);
+			fmt_key(&o, fmt, false, NULL);
+			fmt_string(&o, fmt, bank_ntostr(n));
+			fmt_key(&o, fmt, false, NULL);
+			fmt_string(&o, fmt, name);
+			fmt_key(&o, fmt, false, NULL);
+		}
+		fmt_key(&o, fmt, true, "attr");
+		fmt_string(&o, fmt, p->name);
+		fmt_key(&o, fmt, false, "value");
+		fmt_printf(&o, "%d", val);
+		fmt_key(&o, fmt, false, "raw");
+		fmt_printf(&o, "%d", raw);
+		fmt_key(&o, fmt, false, "text");
+		fmt_string(&o, fmt, text);
+		fmt_char(&o, (fmt == FORMAT_JSON) ? '}' : '\n');
+		first = false;
+	}
+
+	if (fmt == FORMAT_JSON)
+		fmt_printf(&o, "]}\n");
+	fmt_end(&o);
+
+	return o.len;
+}
+
+int sprint_bank_ops_header(char *buf, size_t size, int fmt)
+{
+	static const char *cols[] = { "attr", "desc", "type", "min", "max", "scaled_min",
+				      "scaled_max", "units", "cc", "cc_fine", "effects" };
+	struct fmt_out o = { buf, size, 0 };
+	int i;
+
+	if (fmt == FORMAT_CSV || fmt == FORMAT_TSV) {
+		for (i = 0; i < lengthof(cols); i++) {
+			fmt_key(&o, fmt, i == 0, cols[i]);
+			fmt_string(&o, fmt, cols[i]);
+		}
+		fmt_char(&o, '\n');
+	}
+	fmt_end(&o);
+
+	return o.len;
+}
+
+/*
+ * Formats attribute op as one record. min and max are device values;
+ * effects lists the amp features or effects it needs (empty: always in
+ * effect), separated by spaces.
+ */
+int sprint_bank_op_fmt(char *buf, size_t size, int fmt, int op)
+{
+	static const struct { int bit; const char *name; } effects[] = {
+		{ EFFECT_COMP, "compression" }, { EFFECT_VOL, "volume" }, { EFFECT_ROTARY, "rotary" },
+		{ EFFECT_TREM, "tremolo" }, { EFFECT_CHORUS, "chorus" }, { EFFECT_FLANGE, "flange" },
+		{ AMP_BRIGHT, "bright" }, { AMP_PRESENCE, "presence" }, { AMP_DRIVE2, "drive2" },
+	};
+	struct bank_op *p = &bank_ops[op];
+	struct fmt_out o = { buf, size, 0 };
+	char list[128] = "";
+	bool knob = (p->type == OP_KNOB);
+	int i, len = 0;
+
+	for (i = 0; i < lengthof(effects); i++) {
+		if (test_bit(p->emask, effects[i].bit))
+			len += snprintf(list + len, sizeof(list) - len, "%s%s", len ? " " : "",
+					effects[i].name);
+	}
+
+	if (fmt == FORMAT_JSON)
+		fmt_char(&o, '{');
+	fmt_key(&o, fmt, true, "attr");
+	fmt_string(&o, fmt, p->name);
+	fmt_key(&o, fmt, false, "desc");
+	fmt_string(&o, fmt, p->desc);
+	fmt_key(&o, fmt, false, "type");
+	fmt_string(&o, fmt, knob ? "knob" : "switch");
+	fmt_key(&o, fmt, false, "min");
+	fmt_printf(&o, "%d", p->min);
+	fmt_key(&o, fmt, false, "max");
+	fmt_printf(&o, "%d", p->max);
+	fmt_key(&o, fmt, false, "scaled_min");
+	fmt_printf(&o, "%d", knob ? bank_op_scaled_value(p, p->min) : p->min);
+	fmt_key(&o, fmt, false, "scaled_max");
+	fmt_printf(&o, "%d", knob ? bank_op_scaled_value(p, p->max) : p->max);
+	fmt_key(&o, fmt, false, "units");
+	fmt_string(&o, fmt, knob ? p->units : "");
+	fmt_key(&o, fmt, false, "cc");
+	fmt_printf(&o, "%d", p->cc);
+	fmt_key(&o, fmt, false, "cc_fine");
+	fmt_printf(&o, "%d", p->cc_fine);
+	fmt_key(&o, fmt, false, "effects");
+	fmt_string(&o, fmt, list);
+	fmt_printf(&o, (fmt == FORMAT_JSON) ? "}\n" : "\n");
+	fmt_end(&o);
+
+	return o.len;
+}
+
+/*
+ * Controller values are 7 bits: on/off switches are sent as 0 or 127,
+ * selectors as their index, 6-bit knobs stretched to 0-127 and 16-bit
+ * knobs as a 14-bit value, of which only knobs with a fine controller
+ * send the low 7 bits.
+ */
+static void bank_op_cc(struct bank_op *p, struct bank *b, struct bank_cc *cc)
+{
+	int val = p->get(p, b);
+
+	cc->n = 0;
+	cc->cc[cc->n] = p->cc;
+
+	if (p->set == bank_set_be16) {
+		val = val * 0x3fff / p->max;
+		cc->val[cc->n++] = val >> 7;
+		if (p->cc_fine) {
+			cc->cc[cc->n] = p->cc_fine;
+			cc->val[cc->n++] = val & 0x7f;
+		}
+	} else if (p->type == OP_SWITCH && p->max == 1) {
+		cc->val[cc->n++] = val ? 0x7f : 0;
+	} else if (p->type == OP_KNOB && p->max < 0x40) {
+		cc->val[cc->n++] = val * 0x7f / p->max;
+	} else {
+		cc->val[cc->n++] = val;
+	}
+}
+
+/*
+ * Finds an attribute by name. Attributes that depend on the effect are
+ * looked up for b's effect when effect_known, else the first is taken.
+ * Returns its index, -ENOENT if there is none by that name, or -ENODEV
+ * if it does not apply to b.
+ */
+int bank_op_lookup(struct bank *b, const char *cmd, bool effect_known)
+{
+	int i, err = -ENOENT;
+
+	for (i = 0; i < lengthof(bank_ops); i++) {
+		struct bank_op *p = &bank_ops[i];
+
+		if (strcmp(cmd, p->name) != 0)
+			continue;
+
+		if (!effect_known || bank_op_applies(p, b))
+			return i;
+		err = -ENODEV;
+	}
+
+	return err;
+}
+
+/* Sets attribute op in b like set_scaled_bank_param(); switches take their index */
+int set_scaled_bank_op(struct bank *b, int op, int val)
+{
+	struct bank_op *p = &bank_ops[op];
+
+	return p->setp ? p->setp(p, b, val) : p->set(p, b, val);
+}
+
+/* Whether attribute op only applies with some effects or amp features */
+bool bank_op_dependent(int op)
+{
+	return bank_ops[op].emask != 0;
+}
+
+/* Units of the scaled value of attribute op; "" for switches */
+const char *bank_op_units(int op)
+{
+	return (bank_ops[op].type == OP_KNOB) ? bank_ops[op].units : "";
+}
+
+/* Index of switch setting label of attribute op; -ENOENT, or -EINVAL if it is no switch */
+int bank_op_switch(int op, const char *label)
+{
+	struct bank_op *p = &bank_ops[op];
+	int i;
+
+	if (p->type != OP_SWITCH)
+		return -EINVAL;
+
+	for (i = p->min; i <= p->max; i++) {
+		if (strcasecmp(p->sw[i], label) == 0)
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * Sets attribute op in b like set_scaled_bank_param() (switches take
+ * their index) and fills cc with the controller changes that make the
+ * same edit on the device. Returns 0, -EINVAL if the attribute has no
+ * controller, or -ERANGE.
+ */
+int set_cc_bank_op(struct bank *b, int op, int val, struct bank_cc *cc)
+{
+	struct bank_op *p = &bank_ops[op];
+	int err;
+
+	if (!p->cc)
+		return -EINVAL;
+
+	err = set_scaled_bank_op(b, op, val);
+	if (err)
+		return err;
+
+	bank_op_cc(p, b, cc);
+
+	return 0;
+}
+
+/*
+ * Sets attribute op in b to a controller position (0 - 0x7f) spread over
+ * its whole device range, as a pedal sweeps it, and fills cc like
+ * set_cc_bank_op(). Returns 0, or -EINVAL if the attribute has no
+ * controller.
+ */
+int set_cc_bank_op_pos(struct bank *b, int op, int pos, struct bank_cc *cc)
+{
+	struct bank_op *p = &bank_ops[op];
+	int err;
+
+	if (!p->cc)
+		return -EINVAL;
+
+	err = p->set(p, b, p->min + (pos * (p->max - p->min) + 0x3f) / 0x7f);
+	if (err)
+		return err;
+
+	bank_op_cc(p, b, cc);
+
+	return 0;
+}
+
+int set_cc_bank_param(struct bank *b, const char *cmd, const char *arg, bool effect_known,
+		      struct bank_cc *cc)
+{
+	int op, err;
+
+	op = bank_op_lookup(b, cmd, effect_known);
+	if (op == -ENODEV) {
+		fprintf(stderr, "Error: '%s' does not apply to %s with %s\n", cmd,
+			amp_model_name(b), effect_name(b));
+		return -EINVAL;
+	}
+	if (op < 0) {
+		fprintf(stderr, "Error: unknown command '%s'\n", cmd);
+		return -EINVAL;
+	}
+
+	err = set_cc_bank_op(b, op, strtol(arg, NULL, 0), cc);
+	if (err == -EINVAL)
+		fprintf(stderr, "Error: '%s' has no MIDI controller\n", cmd);
+	else if (err)
+		fprintf(stderr, "Error: value out of range for '%s': %s\n", cmd, arg);
+
+	return err;
+}
+
+/*
+ * Applies a controller change to b as the device would. Returns the index
+ * of the attribute changed, -ENOENT if the controller is not one of them
+ * for b's effect, or -ERANGE.
+ */
+int bank_apply_cc(struct bank *b, int cc, int val)
+{
+	int i, cur;
+
+	for (i = 0; i < lengthof(bank_ops); i++) {
+		struct bank_op *p = &bank_ops[i];
+
+		if ((p->cc != cc && p->cc_fine != cc) || !p->cc || !bank_op_applies(p, b))
+			continue;
+
+		if (p->set == bank_set_be16) {
+			cur = p->get(p, b) * 0x3fff / p->max;
+			if (cc == p->cc)
+				cur = (val << 7) | (cur & 0x7f);
+			else
+				cur = (cur & ~0x7f) | val;
+			val = (cur * p->max + 0x1fff) / 0x3fff;
+			if (val < p->min)
+				val = p->min;
+		} else if (p->type == OP_SWITCH && p->max == 1) {
+			val = val >= 0x40;
+		} else if (p->type == OP_KNOB && p->max < 0x40) {
+			val = (val * p->max + 0x3f) / 0x7f;
+		}
+
+		return p->set(p, b, val) ? -ERANGE : i;
+	}
+
+	return -ENOENT;
+}
+
+const char *bank_op_name(int op)
+{
+	return bank_ops[op].name;
+}
+
+int bank_op_count()
+{
+	return lengthof(bank_ops);
+}
+
+/* Gets attribute op of b scaled like set takes it; -ENODEV if it does not apply to b */
+int get_scaled_bank_op(struct bank *b, int op, int *val)
+{
+	struct bank_op *p = &bank_ops[op];
+
+	if (!bank_op_applies(p, b))
+		return -ENODEV;
+
+	*val = p->getp ? p->getp(p, b) : p->get(p, b);
+
+	return 0;
+}
+
+/* Formats attribute op of b as name=value, scaled like set takes it */
+int sprint_bank_op(char *buf, size_t size, struct bank *b, int op)
+{
+	struct bank_op *p = &bank_ops[op];
+
+	return snprintf(buf, size, "%s=%d", p->name, p->getp ? p->getp(p, b) : p->get(p, b));
+}
+
+/* Formats the attributes in effect for b as space separated name=value */
+int sprint_bank(char *buf, size_t size, struct bank *b)
+{
+	int i, n = 0;
+
+	for (i = 0; i < lengthof(bank_ops); i++) {
+		if (!bank_op_applies(&bank_ops[i], b))
+			continue;
+
+		n += snprintf(buf + n, (n < size) ? size - n : 0, n ? " " : "");
+		n += sprint_bank_op(buf + n, (n < size) ? size - n : 0, b, i);
+	}
+
+	return n;
+}
+
+/*
+ * Blends banks a and b into out at pos (0: a, 1000: b). Switches take
+ * a's setting below threshold and b's from there on. Knobs with a
+ * transform blend their scaled values; the rest blend device values,
+ * which scale linearly anyway and keep both ends exact. Knobs that
+ * depend on the effect or amp are only blended if both banks have them,
+ * and otherwise keep the value of the bank whose switches out has.
+ */
+void morph_bank(struct bank *out, struct bank *a, struct bank *b, int pos, int threshold)
+{
+	int i, va, vb;
+
+	*out = (pos >= threshold) ? *b : *a;
+
+	for (i = 0; i < lengthof(bank_ops); i++) {
+		struct bank_op *p = &bank_ops[i];
+
+		if (p->type != OP_KNOB || !bank_op_applies(p, a) || !bank_op_applies(p, b))
+			continue;
+
+		if (p->xfrm) {
+			va = p->getp(p, a);
+			vb = p->getp(p, b);
+			p->setp(p, out, va + (vb - va) * pos / 1000);
+		} else {
+			va = p->get(p, a);
+			vb = p->get(p, b);
+			p->set(p, out, va + (vb - va) * pos / 1000);
+		}
+	}
+}
+
+/*
+ * Fills cc with the controller changes that turn device state from into
+ * to, at most max of them, and returns their number. Every attribute is
+ * sent if from is NULL or the amp or effect changes, as the device may
+ * have reset the others with it.
+ */
+int bank_diff_cc(struct bank *from, struct bank *to, struct bank_cc cc[], int max)
+{
+	bool all = !from || from->amp_model != to->amp_model || from->effect_type != to->effect_type;
+	int i, n = 0;
+
+	for (i = 0; i < lengthof(bank_ops) && n < max; i++) {
+		struct bank_op *p = &bank_ops[i];
+
+		if (!p->cc || !bank_op_applies(p, to))
+			continue;
+
+		if (!all && p->get(p, from) == p->get(p, to))
+			continue;
+
+		bank_op_cc(p, to, &cc[n++]);
+	}
+
+	return n;
+}
+
+/*
+ * Fills ops with the attributes that differ between a and b, at most max
+ * of them, and returns their number. An attribute that applies to only
+ * one of them differs; one that applies to neither is not looked at.
+ */
+int bank_diff_ops(struct bank *a, struct bank *b, int ops[], int max)
+{
+	bool in_a, in_b;
+	int i, n = 0;
+
+	for (i = 0; i < lengthof(bank_ops) && n < max; i++) {
+		struct bank_op *p = &bank_ops[i];
+
+		in_a = bank_op_applies(p, a);
+		in_b = bank_op_applies(p, b);
+		if (!in_a && !in_b)
+			continue;
+
+		if (in_a && in_b && p->get(p, a) == p->get(p, b))
+			continue;
+
+		ops[n++] = i;
+	}
+
+	return n;
+}
+
+int set_bank_name(struct bank *b, const char *s)
+{
+	size_t slen = strlen(s);
+
+	if (slen > BANK_NAME_LEN)
+		return -EINVAL;
+
+	memset(b->bank_name, ' ', BANK_NAME_LEN);
+	memcpy(b->bank_name, s, slen);
+
+	return 0;
 }
 
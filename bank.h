@@ -25,6 +25,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 /* Bank settings may depend on the selected effect and amp model */
 #define EFFECT_MASK	0x77
@@ -126,13 +127,53 @@ void print_bank_ops();
 void print_bank_bytes(unsigned char *b);
 void print_bank_ubytes(unsigned char *b);
 
+/* Output formats (--format) */
+enum { FORMAT_TEXT, FORMAT_JSON, FORMAT_CSV, FORMAT_TSV };
+int format_strton(const char *s);
+int sprint_bank_header(char *buf, size_t size, int fmt);
+int sprint_bank_fmt(char *buf, size_t size, int fmt, const char *source, int n, struct bank *b);
+int sprint_bank_ops_header(char *buf, size_t size, int fmt);
+int sprint_bank_op_fmt(char *buf, size_t size, int fmt, int op);
+
 const char *amp_model_name(struct bank *b);
 const char *effect_name(struct bank *b);
 const char *cabinet_name(struct bank *b);
 const char *compression_ratio_name(struct bank *b);
 
-void set_direct_bank_param(struct bank *b, const char *cmd, const char *arg);
-void set_scaled_bank_param(struct bank *b, const char *cmd, const char *arg);
+int set_direct_bank_param(struct bank *b, const char *cmd, const char *arg);
+int set_scaled_bank_param(struct bank *b, const char *cmd, const char *arg);
+int set_bank_name(struct bank *b, const char *s);
+char *bank_name_str(char *s, struct bank *b);
+
+/* Control changes that make an attribute edit live on the device */
+#define BANK_CC_MAX	2
+struct bank_cc {
+	int n;
+	unsigned char cc[BANK_CC_MAX];
+	unsigned char val[BANK_CC_MAX];
+};
+
+int bank_op_lookup(struct bank *b, const char *cmd, bool effect_known);
+int set_scaled_bank_op(struct bank *b, int op, int val);
+bool bank_op_dependent(int op);
+const char *bank_op_units(int op);
+int bank_op_switch(int op, const char *label);
+int set_cc_bank_op(struct bank *b, int op, int val, struct bank_cc *cc);
+int set_cc_bank_op_pos(struct bank *b, int op, int pos, struct bank_cc *cc);
+int set_cc_bank_param(struct bank *b, const char *cmd, const char *arg, bool effect_known,
+		      struct bank_cc *cc);
+int bank_apply_cc(struct bank *b, int cc, int val);
+const char *bank_op_name(int op);
+int bank_op_count();
+int get_scaled_bank_op(struct bank *b, int op, int *val);
+int sprint_bank_op(char *buf, size_t size, struct bank *b, int op);
+int sprint_bank(char *buf, size_t size, struct bank *b);
+
+/* At most one control change set per attribute */
+#define BANK_OPS_MAX	64
+void morph_bank(struct bank *out, struct bank *a, struct bank *b, int pos, int threshold);
+int bank_diff_cc(struct bank *from, struct bank *to, struct bank_cc cc[], int max);
+int bank_diff_ops(struct bank *a, struct bank *b, int ops[], int max);
 	
 int bank_strton(const char *s);
 const char *bank_ntostr(int n);
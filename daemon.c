@@ -0,0 +1,510 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  Daemon
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "pod6ctl.h"
+#include "daemon.h"
+
+/*
+ * A request is one SOCK_SEQPACKET message: the header, the client's
+ * working directory and its argv as NUL-terminated strings, with the
+ * client's stdin, stdout and stderr attached as SCM_RIGHTS. The reply is
+ * the exit status as an int32_t.
+ */
+#define DAEMON_REQ_MAX	4096
+#define DAEMON_QUEUE	32
+#define DAEMON_ARGS	64
+#define DAEMON_RECV_MS	500	/* Time a new connection has to send its request */
+#define DAEMON_KILL_MS	1000	/* Time a request child has to stop before SIGKILL */
+
+struct daemon_hdr {
+	uint32_t argc;
+	uint32_t flags;
+};
+
+struct daemon_req {
+	int fd;			/* Connection */
+	int stdfds[3];
+	int flags;
+	int argc;
+	char *argv[DAEMON_ARGS + 1];
+	char *cwd;
+	char buf[DAEMON_REQ_MAX];
+};
+
+static struct daemon_req *queue[DAEMON_QUEUE];
+static int queued;
+
+static volatile sig_atomic_t terminate;
+
+/*
+ * The socket is in $XDG_RUNTIME_DIR, or else in /tmp/pod6ctl-<uid>, which
+ * the daemon creates and both ends only use while it is the user's own
+ * directory and closed to everyone else. Returns -1 if it is not.
+ */
+static int daemon_sock_path(char *path, size_t len, const char *port_name, bool create)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	char pname[64], priv[32];
+	struct stat st;
+	int i;
+
+	if (!dir) {
+		snprintf(priv, sizeof(priv), "/tmp/" CLIENT_NAME "-%u", (unsigned int)getuid());
+		if (create && mkdir(priv, 0700) != 0 && errno != EEXIST)
+			return -1;
+		if (lstat(priv, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != getuid() ||
+		    (st.st_mode & 077)) {
+			debug("%s is not a private directory\n", priv);
+			return -1;
+		}
+		dir = priv;
+	}
+
+	for (i = 0; port_name[i] && i < sizeof(pname) - 1; i++)
+		pname[i] = (port_name[i] == '/') ? '_' : port_name[i];
+	pname[i] = 0;
+
+	if (snprintf(path, len, "%s/" CLIENT_NAME "-%s.sock", dir, pname) >= len) {
+		*path = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int daemon_sock(const char *port_name, struct sockaddr_un *sun, bool create)
+{
+	memset(sun, 0, sizeof(*sun));
+	sun->sun_family = AF_UNIX;
+	if (daemon_sock_path(sun->sun_path, sizeof(sun->sun_path), port_name, create) < 0)
+		return -1;
+
+	return socket(AF_UNIX, SOCK_SEQPACKET, 0);
+}
+
+/* Whether the other end of a connection runs as this user */
+static bool daemon_peer_ok(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || cred.uid != getuid()) {
+		debug("rejecting a peer of another user\n");
+		return false;
+	}
+
+	return true;
+}
+
+static void daemon_close(struct daemon_req *req)
+{
+	int i;
+
+	for (i = 0; i < 3; i++)
+		close(req->stdfds[i]);
+	close(req->fd);
+}
+
+static void daemon_reply(struct daemon_req *req, int32_t status)
+{
+	if (send(req->fd, &status, sizeof(status), 0) != sizeof(status))
+		debug("reply to client failed (errno %d)\n", errno);
+
+	daemon_close(req);
+	free(req);
+}
+
+/*
+ * Takes the descriptors that came with a request: the first three are
+ * its stdin, stdout and stderr, any others are closed. Returns how many
+ * there were.
+ */
+static int daemon_fds(struct msghdr *msg, int stdfds[3])
+{
+	struct cmsghdr *cmsg;
+	int i, n, fd, nr = 0;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (i = 0; i < n; i++, nr++) {
+			memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			if (nr < 3)
+				stdfds[nr] = fd;
+			else
+				close(fd);
+		}
+	}
+
+	return nr;
+}
+
+/*
+ * Reads a request from a new connection; returns NULL if it is malformed
+ * or does not arrive within DAEMON_RECV_MS, so that a client that sends
+ * nothing cannot hold up the others.
+ */
+static struct daemon_req *daemon_recv(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct daemon_req *req;
+	struct daemon_hdr hdr;
+	char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+	struct iovec iov[2];
+	struct msghdr msg = { 0 };
+	ssize_t len;
+	char *p, *end;
+	int i, nfds;
+
+	req = calloc(1, sizeof(*req));
+	if (!req)
+		return NULL;
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = req->buf;
+	iov[1].iov_len = sizeof(req->buf) - 1;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	if (poll(&pfd, 1, DAEMON_RECV_MS) <= 0) {
+		debug("dropping a client that sent no request\n");
+		goto fail;
+	}
+
+	len = recvmsg(fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (len < 0)
+		goto fail;
+
+	/* Whatever descriptors arrived are ours to close, even if the request is bad */
+	nfds = daemon_fds(&msg, req->stdfds);
+	if (nfds != 3 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+	    len < (ssize_t)sizeof(hdr) || hdr.argc == 0 || hdr.argc > DAEMON_ARGS)
+		goto fail_fds;
+
+	req->fd = fd;
+	req->flags = hdr.flags;
+	req->argc = hdr.argc;
+
+	p = req->buf;
+	end = req->buf + len - sizeof(hdr);
+	*end = 0;
+
+	req->cwd = p;
+	p += strlen(p) + 1;
+	for (i = 0; i < req->argc; i++) {
+		if (p >= end)
+			goto fail_fds;
+		req->argv[i] = p;
+		p += strlen(p) + 1;
+	}
+
+	return req;
+
+fail_fds:
+	for (i = 0; i < nfds && i < 3; i++)
+		close(req->stdfds[i]);
+fail:
+	free(req);
+	return NULL;
+}
+
+/* Queues every connection already waiting on the listening socket */
+static void daemon_accept(int lfd)
+{
+	struct daemon_req *req;
+	int fd;
+
+	while (queued < DAEMON_QUEUE) {
+		fd = accept(lfd, NULL, NULL);
+		if (fd < 0)
+			break;
+
+		if (!daemon_peer_ok(fd)) {
+			close(fd);
+			continue;
+		}
+
+		req = daemon_recv(fd);
+		if (!req) {
+			close(fd);
+			continue;
+		}
+
+		queue[queued++] = req;
+	}
+}
+
+/*
+ * Runs a request in a child that inherits the device session. The child
+ * keeps no descriptors of the queued requests, and only the client's
+ * stdin, stdout and stderr of its own, so that a client's pipes see EOF
+ * once its own request is done.
+ *
+ * A request lives no longer than its client: if the client goes away
+ * (e.g. interrupted during monitor or route), or the daemon is told to
+ * terminate, the child gets SIGTERM, and SIGKILL if it does not stop.
+ * SIGCHLD, SIGINT and SIGTERM are only let in while waiting in ppoll(),
+ * so none of them is missed between the checks and the wait.
+ */
+static int32_t daemon_exec(struct daemon_req *req, int lfd, int (*exec)(int argc, char *argv[]))
+{
+	struct pollfd pfd = { .fd = req->fd, .events = POLLIN };
+	struct timespec grace = { DAEMON_KILL_MS / 1000, (DAEMON_KILL_MS % 1000) * 1000000 };
+	sigset_t block, orig;
+	bool killed = false;
+	pid_t pid, done;
+	int i, n, status;
+
+	fflush(stdout);
+	fflush(stderr);
+
+	sigemptyset(&block);
+	sigaddset(&block, SIGCHLD);
+	sigaddset(&block, SIGINT);
+	sigaddset(&block, SIGTERM);
+	sigprocmask(SIG_BLOCK, &block, &orig);
+
+	pid = fork();
+	if (pid < 0) {
+		sigprocmask(SIG_SETMASK, &orig, NULL);
+		return 1;
+	}
+
+	if (pid == 0) {
+		close(lfd);
+		close(req->fd);
+		for (i = 0; i < queued; i++)
+			daemon_close(queue[i]);
+		for (i = 0; i < 3; i++)
+			dup2(req->stdfds[i], i);
+		for (i = 0; i < 3; i++) {
+			if (req->stdfds[i] > 2)
+				close(req->stdfds[i]);
+		}
+		signal(SIGPIPE, SIG_DFL);
+		signal(SIGINT, SIG_DFL);
+		signal(SIGTERM, SIG_DFL);
+		signal(SIGCHLD, SIG_DFL);
+		sigprocmask(SIG_SETMASK, &orig, NULL);
+		if (chdir(req->cwd) != 0)
+			info("Warning: cannot change directory to %s\n", req->cwd);
+
+		status = exec(req->argc, req->argv);
+		fflush(stdout);
+		fflush(stderr);
+		_exit(status);
+	}
+
+	while ((done = waitpid(pid, &status, WNOHANG)) == 0) {
+		if (!killed && (terminate || pfd.revents)) {
+			debug("%s, stopping the request\n", terminate ? "Terminating" : "Client gone");
+			kill(pid, SIGTERM);
+			killed = true;
+		}
+
+		pfd.revents = 0;
+		n = ppoll(&pfd, killed ? 0 : 1, killed ? &grace : NULL, &orig);
+		if ((n == 0 && killed) || (n < 0 && errno != EINTR)) {
+			kill(pid, SIGKILL);
+			killed = true;
+		}
+	}
+
+	sigprocmask(SIG_SETMASK, &orig, NULL);
+
+	return (done == pid && !killed && WIFEXITED(status)) ? WEXITSTATUS(status) : 1;
+}
+
+static void daemon_sig(int sig)
+{
+	terminate = 1;
+}
+
+/* Only there to wake ppoll() in daemon_exec() when a request child exits */
+static void daemon_chld(int sig)
+{
+}
+
+void daemon_serve(const char *port_name, int (*exec)(int argc, char *argv[]))
+{
+	struct sockaddr_un sun;
+	struct sigaction sa = { .sa_handler = daemon_sig };
+	struct sigaction sa_chld = { .sa_handler = daemon_chld };
+	struct pollfd pfd;
+	struct daemon_req *req;
+	mode_t mask;
+	int lfd, i, err;
+
+	lfd = daemon_sock(port_name, &sun, true);
+	EXIT_ON(lfd < 0 && !*sun.sun_path, "No usable location for the daemon socket (see -D)\n");
+	EXIT_ON(lfd < 0, "Error creating socket (errno %d)\n", errno);
+
+	/* A socket that accepts connections belongs to a live daemon */
+	EXIT_ON(connect(lfd, (struct sockaddr *)&sun, sizeof(sun)) == 0,
+		"A daemon is already serving %s (%s)\n", port_name, sun.sun_path);
+	close(lfd);
+	unlink(sun.sun_path);
+
+	lfd = daemon_sock(port_name, &sun, true);
+	EXIT_ON(lfd < 0, "Error creating socket (errno %d)\n", errno);
+
+	/* Only the user may connect */
+	mask = umask(077);
+	err = bind(lfd, (struct sockaddr *)&sun, sizeof(sun));
+	umask(mask);
+	EXIT_ON(err, "Error binding %s (errno %d)\n", sun.sun_path, errno);
+	err = chmod(sun.sun_path, 0600);
+	EXIT_ON(err, "Error setting the mode of %s (errno %d)\n", sun.sun_path, errno);
+	err = listen(lfd, DAEMON_QUEUE);
+	EXIT_ON(err, "Error listening on %s (errno %d)\n", sun.sun_path, errno);
+	fcntl(lfd, F_SETFL, O_NONBLOCK);
+
+	signal(SIGPIPE, SIG_IGN);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	sigaction(SIGCHLD, &sa_chld, NULL);
+
+	info("Serving %s on %s\n", port_name, sun.sun_path);
+
+	pfd.fd = lfd;
+	pfd.events = POLLIN;
+
+	while (!terminate) {
+		if (queued == 0 && poll(&pfd, 1, -1) < 0)
+			continue;
+
+		daemon_accept(lfd);
+		if (queued == 0)
+			continue;
+
+		req = queue[0];
+		queued--;
+		memmove(&queue[0], &queue[1], queued * sizeof(queue[0]));
+
+		/* Only the last of several queued program changes matters */
+		if (req->flags & DAEMON_COALESCE) {
+			for (i = 0; i < queued; i++) {
+				if (queue[i]->flags & DAEMON_COALESCE)
+					break;
+			}
+			if (i < queued) {
+				debug("coalescing request '%s'\n", req->argv[req->argc - 1]);
+				daemon_reply(req, 0);
+				continue;
+			}
+		}
+
+		daemon_reply(req, daemon_exec(req, lfd, exec));
+	}
+
+	for (i = 0; i < queued; i++)
+		daemon_reply(queue[i], 1);
+
+	close(lfd);
+	unlink(sun.sun_path);
+	info("Daemon for %s terminated\n", port_name);
+}
+
+int daemon_client(const char *port_name, int flags, int argc, char *argv[])
+{
+	struct sockaddr_un sun;
+	struct daemon_hdr hdr = { .argc = argc, .flags = flags };
+	char buf[DAEMON_REQ_MAX];
+	char cbuf[CMSG_SPACE(sizeof(int) * 3)];
+	int stdfds[3] = { 0, 1, 2 };
+	struct iovec iov[2];
+	struct msghdr msg = { 0 };
+	struct cmsghdr *cmsg;
+	size_t len, n;
+	int32_t status;
+	int fd, i;
+
+	fd = daemon_sock(port_name, &sun, false);
+	if (fd < 0)
+		return -1;
+
+	/* Only a daemon of this user gets the terminal */
+	if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) != 0 || !daemon_peer_ok(fd)) {
+		close(fd);
+		return -1;
+	}
+
+	if (!getcwd(buf, sizeof(buf)))
+		strcpy(buf, "/");
+	len = strlen(buf) + 1;
+
+	for (i = 0; i < argc; i++) {
+		n = strlen(argv[i]) + 1;
+		EXIT_ON(len + n > sizeof(buf), "Command line too long for the daemon\n");
+		memcpy(buf + len, argv[i], n);
+		len += n;
+	}
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	msg.msg_iov = iov;
+	msg.msg_iovlen = 2;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(stdfds));
+	memcpy(CMSG_DATA(cmsg), stdfds, sizeof(stdfds));
+
+	EXIT_ON(sendmsg(fd, &msg, 0) < 0, "Error sending request to daemon (errno %d)\n", errno);
+
+	if (recv(fd, &status, sizeof(status), 0) != sizeof(status)) {
+		info("Daemon for %s did not complete the request\n", port_name);
+		status = 1;
+	}
+
+	close(fd);
+
+	return status;
+}
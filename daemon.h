@@ -0,0 +1,39 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  Daemon
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef _POD6CTL_DAEMON_H
+#define _POD6CTL_DAEMON_H
+
+/* Request flags */
+#define DAEMON_COALESCE	0x01	/* Superseded by a later queued request with this flag */
+
+/*
+ * Serves requests for port_name until terminated. Each request runs
+ * exec(argc, argv) in a child that inherits the open device session and
+ * the client's stdin, stdout and stderr; its return value is the exit
+ * status reported to the client.
+ */
+void daemon_serve(const char *port_name, int (*exec)(int argc, char *argv[]));
+
+/* Returns the exit status of the request, or -1 if no daemon serves port_name */
+int daemon_client(const char *port_name, int flags, int argc, char *argv[]);
+
+#endif
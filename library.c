@@ -0,0 +1,425 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  Patch Library Index
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pod6ctl.h"
+#include "bank.h"
+#include "library.h"
+
+/*
+ * The index is a header followed by sections of fixed-size entries,
+ * each 8-byte aligned. Values are stored a column per attribute, so a
+ * query term reads one contiguous array however many attributes there
+ * are:
+ *
+ *   ops      uint32_t per attribute: its name (offset in strings)
+ *   files    uint32_t per save file: its path
+ *   where    uint32_t per bank: file << 8 | slot
+ *   names    BANK_NAME_LEN bytes per bank, NUL padded
+ *   cols     int16_t per attribute per bank: the value scaled like set
+ *            takes it, or LIB_NA if the attribute does not apply
+ *   strings  NUL-terminated
+ *
+ * The attribute names are part of the index, so an index stays readable
+ * when attributes are added.
+ */
+#define LIB_MAGIC	"P6LI"
+#define LIB_VERSION	1
+#define LIB_NA		INT16_MIN
+#define LIB_SAVE_SIZE	(sizeof(struct bank) * BANKS_NR)
+#define LIB_TERMS_MAX	32
+#define LIB_COLS_MAX	4	/* Attributes of the same name, for different effects */
+#define LIB_ALIGN(x)	(((x) + 7) & ~(uint64_t)7)
+
+struct lib_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t nops;
+	uint32_t nfiles;
+	uint32_t nbanks;
+	uint32_t strings_size;
+	uint64_t ops_off;
+	uint64_t files_off;
+	uint64_t where_off;
+	uint64_t names_off;
+	uint64_t cols_off;
+	uint64_t strings_off;
+};
+
+/*
+ * A term matches values in [lo, hi], or outside it if neg; banks the
+ * attribute does not apply to never match. For the bank name, text is
+ * matched whole (name=) or as a substring (name~).
+ */
+struct lib_term {
+	int lo;
+	int hi;
+	bool neg;
+	const char *text;
+	bool substr;
+	int ncols;
+	const int16_t *col[LIB_COLS_MAX];
+};
+
+static char **lib_files;
+static int lib_nfiles;
+static int lib_size;
+
+static int lib_walk(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	if (flag != FTW_F || !S_ISREG(st->st_mode) || st->st_size != LIB_SAVE_SIZE)
+		return 0;
+
+	if (lib_nfiles == lib_size) {
+		lib_size = lib_size ? lib_size * 2 : 256;
+		lib_files = realloc(lib_files, lib_size * sizeof(*lib_files));
+		EXIT_ON(lib_files == NULL, "%s: out of memory\n", __func__);
+	}
+
+	lib_files[lib_nfiles] = strdup(path);
+	EXIT_ON(lib_files[lib_nfiles] == NULL, "%s: out of memory\n", __func__);
+	lib_nfiles++;
+
+	return 0;
+}
+
+static int lib_path_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Pads a section of size bytes to the next one */
+static void lib_pad(FILE *f, uint64_t size)
+{
+	static const char pad[8];
+
+	EXIT_ON(LIB_ALIGN(size) > size && fwrite(pad, LIB_ALIGN(size) - size, 1, f) != 1,
+		"Error writing index (errno %d)\n", errno);
+}
+
+static void lib_write(FILE *f, const void *p, uint64_t size)
+{
+	EXIT_ON(size && fwrite(p, size, 1, f) != 1, "Error writing index (errno %d)\n", errno);
+	lib_pad(f, size);
+}
+
+int library_index(const char *index_file, char *dirs[])
+{
+	struct lib_header h = { .magic = LIB_MAGIC, .version = LIB_VERSION };
+	struct bank banks[BANKS_NR];
+	char root[PATH_MAX], tmp[PATH_MAX], name[BANK_NAME_LEN + 1];
+	uint32_t *ops_str, *files_str, *where;
+	char *names, *strings;
+	int16_t *cols;
+	size_t cap, len;
+	int i, n, op, fd, val;
+	FILE *f;
+
+	for (; *dirs; dirs++) {
+		EXIT_ON(!realpath(*dirs, root), "Error reading %s (errno %d)\n", *dirs, errno);
+		EXIT_ON(nftw(root, lib_walk, 16, FTW_PHYS) != 0, "Error reading %s (errno %d)\n",
+			root, errno);
+	}
+	qsort(lib_files, lib_nfiles, sizeof(*lib_files), lib_path_cmp);
+
+	h.nops = bank_op_count();
+	cap = (size_t)lib_nfiles * BANKS_NR;
+	ops_str = calloc(h.nops, sizeof(*ops_str));
+	files_str = calloc(lib_nfiles + 1, sizeof(*files_str));
+	where = calloc(cap + 1, sizeof(*where));
+	names = calloc(cap + 1, BANK_NAME_LEN);
+	cols = calloc(cap * h.nops + 1, sizeof(*cols));
+	EXIT_ON(!ops_str || !files_str || !where || !names || !cols, "%s: out of memory\n", __func__);
+
+	for (i = 0; i < lib_nfiles; i++) {
+		fd = open(lib_files[i], O_RDONLY);
+		len = (fd < 0) ? 0 : read(fd, banks, sizeof(banks));
+		if (fd >= 0)
+			close(fd);
+		if (len != sizeof(banks)) {
+			info("Skipping %s: cannot read it\n", lib_files[i]);
+			free(lib_files[i]);
+			continue;
+		}
+
+		lib_files[h.nfiles] = lib_files[i];
+		for (n = 0; n < BANKS_NR; n++) {
+			where[h.nbanks] = h.nfiles << 8 | n;
+
+			bank_name_str(name, &banks[n]);
+			for (len = strlen(name); len > 0 && name[len - 1] == ' '; len--)
+				name[len - 1] = 0;
+			memcpy(names + (size_t)h.nbanks * BANK_NAME_LEN, name, BANK_NAME_LEN);
+
+			for (op = 0; op < h.nops; op++) {
+				if (get_scaled_bank_op(&banks[n], op, &val) < 0)
+					val = LIB_NA;
+				cols[op * cap + h.nbanks] = val;
+			}
+			h.nbanks++;
+		}
+		h.nfiles++;
+	}
+
+	len = 0;
+	for (op = 0; op < h.nops; op++)
+		len += strlen(bank_op_name(op)) + 1;
+	for (i = 0; i < h.nfiles; i++)
+		len += strlen(lib_files[i]) + 1;
+	strings = malloc(len + 1);
+	EXIT_ON(strings == NULL, "%s: out of memory\n", __func__);
+
+	for (op = 0; op < h.nops; op++) {
+		ops_str[op] = h.strings_size;
+		h.strings_size += sprintf(strings + h.strings_size, "%s", bank_op_name(op)) + 1;
+	}
+	for (i = 0; i < h.nfiles; i++) {
+		files_str[i] = h.strings_size;
+		h.strings_size += sprintf(strings + h.strings_size, "%s", lib_files[i]) + 1;
+	}
+
+	h.ops_off = LIB_ALIGN(sizeof(h));
+	h.files_off = h.ops_off + LIB_ALIGN(h.nops * sizeof(*ops_str));
+	h.where_off = h.files_off + LIB_ALIGN(h.nfiles * sizeof(*files_str));
+	h.names_off = h.where_off + LIB_ALIGN(h.nbanks * sizeof(*where));
+	h.cols_off = h.names_off + LIB_ALIGN((uint64_t)h.nbanks * BANK_NAME_LEN);
+	h.strings_off = h.cols_off + LIB_ALIGN((uint64_t)h.nops * h.nbanks * sizeof(*cols));
+
+	/* Searches running meanwhile keep reading the old index */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", index_file);
+	f = fopen(tmp, "w");
+	EXIT_ON(f == NULL, "Error creating %s (errno %d)\n", tmp, errno);
+
+	lib_write(f, &h, sizeof(h));
+	lib_write(f, ops_str, h.nops * sizeof(*ops_str));
+	lib_write(f, files_str, h.nfiles * sizeof(*files_str));
+	lib_write(f, where, h.nbanks * sizeof(*where));
+	lib_write(f, names, (uint64_t)h.nbanks * BANK_NAME_LEN);
+	for (op = 0; op < h.nops; op++)
+		EXIT_ON(h.nbanks && fwrite(cols + op * cap, sizeof(*cols), h.nbanks, f) != h.nbanks,
+			"Error writing index (errno %d)\n", errno);
+	lib_pad(f, (uint64_t)h.nops * h.nbanks * sizeof(*cols));
+	lib_write(f, strings, h.strings_size);
+
+	EXIT_ON(fclose(f) != 0, "Error writing index (errno %d)\n", errno);
+	EXIT_ON(rename(tmp, index_file) != 0, "Error creating %s (errno %d)\n", index_file, errno);
+
+	for (i = 0; i < h.nfiles; i++)
+		free(lib_files[i]);
+	free(lib_files);
+	lib_files = NULL;
+	lib_nfiles = lib_size = 0;
+	free(ops_str);
+	free(files_str);
+	free(where);
+	free(names);
+	free(cols);
+	free(strings);
+
+	return h.nbanks;
+}
+
+struct lib_index {
+	const struct lib_header *h;
+	const char *base;
+	size_t size;
+};
+
+/* A string in the index, or NULL if off is out of it */
+static const char *lib_string(struct lib_index *x, uint32_t off)
+{
+	return (off < x->h->strings_size) ? x->base + x->h->strings_off + off : NULL;
+}
+
+static void lib_open(struct lib_index *x, const char *index_file)
+{
+	const struct lib_header *h;
+	struct stat st;
+	int fd;
+
+	fd = open(index_file, O_RDONLY);
+	EXIT_ON(fd < 0, "Error reading %s (errno %d); run library index first\n", index_file, errno);
+	EXIT_ON(fstat(fd, &st) != 0, "Error reading %s (errno %d)\n", index_file, errno);
+	x->size = st.st_size;
+	EXIT_ON(x->size < sizeof(*h), "%s: not a library index\n", index_file);
+
+	x->base = mmap(NULL, x->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	EXIT_ON(x->base == MAP_FAILED, "Error mapping %s (errno %d)\n", index_file, errno);
+
+	x->h = h = (const struct lib_header *)x->base;
+	EXIT_ON(memcmp(h->magic, LIB_MAGIC, sizeof(h->magic)) != 0 || h->version != LIB_VERSION,
+		"%s: not a library index (or from another version; index again)\n", index_file);
+	EXIT_ON(h->ops_off + h->nops * sizeof(uint32_t) > x->size ||
+		h->files_off + h->nfiles * sizeof(uint32_t) > x->size ||
+		h->where_off + h->nbanks * sizeof(uint32_t) > x->size ||
+		h->names_off + (uint64_t)h->nbanks * BANK_NAME_LEN > x->size ||
+		h->cols_off + (uint64_t)h->nops * h->nbanks * sizeof(int16_t) > x->size ||
+		h->strings_off + h->strings_size > x->size || h->strings_size == 0 ||
+		x->base[h->strings_off + h->strings_size - 1] != 0,
+		"%s: truncated or damaged; index again\n", index_file);
+}
+
+/* Parses attr=value, attr!=value, attr<value, attr<=value, attr>value, attr>=value or name~text */
+static void lib_term(struct lib_index *x, struct lib_term *t, char *s)
+{
+	const uint32_t *ops = (const uint32_t *)(x->base + x->h->ops_off);
+	char *cmp = strpbrk(s, "=!<>~"), *val, *end;
+	const char *name;
+	int op, v;
+
+	EXIT_ON(!cmp || cmp == s, "Invalid term '%s': expected attr=value, attr>value, ...\n", s);
+
+	val = cmp + 1;
+	if (*val == '=' && *cmp != '=' && *cmp != '~')
+		val++;
+
+	memset(t, 0, sizeof(*t));
+	if (cmp - s == 4 && strncmp(s, "name", 4) == 0) {
+		EXIT_ON(*cmp != '=' && *cmp != '~', "name takes name=text or name~text\n");
+		t->text = val;
+		t->substr = (*cmp == '~');
+		return;
+	}
+
+	v = strtol(val, &end, 0);
+	EXIT_ON(end == val || *end, "Invalid value in '%s'\n", s);
+
+	t->lo = LIB_NA + 1;
+	t->hi = INT16_MAX;
+	switch (*cmp) {
+	case '=':
+		t->lo = t->hi = v;
+		break;
+	case '!':
+		EXIT_ON(val == cmp + 1, "Invalid term '%s': expected !=\n", s);
+		t->lo = t->hi = v;
+		t->neg = true;
+		break;
+	case '<':
+		t->hi = (val == cmp + 1) ? v - 1 : v;
+		break;
+	case '>':
+		t->lo = (val == cmp + 1) ? v + 1 : v;
+		break;
+	default:
+		EXIT_ON(true, "Invalid term '%s': ~ is for the name\n", s);
+	}
+
+	*cmp = 0;
+	for (op = 0; op < x->h->nops; op++) {
+		name = lib_string(x, ops[op]);
+		if (!name || strcmp(name, s) != 0)
+			continue;
+
+		EXIT_ON(t->ncols == LIB_COLS_MAX, "%s: too many attributes by that name\n", s);
+		t->col[t->ncols++] = (const int16_t *)(x->base + x->h->cols_off) +
+				     (size_t)op * x->h->nbanks;
+	}
+	EXIT_ON(t->ncols == 0, "Unknown attribute '%s' (see attr)\n", s);
+}
+
+static bool lib_match(struct lib_index *x, const struct lib_term *t, uint32_t i)
+{
+	const char *names = x->base + x->h->names_off;
+	char name[BANK_NAME_LEN + 1];
+	int c, v = LIB_NA;
+
+	if (t->text) {
+		memcpy(name, names + (size_t)i * BANK_NAME_LEN, BANK_NAME_LEN);
+		name[BANK_NAME_LEN] = 0;
+		return t->substr ? strstr(name, t->text) != NULL : strcmp(name, t->text) == 0;
+	}
+
+	for (c = 0; c < t->ncols && v == LIB_NA; c++)
+		v = t->col[c][i];
+
+	if (v == LIB_NA)
+		return false;
+
+	return (v >= t->lo && v <= t->hi) != t->neg;
+}
+
+/*
+ * Terms are applied one at a time: the first scans its column whole
+ * and leaves the matching banks, each later one narrows them down.
+ */
+int library_search(const char *index_file, char *terms[])
+{
+	struct lib_term t[LIB_TERMS_MAX];
+	struct lib_index x;
+	const uint32_t *files, *where;
+	uint32_t *sel, i;
+	int nterms = 0, n, k, j;
+	const char *path;
+
+	lib_open(&x, index_file);
+	files = (const uint32_t *)(x.base + x.h->files_off);
+	where = (const uint32_t *)(x.base + x.h->where_off);
+
+	for (; *terms; terms++) {
+		EXIT_ON(nterms == LIB_TERMS_MAX, "Too many terms (at most %d)\n", LIB_TERMS_MAX);
+		lib_term(&x, &t[nterms++], *terms);
+	}
+
+	sel = malloc((x.h->nbanks + 1) * sizeof(*sel));
+	EXIT_ON(sel == NULL, "%s: out of memory\n", __func__);
+
+	n = 0;
+	for (i = 0; i < x.h->nbanks; i++) {
+		if (!nterms || lib_match(&x, &t[0], i))
+			sel[n++] = i;
+	}
+
+	for (k = 1; k < nterms; k++) {
+		for (j = i = 0; j < n; j++) {
+			if (lib_match(&x, &t[k], sel[j]))
+				sel[i++] = sel[j];
+		}
+		n = i;
+	}
+
+	for (j = 0; j < n; j++) {
+		i = sel[j];
+		path = (where[i] >> 8 < x.h->nfiles) ? lib_string(&x, files[where[i] >> 8]) : NULL;
+		printf("%s %s \"%.*s\"\n", path ? path : "?", bank_ntostr(where[i] & 0xff),
+		       BANK_NAME_LEN, x.base + x.h->names_off + (size_t)i * BANK_NAME_LEN);
+	}
+
+	free(sel);
+	munmap((void *)x.base, x.size);
+
+	return n;
+}
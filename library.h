@@ -0,0 +1,37 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  Patch Library Index
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef _POD6CTL_LIBRARY_H
+#define _POD6CTL_LIBRARY_H
+
+/*
+ * Finds the save files under the directories and writes the index of
+ * their banks to index_file. Returns the number of banks indexed.
+ */
+int library_index(const char *index_file, char *dirs[]);
+
+/*
+ * Prints the banks in index_file that match all terms (attr=value,
+ * attr>value, name~text, ...). Returns the number of banks printed.
+ */
+int library_search(const char *index_file, char *terms[]);
+
+#endif
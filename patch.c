@@ -0,0 +1,266 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  Text Patch Compiler
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "pod6ctl.h"
+#include "bank.h"
+#include "patch.h"
+
+/*
+ * A patch is text of '[bank]' lines, each followed by 'attr = value'
+ * lines for that bank; '#' starts a comment:
+ *
+ *   [2B]
+ *   name = "Crunch"
+ *   amp_model = "Brit Class A #3"    # a switch by its setting, or number
+ *   drive = 70%                      # units are optional, but must match
+ *   delay_time = 350ms
+ *   gate_threshold = -40dB
+ *
+ * The file is mapped and scanned once; settings are kept as slices of
+ * it until their bank ends. Then the ones that apply whatever the effect
+ * are set first, so that those depending on effect_type or amp_model
+ * are checked against the bank's final effect and amp whatever their
+ * order in the file.
+ */
+#define PATCH_SETTINGS_MAX	BANK_OPS_MAX
+#define PATCH_TOKEN_MAX		64
+
+struct patch_setting {
+	const char *key;
+	int klen;
+	const char *val;
+	int vlen;
+	bool quoted;
+	int line;
+};
+
+struct patch {
+	const char *file_name;
+	struct bank *b;
+	int bank;
+	struct patch_setting s[PATCH_SETTINGS_MAX];
+	int n;
+};
+
+/* Copies a slice to a NUL-terminated token */
+static const char *patch_token(char *buf, const char *s, int len)
+{
+	if (len > PATCH_TOKEN_MAX - 1)
+		len = PATCH_TOKEN_MAX - 1;
+	memcpy(buf, s, len);
+	buf[len] = 0;
+
+	return buf;
+}
+
+static void patch_set(struct patch *pt, struct patch_setting *s, int op)
+{
+	char key[PATCH_TOKEN_MAX], val[PATCH_TOKEN_MAX], *end;
+	const char *units = bank_op_units(op);
+	int v, err;
+
+	patch_token(key, s->key, s->klen);
+	patch_token(val, s->val, s->vlen);
+
+	if (s->quoted) {
+		v = bank_op_switch(op, val);
+		EXIT_ON(v == -EINVAL, "%s:%d: %s takes a number\n", pt->file_name, s->line, key);
+		EXIT_ON(v < 0, "%s:%d: %s has no setting \"%s\" (see attr -v)\n", pt->file_name,
+			s->line, key, val);
+	} else {
+		v = strtol(val, &end, 0);
+		EXIT_ON(end == val, "%s:%d: invalid value '%s' for %s\n", pt->file_name, s->line, val,
+			key);
+		EXIT_ON(*end && strcmp(end, units) != 0, "%s:%d: %s is in %s, not '%s'\n",
+			pt->file_name, s->line, key, *units ? units : "plain numbers", end);
+	}
+
+	err = set_scaled_bank_op(pt->b, op, v);
+	EXIT_ON(err, "%s:%d: %s = %s is out of range (see attr -v)\n", pt->file_name, s->line, key,
+		val);
+}
+
+/* Sets the settings kept for the bank that ends */
+static void patch_end(struct patch *pt)
+{
+	char key[PATCH_TOKEN_MAX], name[PATCH_TOKEN_MAX];
+	struct patch_setting *s;
+	int pass, op;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (s = pt->s; s < pt->s + pt->n; s++) {
+			patch_token(key, s->key, s->klen);
+
+			if (strcmp(key, "name") == 0) {
+				if (pass == 0)
+					EXIT_ON(!s->quoted || s->vlen > BANK_NAME_LEN ||
+						set_bank_name(pt->b, patch_token(name, s->val, s->vlen)),
+						"%s:%d: name takes a quoted name of up to %d characters\n",
+						pt->file_name, s->line, BANK_NAME_LEN);
+				continue;
+			}
+
+			op = bank_op_lookup(pt->b, key, pass == 1);
+			EXIT_ON(op == -ENOENT, "%s:%d: unknown attribute '%s'\n", pt->file_name,
+				s->line, key);
+			if (pass == 0 && (op < 0 || bank_op_dependent(op)))
+				continue;
+			EXIT_ON(op < 0, "%s:%d: %s does not apply to %s with %s\n", pt->file_name,
+				s->line, key, amp_model_name(pt->b), effect_name(pt->b));
+			if (pass == 1 && !bank_op_dependent(op))
+				continue;
+
+			patch_set(pt, s, op);
+		}
+	}
+
+	pt->n = 0;
+}
+
+static bool patch_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static bool patch_key_char(char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+	       c == '_' || c == '.';
+}
+
+static void patch_bank(struct patch *pt, struct bank b[], bool defined[], int n, int line)
+{
+	EXIT_ON(n < 0 || n >= BANKS_NR, "%s:%d: invalid bank (1A - 9D)\n", pt->file_name, line);
+	EXIT_ON(defined[n], "%s:%d: bank %s is already defined\n", pt->file_name, line,
+		bank_ntostr(n));
+
+	defined[n] = true;
+	pt->bank = n;
+	pt->b = &b[n];
+}
+
+void patch_compile(const char *file_name, struct bank b[], bool defined[], int default_bank)
+{
+	struct patch pt = { .file_name = file_name, .bank = -1 };
+	struct patch_setting *s;
+	const char *map, *p, *end, *tok;
+	char buf[PATCH_TOKEN_MAX];
+	struct stat st;
+	int fd, line = 0, i;
+
+	fd = open(file_name, O_RDONLY);
+	EXIT_ON(fd < 0, "Error reading file: %s (errno %d)\n", file_name, errno);
+	EXIT_ON(fstat(fd, &st) != 0, "Error reading file: %s (errno %d)\n", file_name, errno);
+
+	map = NULL;
+	if (st.st_size > 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		EXIT_ON(map == MAP_FAILED, "Error mapping %s (errno %d)\n", file_name, errno);
+	}
+	close(fd);
+
+	p = map;
+	end = map + st.st_size;
+	while (p < end) {
+		line++;
+		while (p < end && patch_blank(*p))
+			p++;
+
+		if (p < end && *p == '[') {
+			for (tok = ++p; p < end && *p != ']' && *p != '\n'; p++)
+				;
+			EXIT_ON(p == end || *p != ']', "%s:%d: expected ']'\n", file_name, line);
+			if (pt.bank >= 0)
+				patch_end(&pt);
+			patch_bank(&pt, b, defined, bank_strton(patch_token(buf, tok, p - tok)), line);
+			p++;
+		} else if (p < end && patch_key_char(*p)) {
+			if (pt.bank < 0) {
+				EXIT_ON(default_bank < 0, "%s:%d: settings before the first [bank] (or use -b)\n",
+					file_name, line);
+				patch_bank(&pt, b, defined, default_bank, line);
+			}
+			EXIT_ON(pt.n == PATCH_SETTINGS_MAX, "%s:%d: too many settings for bank %s\n",
+				file_name, line, bank_ntostr(pt.bank));
+
+			s = &pt.s[pt.n];
+			s->line = line;
+			for (s->key = p; p < end && patch_key_char(*p); p++)
+				;
+			s->klen = p - s->key;
+
+			while (p < end && patch_blank(*p))
+				p++;
+			EXIT_ON(p == end || *p != '=', "%s:%d: expected attr = value\n", file_name, line);
+			p++;
+			while (p < end && patch_blank(*p))
+				p++;
+
+			s->quoted = (p < end && *p == '"');
+			if (s->quoted) {
+				for (s->val = ++p; p < end && *p != '"' && *p != '\n'; p++)
+					;
+				EXIT_ON(p == end || *p != '"', "%s:%d: unterminated string\n", file_name,
+					line);
+				s->vlen = p++ - s->val;
+			} else {
+				for (s->val = p; p < end && !patch_blank(*p) && *p != '#' && *p != '\n'; p++)
+					;
+				s->vlen = p - s->val;
+				EXIT_ON(s->vlen == 0, "%s:%d: missing value\n", file_name, line);
+			}
+
+			for (i = 0; i < pt.n; i++) {
+				EXIT_ON(pt.s[i].klen == s->klen && memcmp(pt.s[i].key, s->key, s->klen) == 0,
+					"%s:%d: %.*s is already set on line %d\n", file_name, line, s->klen,
+					s->key, pt.s[i].line);
+			}
+			pt.n++;
+		}
+
+		while (p < end && patch_blank(*p))
+			p++;
+		if (p < end && *p == '#') {
+			while (p < end && *p != '\n')
+				p++;
+		}
+		EXIT_ON(p < end && *p != '\n', "%s:%d: unexpected '%c'\n", file_name, line, *p);
+		p++;
+	}
+
+	if (pt.bank >= 0)
+		patch_end(&pt);
+
+	if (map)
+		munmap((void *)map, st.st_size);
+}
@@ -0,0 +1,36 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  Text Patch Compiler
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef _POD6CTL_PATCH_H
+#define _POD6CTL_PATCH_H
+
+
+#include <stdbool.h>
+
+/*
+ * Compiles the patch text in file_name into b, marking the banks it
+ * sets in defined. Settings before the first [bank] line go to bank
+ * default_bank, or are an error if it is negative. Exits on the first
+ * error, with its file and line.
+ */
+void patch_compile(const char *file_name, struct bank b[], bool defined[], int default_bank);
+
+#endif
@@ -18,7 +18,7 @@
  *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
  */
 
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,7 +27,13 @@
 #include <string.h>
 #include <signal.h>
 #include <getopt.h>
+#include <unistd.h>
+#include <time.h>
+#include <glob.h>
+#include <fnmatch.h>
 #include <sys/poll.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 
 #include <alsa/asoundlib.h>
 
@@ -35,16 +41,53 @@
 #include "rbuf.h"
 #include "bank.h"
 #include "sysex.h"
+#include "daemon.h"
+#include "transport.h"
+#include "library.h"
+#include "store.h"
+#include "patch.h"
 
 static char *port_name;
+static struct pod *pod;
+#define PORTS_MAX	64
+static char *ports[PORTS_MAX];
+static const char *port_desc[PORTS_MAX];
+static int nports;
 static bool overwrite = false;
 static int bank_n = -1;
+static bool restore_diff = false;
+static char *control_port;
+static int control_cc = 11;
+static int morph_threshold = 50;
+static char *diff_snapshot;
+static bool use_cache = false;
+static char *cache_file;
+static char *index_file;
+static char *store_dir;
+static char *base_file;
+static int output_format = FORMAT_TEXT;
 int nohello = false;
+static int nodaemon = false;
+int dump_depth = 4;
+int verify_policy = VERIFY_IMMEDIATE;
+int probe_timeout = 1000;
 bool debug_mode;
 bool verbose = false;
 
 #define REQUIRE_MIDI() do { EXIT_ON(port_name == NULL, "Please specify MIDI port (-p)\n"); } while (0)
 #define REQUIRE_BANK() do { EXIT_ON(bank_n < 0, "Please specify bank (1A - 9D) (-b)\n"); } while (0)
+#define lengthof(x) ((size_t)(sizeof(x) / sizeof(__typeof__(*x))))
+
+/* The device session is opened on first use and shared by the whole run */
+static struct pod *session()
+{
+	REQUIRE_MIDI();
+
+	if (!pod)
+		pod = pod_open(port_name);
+
+	return pod;
+}
 
 static void print_help()
 {
@@ -56,49 +99,398 @@ static void print_help()
 		" query                        Query one bank from POD\n"
 		" save [filename]              Save all POD banks to file\n"
 		" restore [filename]           Restore all banks from file to POD\n"
+		"                              (--diff: only banks that differ from the POD)\n"
 		" list [filename]              List banks in file\n"
+		" diff [file] [file]           Show the attributes that differ between two files,\n"
+		"                              or between a file and the device\n"
 		" name [name]                  Set bank name\n"
-		" set [attr] [value]           Set an attribute to the value\n"
+		" set [attr=value ...]         Set attributes to the values, in one write\n"
+		"                              (or: set [attr] [value])\n"
+		" batch [file]                 Run '<bank> attr=value ...' lines (- for stdin),\n"
+		"                              reading and writing each bank once\n"
+		" tweak [attr=value ...]       Change attributes live on the device (MIDI CC),\n"
+		"                              or '-' to read attr=value lines from stdin\n"
+		" automate [file]              Play a timeline of attribute changes and glides\n"
+		"                              live on the device (- for stdin)\n"
+		" morph [bank] [bank]          Blend the edit buffer between two banks (1A, or\n"
+		"                              file:1A) by a control read from stdin (0 - 100)\n"
+		"                              or --control\n"
+		" monitor                      Print what the device sends, a line per message\n"
 		" setdirect [attr] [value]     Set an attribute to a device value (for debugging; not recommended)\n"
 		" attr                         Show the list of attributes\n"
 		" writeb [pos] [value]         Writes a byte to a position, FOR DEBUGGING ONLY! DANGEROUS!\n"
 		" select                       Select the current bank\n"
 		" manual                       Engage manual mode\n"
 		" tuner                        Engage tuner mode\n"
+		" route [file]                 Map --control notes, program changes and\n"
+		"                              controllers to bank selects and attributes\n"
+		" serve                        Keep the port open and serve commands (daemon)\n"
+		" discover                     Find the PODs on all raw MIDI ports (or the -p ports)\n"
+		" bench [runs]                 Time opening each -p port and sending a first\n"
+		"                              message, in a fresh process per run (default: 20)\n"
+		" library index [dir ...]      Index the banks of the save files under the dirs\n"
+		" library search [term ...]    List indexed banks matching all terms (attr=value,\n"
+		"                              attr>value, attr<=value, attr!=value, name~text)\n"
+		" compile [out] [patch ...]    Compile text patches ('[2B]' then 'attr = value'\n"
+		"                              lines) to a bank file for restore\n"
 		"\nOptions:\n"
-		" -p port       Raw MIDI Device (example: hw:2,0)\n"
+		" -p port       Raw MIDI Device (example: hw:2,0). May be repeated, or a\n"
+		"               glob (example: 'hw:*'), to query, save or restore many devices,\n"
+		"               or an alias found by discover (example: @pod1). raw:hw:2,0 or\n"
+		"               raw:/dev/snd/midiC2D0 opens the device node without alsa-lib\n"
 		" -v            Verbose\n"
 		" -D --debug    Debug\n"
 		" -o            Allow file overwrite\n"
+		" --diff[=file] Restore only changed banks (compared to file instead of POD)\n"
+		" --verify=mode Write verification: none, immediate (default), deferred, sampled\n"
 		" -h --help     Help\n"
 		" -b            Bank (1A - 9D)\n"
+		" --no-daemon   Do not pass the command to a running daemon\n"
+		" -w depth      Bank requests kept in flight by save (default: 4)\n"
+		" --control=port MIDI port of the controller that drives morph or route\n"
+		" --cc=n        Controller number to read from it (default: 11, expression)\n"
+		" --threshold=n Morph position (0 - 100) at which switches flip (default: 50)\n"
+		" --timeout=ms  Time discover waits for replies (default: 1000)\n"
+		" --cache[=file] Discovery cache written by discover and read for @alias\n"
+		"               (default: ~/." CLIENT_NAME "-ports)\n"
+		" --index=file  Library index (default: ~/." CLIENT_NAME "-library)\n"
+		" --format=fmt  Output of list, query and attr: text (default), json, csv, tsv\n"
+		" --store=dir   Save, restore and list snapshots by name in a bank store,\n"
+		"               which keeps each distinct bank once\n"
+		" --base=file   Banks that compile starts from (default: blank banks)\n"
 		"\n");
 }
 
+/* Reads the selected bank; a device that never answers ends the run */
+static void read_bank(struct bank *b)
+{
+	EXIT_ON(sysex_get_bank(session(), b, bank_n) < 0, "Error reading bank %s: no reply\n",
+		bank_ntostr(bank_n));
+}
+
+/* Port list for fleet mode (multiple -p, or a -p glob) */
+static void add_port(char *name)
+{
+	EXIT_ON(nports == PORTS_MAX, "Too many ports (max. %d)\n", PORTS_MAX);
+
+	ports[nports++] = name;
+}
+
+/* Expands a port glob (e.g. 'hw:*') against the raw MIDI device nodes */
+static void add_port_glob(const char *pattern)
+{
+	glob_t g;
+	char name[32];
+	int i, card, dev, matched = 0;
+
+	if (glob("/dev/snd/midiC*D*", 0, NULL, &g) == 0) {
+		for (i = 0; i < g.gl_pathc; i++) {
+			if (sscanf(g.gl_pathv[i], "/dev/snd/midiC%dD%d", &card, &dev) != 2)
+				continue;
+
+			snprintf(name, sizeof(name), "hw:%d,%d", card, dev);
+			if (fnmatch(pattern, name, 0) != 0)
+				continue;
+
+			add_port(strdup(name));
+			matched++;
+		}
+		globfree(&g);
+	}
+
+	EXIT_ON(matched == 0, "No MIDI ports match '%s'\n", pattern);
+}
+
+/* Adds every raw MIDI device, in and out, that the ALSA control interface lists */
+static void add_ports_alsa()
+{
+	snd_ctl_t *ctl;
+	snd_rawmidi_info_t *rinfo;
+	char name[32];
+	int card = -1, dev;
+
+	snd_rawmidi_info_alloca(&rinfo);
+
+	while (snd_card_next(&card) == 0 && card >= 0) {
+		snprintf(name, sizeof(name), "hw:%d", card);
+		if (snd_ctl_open(&ctl, name, 0) < 0)
+			continue;
+
+		dev = -1;
+		while (snd_ctl_rawmidi_next_device(ctl, &dev) == 0 && dev >= 0) {
+			snd_rawmidi_info_set_device(rinfo, dev);
+			snd_rawmidi_info_set_subdevice(rinfo, 0);
+			snd_rawmidi_info_set_stream(rinfo, SND_RAWMIDI_STREAM_OUTPUT);
+			if (snd_ctl_rawmidi_info(ctl, rinfo) < 0)
+				continue;
+			snd_rawmidi_info_set_stream(rinfo, SND_RAWMIDI_STREAM_INPUT);
+			if (snd_ctl_rawmidi_info(ctl, rinfo) < 0)
+				continue;
+
+			snprintf(name, sizeof(name), "hw:%d,%d", card, dev);
+			port_desc[nports] = strdup(snd_rawmidi_info_get_name(rinfo));
+			add_port(strdup(name));
+		}
+
+		snd_ctl_close(ctl);
+	}
+}
+
+/* Discovery cache: an 'alias port firmware' line per POD found */
+static const char *cache_path()
+{
+	static char path[256];
+	const char *home = getenv("HOME");
+
+	if (cache_file)
+		return cache_file;
+
+	snprintf(path, sizeof(path), "%s/." CLIENT_NAME "-ports", home ? home : ".");
+
+	return path;
+}
+
+static const char *index_path()
+{
+	static char path[256];
+	const char *home = getenv("HOME");
+
+	if (index_file)
+		return index_file;
+
+	snprintf(path, sizeof(path), "%s/." CLIENT_NAME "-library", home ? home : ".");
+
+	return path;
+}
+
+/* Resolves -p @alias through the discovery cache, without probing */
+static char *port_alias(const char *alias)
+{
+	char line[256], a[64], port[128];
+	FILE *f;
+
+	f = fopen(cache_path(), "r");
+	EXIT_ON(f == NULL, "Cannot read %s for @%s (run discover --cache)\n", cache_path(), alias);
+
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == '#' || sscanf(line, "%63s %127s", a, port) != 2)
+			continue;
+
+		if (strcmp(a, alias) == 0) {
+			fclose(f);
+			return strdup(port);
+		}
+	}
+
+	fclose(f);
+	printf("Unknown device alias '%s' (not in %s)\n", alias, cache_path());
+	exit(1);
+}
+
+static struct fleet_dev *fleet_alloc()
+{
+	struct fleet_dev *devs;
+	int i;
+
+	devs = calloc(nports, sizeof(*devs));
+	EXIT_ON(devs == NULL, "%s: out of memory\n", __func__);
+
+	for (i = 0; i < nports; i++) {
+		devs[i].port_name = ports[i];
+		devs[i].bank = bank_n;
+	}
+
+	return devs;
+}
+
+/* Prints per-device results and exits non-zero if any device failed */
+static void fleet_report(struct fleet_dev devs[])
+{
+	int i, failed = 0;
+
+	for (i = 0; i < nports; i++) {
+		info("%-16s %s (%ld.%03ld sec)\n", devs[i].port_name, devs[i].status,
+			devs[i].ms / 1000, devs[i].ms % 1000);
+		if (devs[i].err)
+			failed++;
+	}
+
+	free(devs);
+	EXIT_ON(failed, "%d of %d devices failed\n", failed, nports);
+}
+
+/*
+ * Per-port file name: '%p' in the file name is replaced by the port name
+ * (':' and ',' become '_'); without it, the port is appended if append.
+ */
+static char *port_file_name(const char *file_name, const char *port, bool append)
+{
+	char pname[64];
+	char *s, *p;
+	size_t len;
+	int i;
+
+	for (i = 0; port[i] && i < sizeof(pname) - 1; i++)
+		pname[i] = (port[i] == ':' || port[i] == ',' || port[i] == '/') ? '_' : port[i];
+	pname[i] = 0;
+
+	p = strstr(file_name, "%p");
+	if (!p && !append)
+		return strdup(file_name);
+
+	len = strlen(file_name) + strlen(pname) + 2;
+	s = malloc(len);
+	EXIT_ON(s == NULL, "%s: out of memory\n", __func__);
+
+	if (p)
+		snprintf(s, len, "%.*s%s%s", (int)(p - file_name), file_name, pname, p + 2);
+	else
+		snprintf(s, len, "%s.%s", file_name, pname);
+
+	return s;
+}
+
+/*
+ * Sends the identity request on every port at once and lists the PODs
+ * that answer within --timeout. They are numbered pod1, pod2, ... in
+ * port order; with --cache, the list is written for -p @alias.
+ */
+static void discover(char **unused)
+{
+	struct fleet_dev *devs;
+	char alias[16];
+	FILE *f = NULL;
+	int i, found = 0;
+
+	if (nports == 0)
+		add_ports_alsa();
+	EXIT_ON(nports == 0, "No raw MIDI ports found\n");
+
+	devs = fleet_alloc();
+	sysex_fleet(FLEET_PROBE, devs, nports);
+
+	if (use_cache) {
+		f = fopen(cache_path(), "w");
+		EXIT_ON(f == NULL, "Error creating %s\n", cache_path());
+		fprintf(f, "# alias port firmware\n");
+	}
+
+	printf("%-8s %-16s %-9s %-10s %s\n", "Alias", "Port", "Firmware", "RTT", "Device");
+	for (i = 0; i < nports; i++) {
+		if (devs[i].err) {
+			if (verbose)
+				info("%-16s %s\n", devs[i].port_name, devs[i].status);
+			continue;
+		}
+
+		snprintf(alias, sizeof(alias), "pod%d", ++found);
+		printf("%-8s %-16s %-9s %3ld.%ld ms   %s\n", alias, devs[i].port_name,
+		       devs[i].firmware, devs[i].rtt_us / 1000, devs[i].rtt_us % 1000 / 100,
+		       port_desc[i] ? port_desc[i] : "");
+		if (f)
+			fprintf(f, "%s %s %s\n", alias, devs[i].port_name, devs[i].firmware);
+	}
+
+	if (f) {
+		fclose(f);
+		info("Wrote %s\n", cache_path());
+	}
+
+	free(devs);
+	EXIT_ON(found == 0, "No POD found on %d port%s\n", nports, (nports > 1) ? "s" : "");
+}
+
+/*
+ * --format output: each record is formatted into one buffer, reused,
+ * and handed to the kernel with a single write.
+ */
+#define FORMAT_BUF_SIZE	16384
+
+static char format_buf[FORMAT_BUF_SIZE];
+
+static void format_write(int len)
+{
+	ssize_t n;
+	int off;
+
+	EXIT_ON(len >= sizeof(format_buf), "%s: record too long\n", __func__);
+
+	for (off = 0; off < len; off += n) {
+		n = write(STDOUT_FILENO, format_buf + off, len - off);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		EXIT_ON(n < 0, "Error writing records (errno %d)\n", errno);
+	}
+}
+
+static void format_bank(const char *source, int n, struct bank *b)
+{
+	static bool header;
+
+	if (!header) {
+		format_write(sprint_bank_header(format_buf, sizeof(format_buf), output_format));
+		header = true;
+	}
+
+	format_write(sprint_bank_fmt(format_buf, sizeof(format_buf), output_format, source, n, b));
+}
+
 static void query(char **unused)
 {
 	struct bank b;
+	struct fleet_dev *devs;
+	int i;
 
 	REQUIRE_MIDI();
 	REQUIRE_BANK();
 
-	sysex_get_bank(port_name, &b, bank_n);
-	print_bank(&b);
+	if (nports > 1) {
+		devs = fleet_alloc();
+		sysex_fleet(FLEET_QUERY, devs, nports);
+		for (i = 0; i < nports; i++) {
+			if (devs[i].err)
+				continue;
+			if (output_format != FORMAT_TEXT) {
+				format_bank(devs[i].port_name, bank_n, &devs[i].b[bank_n]);
+				continue;
+			}
+			printf("Port: %s\n", devs[i].port_name);
+			print_bank(&devs[i].b[bank_n]);
+		}
+		fleet_report(devs);
+		return;
+	}
+
+	read_bank(&b);
+	if (output_format != FORMAT_TEXT)
+		format_bank(port_name, bank_n, &b);
+	else
+		print_bank(&b);
 }
 
-static void save(char *argv[])
+/* With --store, bank files are snapshots in the store and there is no fd */
+static int create_banks(const char *file_name)
 {
-	const char *file_name = argv[0];
-	int i, err;
-	struct bank b[BANKS_NR];
+	char *path;
 	int fd;
 
-	REQUIRE_MIDI();
+	if (store_dir) {
+		path = store_path(store_dir, file_name);
+		EXIT_ON(!overwrite && access(path, F_OK) == 0,
+			"Error creating snapshot (snapshot must not exist): %s\n", file_name);
+		free(path);
+		return -1;
+	}
 
 	fd = open(file_name, O_WRONLY | O_CREAT | ((overwrite) ? 0 : O_EXCL), 0644);
 	EXIT_ON(fd <= 0, "Error creating file (file must not exist): %s\n", file_name);
 
-	sysex_get_all(port_name, b);
+	return fd;
+}
+
+static void write_banks(int fd, const char *file_name, struct bank b[])
+{
+	int i, err;
 
 	if (verbose) {
 		for (i = 0; i < BANKS_NR; i++) {
@@ -106,91 +498,1548 @@ static void save(char *argv[])
 			print_bank(&b[i]);
 		}
 	}
-	
-	err = write(fd, b, sizeof(b));
-	EXIT_ON(err != sizeof(b), "Error writing (ret %d, errno %d)\n", err, errno);
+	
+	if (store_dir) {
+		err = store_save(store_dir, file_name, b, overwrite);
+		if (verbose)
+			info("Stored %s: %d new banks\n", file_name, err);
+		return;
+	}
+
+	err = write(fd, b, sizeof(struct bank) * BANKS_NR);
+	EXIT_ON(err != sizeof(struct bank) * BANKS_NR, "Error writing (ret %d, errno %d)\n", err, errno);
+
+	err = fsync(fd);
+	EXIT_ON(!!err, "Error closing file (fsync) (err %d, errno %d)\n", err, errno);
+
+	err = close(fd);
+	EXIT_ON(!!err, "Error closing file (err %d, errno %d)\n", err, errno);
+
+	info("Successfully wrote banks to '%s'\n", file_name);
+}
+
+static void fleet_save(const char *file_name)
+{
+	struct fleet_dev *devs = fleet_alloc();
+	char *names[PORTS_MAX];
+	int fds[PORTS_MAX];
+	int i;
+
+	for (i = 0; i < nports; i++) {
+		names[i] = port_file_name(file_name, ports[i], true);
+		fds[i] = create_banks(names[i]);
+	}
+
+	sysex_fleet(FLEET_SAVE, devs, nports);
+
+	for (i = 0; i < nports; i++) {
+		if (devs[i].err) {
+			if (fds[i] >= 0) {
+				close(fds[i]);
+				unlink(names[i]);
+			}
+		} else {
+			write_banks(fds[i], names[i], devs[i].b);
+		}
+		free(names[i]);
+	}
+
+	fleet_report(devs);
+}
+
+/*
+ * Checkpoint of a save or restore in progress, kept next to the bank file
+ * as <file>.part and rewritten as each bank completes. A later run of the
+ * same command picks up from the banks not done yet; the file is removed
+ * once the command succeeds.
+ */
+#define CKPT_MAGIC	"P6CK"
+#define CKPT_SUFFIX	".part"
+
+enum {
+	CKPT_SAVE = 's',
+	CKPT_RESTORE = 'r',
+};
+
+struct checkpoint {
+	char magic[4];
+	unsigned char op;
+	unsigned char done[BANKS_NR];
+	struct bank b[BANKS_NR];	/* Banks read so far (save), or the image written (restore) */
+	unsigned long long dev, ino;	/* The file a save created (0 for restore and --store) */
+};
+
+static int ckpt_fd = -1;
+static char *ckpt_name;
+static struct checkpoint ckpt;
+
+static void ckpt_flush()
+{
+	int err;
+
+	err = pwrite(ckpt_fd, &ckpt, sizeof(ckpt), 0);
+	EXIT_ON(err != sizeof(ckpt), "Error writing checkpoint %s (errno %d)\n", ckpt_name, errno);
+}
+
+static char *ckpt_path(const char *file_name)
+{
+	char *path, *name;
+
+	path = store_dir ? store_path(store_dir, file_name) : strdup(file_name);
+	name = malloc(strlen(path) + sizeof(CKPT_SUFFIX));
+	EXIT_ON(name == NULL, "%s: out of memory\n", __func__);
+	sprintf(name, "%s" CKPT_SUFFIX, path);
+	free(path);
+
+	return name;
+}
+
+/* Whether an old checkpoint of op is for this image or output file */
+static bool ckpt_match(const struct checkpoint *old, unsigned char op, const struct checkpoint *cur)
+{
+	if (memcmp(old->magic, CKPT_MAGIC, sizeof(old->magic)) != 0 || old->op != op)
+		return false;
+
+	if (op == CKPT_RESTORE)
+		return memcmp(old->b, cur->b, sizeof(old->b)) == 0;
+
+	return old->dev == cur->dev && old->ino == cur->ino;
+}
+
+/*
+ * Whether file_name is the output file of a save that was interrupted,
+ * so that save may write it again without -o. A save only writes that
+ * file once it has every bank, so it must still be empty.
+ */
+static bool ckpt_created(const char *file_name)
+{
+	struct checkpoint old, cur = { .op = CKPT_SAVE };
+	struct stat st;
+	char *name;
+	bool found;
+	int fd;
+
+	if (store_dir || stat(file_name, &st) != 0 || st.st_size != 0)
+		return false;
+
+	cur.dev = st.st_dev;
+	cur.ino = st.st_ino;
+
+	name = ckpt_path(file_name);
+	fd = open(name, O_RDONLY);
+	free(name);
+	if (fd < 0)
+		return false;
+
+	found = pread(fd, &old, sizeof(old), 0) == sizeof(old) && ckpt_match(&old, CKPT_SAVE, &cur);
+	close(fd);
+
+	return found;
+}
+
+/*
+ * Opens the checkpoint for file_name. For a restore, b is the image to
+ * write and an old checkpoint only counts if it was for the same image;
+ * for a save, fd is the output file (-1 with --store), an old checkpoint
+ * only counts if it was for the same file, and banks read before are
+ * copied to b. done[] is set for the banks that need no more work.
+ * Returns their number.
+ */
+static int ckpt_open(const char *file_name, unsigned char op, struct bank b[], bool done[], int fd)
+{
+	struct checkpoint old;
+	struct stat st;
+	int n, nr = 0;
+
+	ckpt_name = ckpt_path(file_name);
+	ckpt_fd = open(ckpt_name, O_RDWR | O_CREAT, 0644);
+	EXIT_ON(ckpt_fd < 0, "Error opening checkpoint %s (errno %d)\n", ckpt_name, errno);
+
+	memset(&ckpt, 0, sizeof(ckpt));
+	memcpy(ckpt.magic, CKPT_MAGIC, sizeof(ckpt.magic));
+	ckpt.op = op;
+	if (op == CKPT_RESTORE)
+		memcpy(ckpt.b, b, sizeof(ckpt.b));
+	if (fd >= 0 && fstat(fd, &st) == 0) {
+		ckpt.dev = st.st_dev;
+		ckpt.ino = st.st_ino;
+	}
+
+	if (pread(ckpt_fd, &old, sizeof(old), 0) == sizeof(old) && ckpt_match(&old, op, &ckpt)) {
+		for (n = 0; n < BANKS_NR; n++) {
+			if (!old.done[n])
+				continue;
+			ckpt.done[n] = true;
+			ckpt.b[n] = old.b[n];
+			nr++;
+		}
+	}
+
+	for (n = 0; n < BANKS_NR; n++) {
+		done[n] = ckpt.done[n];
+		if (done[n] && op == CKPT_SAVE)
+			b[n] = ckpt.b[n];
+	}
+
+	if (nr > 0)
+		info("Resuming from %s (%d of %d banks done)\n", ckpt_name, nr, BANKS_NR);
+
+	ckpt_flush();
+
+	return nr;
+}
+
+/* Progress callback: the bank is done */
+static void ckpt_mark(int n, const struct bank *b, void *arg)
+{
+	ckpt.done[n] = true;
+	ckpt.b[n] = *b;
+	ckpt_flush();
+}
+
+/* Closes the checkpoint; it is only kept if the command did not finish */
+static void ckpt_close(bool finished)
+{
+	close(ckpt_fd);
+	ckpt_fd = -1;
+
+	if (finished)
+		unlink(ckpt_name);
+	else
+		info("Progress kept in %s; run the command again to resume.\n", ckpt_name);
+
+	free(ckpt_name);
+	ckpt_name = NULL;
+}
+
+static void save(char *argv[])
+{
+	const char *file_name = argv[0];
+	struct bank b[BANKS_NR];
+	bool want[BANKS_NR];
+	int fd, n, missing;
+
+	REQUIRE_MIDI();
+
+	if (nports > 1) {
+		fleet_save(file_name);
+		return;
+	}
+
+	/* An interrupted save leaves its output file behind */
+	if (ckpt_created(file_name))
+		fd = open(file_name, O_WRONLY | O_TRUNC);
+	else
+		fd = create_banks(file_name);
+	EXIT_ON(fd < 0 && !store_dir, "Error creating file: %s (errno %d)\n", file_name, errno);
+
+	ckpt_open(file_name, CKPT_SAVE, b, want, fd);
+
+	for (n = 0; n < BANKS_NR; n++)
+		want[n] = !want[n];
+
+	pod_progress(session(), ckpt_mark, NULL);
+	missing = sysex_get_banks(session(), b, want);
+	pod_progress(session(), NULL, NULL);
+
+	if (missing) {
+		if (fd >= 0) {
+			close(fd);
+			unlink(file_name);
+		}
+		ckpt_close(false);
+		EXIT_ON(true, "%d banks could not be read\n", missing);
+	}
+
+	write_banks(fd, file_name, b);
+	ckpt_close(true);
+}
+
+static void load_banks(const char *file_name, struct bank b[])
+{
+	int err;
+	int fd;
+
+	if (store_dir) {
+		store_load(store_dir, file_name, b);
+		return;
+	}
+
+	fd = open(file_name, O_RDONLY);
+	EXIT_ON(fd <= 0, "Error reading file: %s (fd %d, errno %d)\n", file_name, fd, errno);
+
+	err = read(fd, b, sizeof(struct bank) * BANKS_NR);
+	EXIT_ON(err != sizeof(struct bank) * BANKS_NR, "Error reading banks (file size mismatch)\n");
+
+	close(fd);
+}
+
+static void list(char *argv[])
+{
+	const char *file_name = argv[0];
+	int i;
+	struct bank b[BANKS_NR];
+
+	load_banks(file_name, b);
+
+	for (i = 0; i < BANKS_NR; i++) {
+		if (output_format != FORMAT_TEXT) {
+			format_bank(file_name, i, &b[i]);
+			continue;
+		}
+		printf("Bank: %s (%d)\n", bank_ntostr(i), i);
+		print_bank(&b[i]);
+		printf("\n");
+	}
+}
+
+static void fleet_restore(const char *file_name)
+{
+	struct fleet_dev *devs = fleet_alloc();
+	char *name;
+	int i;
+
+	EXIT_ON(restore_diff, "--diff is not supported with multiple ports\n");
+
+	for (i = 0; i < nports; i++) {
+		name = port_file_name(file_name, ports[i], false);
+		load_banks(name, devs[i].b);
+		free(name);
+	}
+
+	sysex_fleet(FLEET_RESTORE, devs, nports);
+	fleet_report(devs);
+}
+
+static void restore(char *argv[])
+{
+	const char *file_name = argv[0];
+	struct bank b[BANKS_NR];
+	struct bank cur[BANKS_NR];
+	bool want[BANKS_NR];
+	bool done[BANKS_NR];
+	int n, skipped = 0, resumed, err = 0;
+
+	REQUIRE_MIDI();
+
+	if (nports > 1) {
+		fleet_restore(file_name);
+		return;
+	}
+
+	load_banks(file_name, b);
+	resumed = ckpt_open(file_name, CKPT_RESTORE, b, done, -1);
+
+	if (restore_diff) {
+		if (diff_snapshot)
+			load_banks(diff_snapshot, cur);
+		else
+			EXIT_ON(sysex_get_all(session(), cur), "Could not read the current banks\n");
+	}
+
+	for (n = 0; n < BANKS_NR; n++) {
+		want[n] = !done[n];
+		if (restore_diff && memcmp(&b[n], &cur[n], sizeof(struct bank)) == 0)
+			want[n] = false;
+		if (!want[n])
+			skipped++;
+	}
+
+	pod_progress(session(), ckpt_mark, NULL);
+	if (skipped < BANKS_NR)
+		err = sysex_set_banks(session(), b, want);
+	pod_progress(session(), NULL, NULL);
+	ckpt_close(err == 0);
+
+	if (restore_diff || resumed)
+		info("Restored %d banks, skipped %d unchanged or done.\n", BANKS_NR - skipped, skipped);
+	EXIT_ON(err, "%d banks failed verification\n", err);
+}
+
+/*
+ * Diff: the banks that differ between two sources are found comparing
+ * the images a word at a time (in a store, comparing the manifests),
+ * and only those are decoded, into a line per changed attribute:
+ *
+ *   <bank> <attr>: <value> -> <value>
+ *
+ * with values scaled as set takes them, or '-' where the attribute does
+ * not apply to the bank's amp or effect. Each bank is written at once.
+ */
+#define DIFF_BUF_SIZE	4096
+
+/* A save file (or snapshot), or the device for NULL */
+static void diff_source(const char *file_name, struct bank b[])
+{
+	if (file_name) {
+		load_banks(file_name, b);
+		return;
+	}
+
+	REQUIRE_MIDI();
+	EXIT_ON(sysex_get_all(session(), b), "Could not read the current banks\n");
+}
+
+/* Marks the banks that differ and returns their number */
+static int diff_image(struct bank a[], struct bank b[], bool changed[])
+{
+	const unsigned char *p = (const unsigned char *)a, *q = (const unsigned char *)b;
+	size_t size = sizeof(struct bank) * BANKS_NR, off, n;
+	uint64_t x, y;
+	int nr = 0;
+
+	memset(changed, 0, BANKS_NR * sizeof(*changed));
+
+	for (off = 0; off < size; off += sizeof(x)) {
+		if (off + sizeof(x) <= size) {
+			memcpy(&x, p + off, sizeof(x));
+			memcpy(&y, q + off, sizeof(y));
+			if (x == y)
+				continue;
+		}
+
+		/* The word may straddle two banks; the next word to look at follows them */
+		for (n = off / sizeof(struct bank); n < BANKS_NR && n * sizeof(struct bank) < off + sizeof(x);
+		     n++) {
+			if (!changed[n] && memcmp(&a[n], &b[n], sizeof(struct bank)) != 0) {
+				changed[n] = true;
+				nr++;
+			}
+		}
+		if (n == BANKS_NR)
+			break;
+		off = (n * sizeof(struct bank) / sizeof(x) - 1) * sizeof(x);
+	}
+
+	return nr;
+}
+
+/* Attributes of the same name for different effects are one to the reader */
+static int diff_value(char *buf, size_t size, struct bank *b, const char *attr)
+{
+	int op = bank_op_lookup(b, attr, true), val;
+
+	if (op < 0 || get_scaled_bank_op(b, op, &val) < 0)
+		return snprintf(buf, size, "-");
+
+	return snprintf(buf, size, "%d", val);
+}
+
+static void diff_bank(struct bank *a, struct bank *b, int n)
+{
+	char buf[DIFF_BUF_SIZE], name_a[BANK_NAME_LEN + 1], name_b[BANK_NAME_LEN + 1];
+	int ops[BANK_OPS_MAX];
+	size_t len = 0;
+	const char *attr;
+	int i, j, nops;
+
+	bank_name_str(name_a, a);
+	bank_name_str(name_b, b);
+	for (i = BANK_NAME_LEN - 1; i >= 0 && name_a[i] == ' '; i--)
+		name_a[i] = 0;
+	for (i = BANK_NAME_LEN - 1; i >= 0 && name_b[i] == ' '; i--)
+		name_b[i] = 0;
+	if (strcmp(name_a, name_b) != 0)
+		len += snprintf(buf + len, sizeof(buf) - len, "%s name: \"%s\" -> \"%s\"\n",
+				bank_ntostr(n), name_a, name_b);
+
+	nops = bank_diff_ops(a, b, ops, lengthof(ops));
+	for (i = 0; i < nops && len < sizeof(buf); i++) {
+		attr = bank_op_name(ops[i]);
+		for (j = 0; j < i && strcmp(attr, bank_op_name(ops[j])) != 0; j++)
+			;
+		if (j < i)
+			continue;
+
+		len += snprintf(buf + len, sizeof(buf) - len, "%s %s: ", bank_ntostr(n), attr);
+		len += diff_value(buf + len, (len < sizeof(buf)) ? sizeof(buf) - len : 0, a, attr);
+		len += snprintf(buf + len, (len < sizeof(buf)) ? sizeof(buf) - len : 0, " -> ");
+		len += diff_value(buf + len, (len < sizeof(buf)) ? sizeof(buf) - len : 0, b, attr);
+		len += snprintf(buf + len, (len < sizeof(buf)) ? sizeof(buf) - len : 0, "\n");
+	}
+
+	if (len == 0)
+		len = snprintf(buf, sizeof(buf), "%s: only unused bytes differ\n", bank_ntostr(n));
+
+	fwrite(buf, 1, (len < sizeof(buf)) ? len : sizeof(buf) - 1, stdout);
+}
+
+static void diff(char *argv[])
+{
+	struct bank a[BANKS_NR], b[BANKS_NR];
+	uint64_t ha[BANKS_NR], hb[BANKS_NR];
+	bool changed[BANKS_NR];
+	int n, nr = 0;
+
+	if (store_dir && argv[1] && store_manifest(store_dir, argv[0], ha) == 0 &&
+	    store_manifest(store_dir, argv[1], hb) == 0) {
+		for (n = 0; n < BANKS_NR; n++) {
+			changed[n] = (ha[n] != hb[n]);
+			nr += changed[n];
+		}
+		if (nr) {
+			diff_source(argv[0], a);
+			diff_source(argv[1], b);
+		}
+	} else {
+		diff_source(argv[0], a);
+		diff_source(argv[1], b);
+		nr = diff_image(a, b, changed);
+	}
+
+	for (n = 0; n < BANKS_NR; n++) {
+		if (changed[n])
+			diff_bank(&a[n], &b[n], n);
+	}
+
+	if (verbose)
+		info("%d of %d banks differ\n", nr, BANKS_NR);
+
+	exit(nr ? 1 : 0);
+}
+
+/*
+ * Compiles patch files to a bank file (or --store snapshot). The banks
+ * the patches do not set, and the ones they set before applying their
+ * attributes, are those of --base, or blank.
+ */
+static void compile(char *argv[])
+{
+	struct bank b[BANKS_NR];
+	bool defined[BANKS_NR] = { false };
+	int i, fd, nr = 0;
+
+	if (base_file) {
+		load_banks(base_file, b);
+	} else {
+		memset(b, 0, sizeof(b));
+		for (i = 0; i < BANKS_NR; i++)
+			set_bank_name(&b[i], "");
+	}
+
+	for (i = 1; argv[i]; i++)
+		patch_compile(argv[i], b, defined, bank_n);
+
+	for (i = 0; i < BANKS_NR; i++)
+		nr += defined[i];
+
+	fd = create_banks(argv[0]);
+	write_banks(fd, argv[0], b);
+
+	info("Compiled %d banks to '%s'\n", nr, argv[0]);
+}
+
+#define STRNCMP_USER_CONST(ustr, cstr)	strncmp(ustr, cstr, strlen(cstr));
+static void name(char *argv[])
+{
+	const char *s = argv[0];
+	struct bank b;
+
+	REQUIRE_MIDI();
+	REQUIRE_BANK();
+
+	EXIT_ON(strlen(s) > BANK_NAME_LEN, "Maximum bank name length (16) exceeded\n");
+
+	read_bank(&b);
+	set_bank_name(&b, s);
+	sysex_set_bank(session(), &b, bank_n);
+
+	fprintf(stderr, "Set bank name to '%s'\n", s);
+}
+
+/* Applies one scaled attribute value; 'name' sets the bank name */
+static int set_param(struct bank *b, const char *attr, const char *val)
+{
+	if (strcmp(attr, "name") == 0) {
+		if (set_bank_name(b, val) == 0)
+			return 0;
+
+		fprintf(stderr, "Error: maximum bank name length (16) exceeded\n");
+		return -EINVAL;
+	}
+
+	return set_scaled_bank_param(b, attr, val);
+}
+
+/*
+ * Applies 'attr=value' or 'attr value' arguments to a bank in memory.
+ * Either all of them apply, or the bank is left as it was.
+ */
+static int set_params(struct bank *b, char *argv[])
+{
+	struct bank tmp = *b;
+	char attr[32];
+	char *arg, *val, *eq;
+	int err;
+
+	while ((arg = *argv++)) {
+		eq = strchr(arg, '=');
+		if (eq) {
+			snprintf(attr, sizeof(attr), "%.*s", (int)(eq - arg), arg);
+			val = eq + 1;
+		} else {
+			snprintf(attr, sizeof(attr), "%s", arg);
+			val = *argv++;
+			if (!val) {
+				fprintf(stderr, "Error: missing value for '%s'\n", attr);
+				return -EINVAL;
+			}
+		}
+
+		err = set_param(&tmp, attr, val);
+		if (err)
+			return err;
+	}
+
+	*b = tmp;
+
+	return 0;
+}
+
+static void set(char *argv[])
+{
+	struct bank b;
+
+	REQUIRE_MIDI();
+	REQUIRE_BANK();
+
+	read_bank(&b);
+	EXIT_ON(set_params(&b, argv) != 0, "Bank not changed.\n");
+	sysex_set_bank(session(), &b, bank_n);
+	print_bank(&b);
+}
+
+/* Reads a whole file into a NUL-terminated buffer */
+static char *read_all(FILE *f)
+{
+	size_t len = 0, size = 4096, n;
+	char *buf = malloc(size);
+
+	EXIT_ON(buf == NULL, "%s: out of memory\n", __func__);
+
+	while ((n = fread(buf + len, 1, size - len - 1, f)) > 0) {
+		len += n;
+		if (len + 1 == size) {
+			size *= 2;
+			buf = realloc(buf, size);
+			EXIT_ON(buf == NULL, "%s: out of memory\n", __func__);
+		}
+	}
+	buf[len] = 0;
+
+	return buf;
+}
+
+/*
+ * Splits off the next whitespace separated token of a line in place.
+ * Double quotes group words ("My Lead") and are removed; '#' starts a
+ * comment. Returns NULL at the end of the line.
+ */
+static char *batch_token(char **line)
+{
+	char *s = *line, *d, *tok;
+	bool quoted = false;
+	char end;
+
+	while (*s == ' ' || *s == '\t' || *s == '\r')
+		s++;
+
+	if (*s == 0 || *s == '#') {
+		*line = s;
+		return NULL;
+	}
+
+	tok = d = s;
+	while (*s && (quoted || (*s != ' ' && *s != '\t' && *s != '\r'))) {
+		if (*s == '"')
+			quoted = !quoted;
+		else
+			*d++ = *s;
+		s++;
+	}
+
+	end = *s;
+	*d = 0;
+	*line = end ? s + 1 : s;
+
+	return tok;
+}
+
+struct batch_op {
+	int bank;
+	int line;
+	const char *attr;
+	const char *val;
+};
+
+/*
+ * Runs a script of '<bank> attr=value ...' lines. Settings are grouped per
+ * bank in memory: every touched bank is read once and written once, and
+ * nothing is written if any setting fails.
+ */
+static void batch(char *argv[])
+{
+	const char *file_name = argv[0];
+	struct bank b[BANKS_NR];
+	bool touched[BANKS_NR] = { false };
+	struct batch_op *bops = NULL;
+	int nbops = 0, size = 0, lineno = 0, banks = 0;
+	char *buf, *p, *nl, *tok, *eq;
+	FILE *f;
+	int i, n, err;
+
+	REQUIRE_MIDI();
+
+	f = strcmp(file_name, "-") ? fopen(file_name, "r") : stdin;
+	EXIT_ON(f == NULL, "Error reading file: %s (errno %d)\n", file_name, errno);
+	buf = read_all(f);
+	if (f != stdin)
+		fclose(f);
+
+	for (p = buf; p; p = nl ? nl + 1 : NULL) {
+		nl = strchr(p, '\n');
+		if (nl)
+			*nl = 0;
+		lineno++;
+
+		tok = batch_token(&p);
+		if (!tok)
+			continue;
+
+		n = bank_strton(tok);
+		EXIT_ON(n < 0 || n >= BANKS_NR, "line %d: invalid bank '%s'\n", lineno, tok);
+
+		while ((tok = batch_token(&p))) {
+			eq = strchr(tok, '=');
+			EXIT_ON(!eq, "line %d: expected attr=value, got '%s'\n", lineno, tok);
+			*eq = 0;
+
+			if (nbops == size) {
+				size = size ? size * 2 : 64;
+				bops = realloc(bops, size * sizeof(*bops));
+				EXIT_ON(bops == NULL, "%s: out of memory\n", __func__);
+			}
+
+			bops[nbops].bank = n;
+			bops[nbops].line = lineno;
+			bops[nbops].attr = tok;
+			bops[nbops].val = eq + 1;
+			nbops++;
+
+			if (!touched[n])
+				banks++;
+			touched[n] = true;
+		}
+	}
+
+	if (nbops == 0) {
+		info("Nothing to do.\n");
+		return;
+	}
+
+	err = sysex_get_banks(session(), b, touched);
+	EXIT_ON(err, "%d banks could not be read, no banks changed.\n", err);
+
+	for (i = 0; i < nbops; i++) {
+		err = set_param(&b[bops[i].bank], bops[i].attr, bops[i].val);
+		EXIT_ON(err, "line %d: %s=%s failed, no banks changed.\n",
+			bops[i].line, bops[i].attr, bops[i].val);
+	}
+
+	err = sysex_set_banks(session(), b, touched);
+	EXIT_ON(err, "%d banks failed verification\n", err);
+
+	info("Applied %d settings to %d banks.\n", nbops, banks);
+
+	free(bops);
+	free(buf);
+}
+
+/*
+ * Live edits: each attr=value goes to the edit buffer as control changes,
+ * with no bank read or written. tweak_bank tracks what was sent, so that
+ * the effect-dependent attributes follow an effect_type tweak (or the
+ * bank read with -b).
+ */
+#define TWEAK_LINE_MAX	4096
+static struct bank tweak_bank;
+static bool tweak_effect_known;
+static int tweak_changes;
+static int tweak_coalesced;
+
+static int tweak_param(char *tok)
+{
+	struct bank_cc cc;
+	char *eq = strchr(tok, '=');
+	int i, err;
+
+	if (!eq) {
+		fprintf(stderr, "Error: expected attr=value, got '%s'\n", tok);
+		return -EINVAL;
+	}
+	*eq = 0;
+
+	err = set_cc_bank_param(&tweak_bank, tok, eq + 1, tweak_effect_known, &cc);
+	if (err)
+		return err;
+
+	if (strcmp(tok, "effect_type") == 0)
+		tweak_effect_known = true;
+
+	for (i = 0; i < cc.n; i++) {
+		if (pod_cc(session(), cc.cc[i], cc.val[i]))
+			tweak_coalesced++;
+	}
+	tweak_changes++;
+
+	return 0;
+}
+
+/* Settings on a line are sent as they arrive; a bad one is skipped */
+static void tweak_line(char *line)
+{
+	char *tok;
+
+	while ((tok = batch_token(&line)))
+		tweak_param(tok);
+}
+
+/* Sends queued changes as the wire takes them, reading more from stdin if stream */
+static void tweak_send(bool stream)
+{
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	char buf[TWEAK_LINE_MAX];
+	size_t len = 0;
+	ssize_t n;
+	char *nl;
+	bool eof = !stream;
+	int timeout = pod_cc_flush(session());
+
+	while (!eof || timeout >= 0) {
+		n = poll(&pfd, eof ? 0 : 1, timeout);
+		EXIT_ON(n < 0 && errno != EINTR, "%s: poll error (errno %d)\n", __func__, errno);
+
+		if (n > 0) {
+			n = read(STDIN_FILENO, buf + len, sizeof(buf) - len - 1);
+			if (n <= 0) {
+				eof = true;
+				n = 0;
+			}
+			len += n;
+			buf[len] = 0;
+
+			while ((nl = strchr(buf, '\n'))) {
+				*nl = 0;
+				tweak_line(buf);
+				len -= nl + 1 - buf;
+				memmove(buf, nl + 1, len + 1);
+			}
+
+			if (eof || len == sizeof(buf) - 1) {
+				tweak_line(buf);
+				len = 0;
+			}
+		}
+
+		timeout = pod_cc_flush(session());
+	}
+}
+
+/* With -b, the bank is read once to know its effect */
+static void tweak_begin()
+{
+	REQUIRE_MIDI();
+
+	if (bank_n >= 0) {
+		read_bank(&tweak_bank);
+		tweak_effect_known = true;
+	}
+}
+
+static void tweak(char *argv[])
+{
+	tweak_begin();
+
+	if (strcmp(argv[0], "-") == 0) {
+		tweak_send(true);
+	} else {
+		for (; *argv; argv++)
+			EXIT_ON(tweak_param(*argv) != 0, "Nothing sent.\n");
+		tweak_send(false);
+	}
+
+	if (verbose)
+		info("Sent %d changes, %d coalesced.\n", tweak_changes, tweak_coalesced);
+}
+
+static long long now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/* Histogram of durations, HIST_BUCKET_US wide buckets; the last takes the rest */
+#define HIST_BUCKET_US		10
+#define HIST_BUCKETS		10000
+
+struct us_hist {
+	unsigned int bucket[HIST_BUCKETS];
+	int n;
+};
+
+static void hist_add(struct us_hist *h, long long us)
+{
+	us /= HIST_BUCKET_US;
+	h->bucket[(us < 0) ? 0 : (us < HIST_BUCKETS) ? us : HIST_BUCKETS - 1]++;
+	h->n++;
+}
+
+/* Duration in us below which pct percent of the samples were */
+static long hist_pct(struct us_hist *h, int pct)
+{
+	long n = 0;
+	int i;
+
+	for (i = 0; i < HIST_BUCKETS - 1; i++) {
+		n += h->bucket[i];
+		if (n * 100 >= (long)h->n * pct)
+			break;
+	}
+
+	return (i + 1) * HIST_BUCKET_US;
+}
+
+/*
+ * Automation: a timeline of '<time> attr=value ...' lines, the time in
+ * seconds ([minutes:]seconds) from the start. 'attr~value' glides from
+ * the attribute's previous point to value, arriving at the given time.
+ * Points are sent as control changes like tweak; a glide is updated
+ * every AUTO_TICK_US but only sends when the device value changes.
+ */
+#define AUTO_TICK_US		1000
+
+struct auto_point {
+	long long us;
+	int line;
+	const char *attr;
+	int val;
+	bool glide;	/* Reached by gliding from the previous point */
+	int next;	/* Next point of the same attribute, or -1 */
+};
+
+struct auto_glide {
+	int op;
+	int from;
+	int to;
+};
+
+static struct auto_point *auto_points;
+static int auto_npoints;
+static short auto_sent[128];		/* Last value sent per controller */
+static int auto_changes;
+static int auto_dropped;
+static struct us_hist auto_jitter;
+
+/* Parses [minutes:]seconds; returns microseconds or -1 */
+static long long auto_time(const char *s)
+{
+	double t, m = 0;
+	char *end;
+
+	t = strtod(s, &end);
+	if (*end == ':') {
+		m = t;
+		s = end + 1;
+		t = strtod(s, &end);
+	}
+
+	if (end == s || *end || t < 0 || m < 0)
+		return -1;
+
+	return (m * 60 + t) * 1000000;
+}
+
+static int auto_point_cmp(const void *a, const void *b)
+{
+	const struct auto_point *p = a, *q = b;
+
+	if (p->us != q->us)
+		return (p->us < q->us) ? -1 : 1;
+
+	return p->line - q->line;
+}
+
+/* Reads and checks the timeline, linking each point to the next of its attribute */
+static void auto_load(const char *file_name)
+{
+	struct bank scratch = { 0 };
+	struct bank_cc cc;
+	struct auto_point *p;
+	int size = 0, lineno = 0, i, j, op;
+	char *buf, *line, *nl, *tok, *eq;
+	long long us;
+	FILE *f;
+
+	f = strcmp(file_name, "-") ? fopen(file_name, "r") : stdin;
+	EXIT_ON(f == NULL, "Error reading file: %s (errno %d)\n", file_name, errno);
+	buf = read_all(f);
+	if (f != stdin)
+		fclose(f);
+
+	for (line = buf; line; line = nl ? nl + 1 : NULL) {
+		nl = strchr(line, '\n');
+		if (nl)
+			*nl = 0;
+		lineno++;
+
+		tok = batch_token(&line);
+		if (!tok)
+			continue;
+
+		us = auto_time(tok);
+		EXIT_ON(us < 0, "line %d: invalid time '%s'\n", lineno, tok);
+
+		while ((tok = batch_token(&line))) {
+			eq = strpbrk(tok, "=~");
+			EXIT_ON(!eq, "line %d: expected attr=value or attr~value, got '%s'\n", lineno, tok);
+
+			if (auto_npoints == size) {
+				size = size ? size * 2 : 256;
+				auto_points = realloc(auto_points, size * sizeof(*auto_points));
+				EXIT_ON(auto_points == NULL, "%s: out of memory\n", __func__);
+			}
+
+			p = &auto_points[auto_npoints++];
+			p->us = us;
+			p->line = lineno;
+			p->glide = (*eq == '~');
+			*eq = 0;
+			p->attr = tok;
+			p->val = strtol(eq + 1, NULL, 0);
+			p->next = -1;
+
+			op = bank_op_lookup(&scratch, tok, false);
+			EXIT_ON(op < 0, "line %d: unknown attribute '%s'\n", lineno, tok);
+			EXIT_ON(set_cc_bank_op(&scratch, op, p->val, &cc) != 0,
+				"line %d: %s=%s is out of range or has no MIDI controller\n",
+				lineno, tok, eq + 1);
+		}
+	}
+
+	qsort(auto_points, auto_npoints, sizeof(*auto_points), auto_point_cmp);
+
+	for (i = 0; i < auto_npoints; i++) {
+		for (j = i - 1; j >= 0; j--) {
+			if (strcmp(auto_points[j].attr, auto_points[i].attr) == 0)
+				break;
+		}
+
+		EXIT_ON(auto_points[i].glide && j < 0, "line %d: %s glides from no earlier point\n",
+			auto_points[i].line, auto_points[i].attr);
+		if (j >= 0)
+			auto_points[j].next = i;
+	}
+}
+
+/* Queues an attribute change, skipping it if the device already has the value */
+static void auto_set(int op, int val)
+{
+	struct bank_cc cc;
+	int i;
+
+	if (set_cc_bank_op(&tweak_bank, op, val, &cc) != 0)
+		return;
+
+	for (i = 0; i < cc.n; i++) {
+		if (auto_sent[cc.cc[i]] == cc.val[i])
+			continue;
+
+		auto_sent[cc.cc[i]] = cc.val[i];
+		auto_changes++;
+		if (pod_cc(session(), cc.cc[i], cc.val[i]))
+			auto_dropped++;
+	}
+}
+
+static void auto_wait(long long start, long long us)
+{
+	struct timespec ts;
+
+	us += start;
+	ts.tv_sec = us / 1000000;
+	ts.tv_nsec = (us % 1000000) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+
+	hist_add(&auto_jitter, now_us() - us);
+}
+
+static void automate(char *argv[])
+{
+	struct auto_point *p;
+	struct auto_glide *glides, *g;
+	long long start, now, wake;
+	int nglides = 0, next = 0, pending = -1, op, i;
+
+	auto_load(argv[0]);
+	if (auto_npoints == 0) {
+		info("Nothing to do.\n");
+		return;
+	}
+
+	glides = calloc(auto_npoints, sizeof(*glides));
+	EXIT_ON(glides == NULL, "%s: out of memory\n", __func__);
+	memset(auto_sent, 0xff, sizeof(auto_sent));
+
+	tweak_begin();
+	start = now_us();
+
+	for (;;) {
+		now = now_us() - start;
+
+		for (; next < auto_npoints && auto_points[next].us <= now; next++) {
+			p = &auto_points[next];
+
+			for (i = 0; i < nglides; i++) {
+				if (glides[i].to == next)
+					glides[i--] = glides[--nglides];
+			}
+
+			op = bank_op_lookup(&tweak_bank, p->attr, tweak_effect_known);
+			if (op < 0) {
+				info("line %d: %s does not apply to %s, skipped\n", p->line, p->attr,
+				     effect_name(&tweak_bank));
+				continue;
+			}
+
+			auto_set(op, p->val);
+			if (strcmp(p->attr, "effect_type") == 0)
+				tweak_effect_known = true;
+
+			if (p->next >= 0 && auto_points[p->next].glide) {
+				g = &glides[nglides++];
+				g->op = op;
+				g->from = next;
+				g->to = p->next;
+			}
+		}
+
+		for (g = glides; g < glides + nglides; g++) {
+			struct auto_point *from = &auto_points[g->from], *to = &auto_points[g->to];
+
+			auto_set(g->op, from->val + (to->val - from->val) * (now - from->us) /
+					(to->us - from->us));
+		}
+
+		pending = pod_cc_flush(session());
+
+		wake = -1;
+		if (next < auto_npoints)
+			wake = auto_points[next].us;
+		if (nglides && (wake < 0 || now + AUTO_TICK_US < wake))
+			wake = now + AUTO_TICK_US;
+		if (pending >= 0 && (wake < 0 || now + pending * 1000 < wake))
+			wake = now + pending * 1000;
+		if (wake < 0)
+			break;
+
+		auto_wait(start, wake);
+	}
+
+	info("Played %d points in %lld ms: %d changes sent, %d dropped on a busy link.\n",
+	     auto_npoints, (now_us() - start) / 1000, auto_changes - auto_dropped, auto_dropped);
+	info("Timer lateness: 50%% < %ld us, 99%% < %ld us, max < %ld us (%d wakeups)\n",
+	     hist_pct(&auto_jitter, 50), hist_pct(&auto_jitter, 99), hist_pct(&auto_jitter, 100),
+	     auto_jitter.n);
+
+	free(glides);
+}
+
+/*
+ * Morphing: the edit buffer is blended between two banks as a control
+ * moves, read from stdin (0-100, one value per line) or as a controller
+ * on a MIDI port (--control). All input waiting is read before a frame
+ * is computed, so a fast pedal skips straight to its latest position;
+ * each frame sends only the attributes whose device value changed.
+ */
+#define MORPH_POS_MAX	1000
+#define MORPH_BUF_SIZE	256
+
+struct morph_input {
+	struct transport *t;
+	unsigned char status;	/* MIDI running status */
+	unsigned char data[2];
+	int ndata;
+	char line[MORPH_BUF_SIZE];	/* Partial stdin line */
+	size_t len;
+	bool eof;
+};
+
+/* A bank slot on the device, or file:slot */
+static void morph_source(const char *arg, struct bank *b)
+{
+	struct bank banks[BANKS_NR];
+	const char *colon = strrchr(arg, ':');
+	char *file_name;
+	int n = bank_strton(colon ? colon + 1 : arg);
+
+	EXIT_ON(n < 0 || n >= BANKS_NR, "Invalid bank '%s'\n", arg);
+
+	if (colon) {
+		file_name = strndup(arg, colon - arg);
+		EXIT_ON(file_name == NULL, "%s: out of memory\n", __func__);
+		load_banks(file_name, banks);
+		*b = banks[n];
+		free(file_name);
+	} else {
+		EXIT_ON(sysex_get_bank(session(), b, n) < 0, "Error reading bank %s: no reply\n",
+			bank_ntostr(n));
+	}
+}
+
+/* Returns the last position given by the controller in buf, or pos */
+static int morph_midi(struct morph_input *in, const unsigned char *buf, size_t len, int pos)
+{
+	unsigned char c;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		c = buf[i];
+		if (c >= 0xf8)
+			continue;
+
+		if (c & 0x80) {
+			in->status = (c < 0xf0) ? c : 0;
+			in->ndata = 0;
+			continue;
+		}
+
+		if (!in->status)
+			continue;
+
+		in->data[in->ndata++] = c;
+		if (in->ndata < (((in->status & 0xe0) == 0xc0) ? 1 : 2))
+			continue;
+		in->ndata = 0;
+
+		if ((in->status & 0xf0) == 0xb0 && in->data[0] == control_cc)
+			pos = in->data[1] * MORPH_POS_MAX / 0x7f;
+	}
+
+	return pos;
+}
+
+/* Returns the last position on the complete lines in buf, or pos */
+static int morph_lines(struct morph_input *in, const char *buf, size_t len, int pos)
+{
+	char *end;
+	double v;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] != '\n' && in->len < sizeof(in->line) - 1) {
+			in->line[in->len++] = buf[i];
+			continue;
+		}
+		if (buf[i] != '\n')
+			continue;
+
+		in->line[in->len] = 0;
+		v = strtod(in->line, &end);
+		if (end != in->line)
+			pos = (v < 0) ? 0 : (v > 100) ? MORPH_POS_MAX : v * MORPH_POS_MAX / 100;
+		else if (*in->line)
+			info("Ignoring '%s': expected 0 - 100\n", in->line);
+		in->len = 0;
+	}
+
+	return pos;
+}
+
+/* Reads what input is waiting; returns the new position or an error */
+static int morph_read(struct morph_input *in, struct pollfd *pfds, int npfds, int pos)
+{
+	unsigned char buf[MORPH_BUF_SIZE];
+	unsigned short revents;
+	ssize_t n;
+	int err;
+
+	if (!in->t) {
+		n = read(STDIN_FILENO, buf, sizeof(buf));
+		if (n <= 0) {
+			in->eof = true;
+			return pos;
+		}
+
+		return morph_lines(in, (char *)buf, n, pos);
+	}
+
+	err = transport_revents(in->t, TRANSPORT_IN, pfds, npfds, &revents);
+	if (err < 0)
+		return err;
+	while ((n = transport_read(in->t, buf, sizeof(buf))) > 0)
+		pos = morph_midi(in, buf, n, pos);
+
+	if (n == -EPIPE || (revents & POLLERR))
+		in->eof = true;
+	else if (n != -EAGAIN)
+		return n;
+
+	return pos;
+}
+
+static void morph(char *argv[])
+{
+	struct morph_input in = { 0 };
+	struct bank a, b, frame, sent;
+	struct bank_cc cc[BANK_OPS_MAX];
+	struct pollfd pfds[8];
+	int npfds = 1, pos = -1, shown = -1, pending = -1, frames = 0;
+	int n, i, j, err;
+
+	REQUIRE_MIDI();
+
+	morph_source(argv[0], &a);
+	morph_source(argv[1], &b);
+
+	if (control_port) {
+		err = transport_open(&in.t, control_port);
+		EXIT_ON(err < 0, "Error opening %s: %s\n", control_port, transport_strerror(err));
+		npfds = transport_nfds(in.t, TRANSPORT_IN);
+		EXIT_ON(npfds <= 0 || npfds > lengthof(pfds), "%s: cannot poll\n", control_port);
+		transport_pollfds(in.t, TRANSPORT_IN, pfds, npfds);
+	} else {
+		pfds[0].fd = STDIN_FILENO;
+		pfds[0].events = POLLIN;
+	}
+
+	for (;;) {
+		n = poll(pfds, npfds, pending);
+		EXIT_ON(n < 0 && errno != EINTR, "%s: poll error (errno %d)\n", __func__, errno);
+
+		if (n > 0) {
+			pos = morph_read(&in, pfds, npfds, pos);
+			EXIT_ON(pos < 0, "Error reading %s: %s\n", control_port, transport_strerror(pos));
+		}
+
+		if (pos >= 0 && pos != shown) {
+			morph_bank(&frame, &a, &b, pos, morph_threshold * MORPH_POS_MAX / 100);
+			n = bank_diff_cc(frames ? &sent : NULL, &frame, cc, lengthof(cc));
+			for (i = 0; i < n; i++) {
+				for (j = 0; j < cc[i].n; j++)
+					pod_cc(session(), cc[i].cc[j], cc[i].val[j]);
+			}
+			debug("morph %d.%d%%: %d attributes\n", pos / 10, pos % 10, n);
+
+			sent = frame;
+			shown = pos;
+			frames++;
+		}
+
+		if (in.eof)
+			break;
+
+		pending = pod_cc_flush(session());
+	}
 
-	err = fsync(fd);
-	EXIT_ON(!!err, "Error closing file (fsync) (err %d, errno %d)\n", err, errno);
+	while ((pending = pod_cc_flush(session())) >= 0)
+		poll(NULL, 0, pending);
 
-	err = close(fd);
-	EXIT_ON(!!err, "Error closing file (err %d, errno %d)\n", err, errno);
+	transport_close(in.t);
 
-	info("Successfully wrote banks to '%s'\n", file_name);
+	if (verbose)
+		info("Sent %d frames.\n", frames);
 }
 
-static void load_banks(const char *file_name, struct bank b[])
-{
-	int err;
-	int fd;
-
-	fd = open(file_name, O_RDONLY);
-	EXIT_ON(fd <= 0, "Error reading file: %s (fd %d, errno %d)\n", file_name, fd, errno);
+/*
+ * Monitor: a line per message received, starting with the wall clock
+ * time it was read and its kind:
+ *
+ *   cc <channel> <controller> <value> [attr=value]
+ *   program <channel> <program> [bank]
+ *   note_on, pitch_bend, ... <channel> <data>
+ *   dump <bank|edit> name="..." attr=value ...
+ *   sysex <hex bytes>
+ *   realtime <clock|start|continue|stop|active_sensing|reset>
+ *
+ * Attribute values are scaled as set and tweak take them. Controllers
+ * are decoded against the last edit buffer seen (from dumps and program
+ * changes), which decides between the effect-dependent attributes. Each
+ * record is written with a single write(), nothing is held back.
+ */
+#define MONITOR_LINE_MAX	4096
+#define DUMP_NIBBLES		(BANK_SIZE * 2)
+
+struct monitor {
+	struct bank edit;
+	struct bank banks[BANKS_NR];
+	bool known[BANKS_NR];
+	char line[MONITOR_LINE_MAX];
+	int len;
+};
 
-	err = read(fd, b, sizeof(struct bank) * BANKS_NR);
-	EXIT_ON(err != sizeof(struct bank) * BANKS_NR, "Error reading banks (file size mismatch)\n");
+static void monitor_printf(struct monitor *m, const char *fmt, ...)
+{
+	va_list ap;
+	int room = sizeof(m->line) - m->len;
 
-	close(fd);
+	va_start(ap, fmt);
+	m->len += vsnprintf(m->line + m->len, (room > 0) ? room : 0, fmt, ap);
+	va_end(ap);
 }
 
-static void list(char *argv[])
+static void monitor_attr(struct monitor *m, struct bank *b, int op)
 {
-	const char *file_name = argv[0];
-	int i;
-	struct bank b[BANKS_NR];
+	int room = sizeof(m->line) - m->len;
 
-	load_banks(file_name, b);
+	m->len += sprint_bank_op(m->line + m->len, (room > 0) ? room : 0, b, op);
+}
 
-	for (i = 0; i < BANKS_NR; i++) {
-		printf("Bank: %s (%d)\n", bank_ntostr(i), i);
-		print_bank(&b[i]);
-		printf("\n");
+static void monitor_channel(struct monitor *m, const unsigned char *d, size_t len)
+{
+	static const char *kinds[] = {
+		"note_off", "note_on", "key_pressure", "cc",
+		"program", "channel_pressure", "pitch_bend",
+	};
+	int kind = (d[0] >> 4) & 0x7, ch = (d[0] & 0x0f) + 1;
+	int op;
+
+	switch (d[0] & 0xf0) {
+	case 0xb0:
+		monitor_printf(m, "cc %d %d %d", ch, d[1], d[2]);
+		op = bank_apply_cc(&m->edit, d[1], d[2]);
+		if (op >= 0) {
+			monitor_printf(m, " ");
+			monitor_attr(m, &m->edit, op);
+		}
+		break;
+	case 0xc0:
+		monitor_printf(m, "program %d %d", ch, d[1]);
+		if (d[1] > 0 && d[1] <= BANKS_NR) {
+			monitor_printf(m, " %s", bank_ntostr(d[1] - 1));
+			if (m->known[d[1] - 1])
+				m->edit = m->banks[d[1] - 1];
+		}
+		break;
+	case 0xd0:
+		monitor_printf(m, "%s %d %d", kinds[kind], ch, d[1]);
+		break;
+	case 0xe0:
+		monitor_printf(m, "%s %d %d", kinds[kind], ch, (d[2] << 7 | d[1]) - 0x2000);
+		break;
+	default:
+		monitor_printf(m, "%s %d %d %d", kinds[kind], ch, d[1], d[2]);
+		break;
 	}
 }
 
-static void restore(char *argv[])
+/* Program (bank) and edit buffer dumps are decoded, anything else shown raw */
+static void monitor_sysex(struct monitor *m, const unsigned char *d, size_t len)
 {
-	const char *file_name = argv[0];
-	struct bank b[BANKS_NR];
+	static const unsigned char dump[] = { 0x00, 0x01, 0x0c, 0x01, 0x01 };
+	unsigned char *bytes;
+	const unsigned char *p;
+	struct bank b, *dst = &m->edit;
+	char name[BANK_NAME_LEN + 1];
+	int i, n = -1, room;
+
+	if (len < sizeof(dump) + 1 + DUMP_NIBBLES || memcmp(d, dump, sizeof(dump)) != 0) {
+		monitor_printf(m, "sysex");
+		for (i = 0; i < len; i++)
+			monitor_printf(m, " %02x", d[i]);
+		return;
+	}
 
-	REQUIRE_MIDI();
+	/* The nibbles are the last part of the message, after any version byte */
+	bytes = (unsigned char *)&b;
+	p = d + len - DUMP_NIBBLES;
+	for (i = 0; i < BANK_SIZE; i++, p += 2)
+		bytes[i] = (p[0] << 4) | p[1];
 
-	load_banks(file_name, b);
-	sysex_set_all(port_name, b);
-}
+	if (d[sizeof(dump)] == 0x00) {
+		n = d[sizeof(dump) + 1];
+		if (n >= BANKS_NR)
+			n = -1;
+	}
 
-#define STRNCMP_USER_CONST(ustr, cstr)	strncmp(ustr, cstr, strlen(cstr));
-static void name(char *argv[])
-{
-	const char *s = argv[0];
-	size_t slen;
-	struct bank b;
+	if (n >= 0) {
+		dst = &m->banks[n];
+		m->known[n] = true;
+		monitor_printf(m, "dump %s", bank_ntostr(n));
+	} else {
+		monitor_printf(m, "dump edit");
+	}
+	*dst = b;
 
-	REQUIRE_MIDI();
-	REQUIRE_BANK();
+	bank_name_str(name, &b);
+	for (i = strlen(name); i > 0 && name[i - 1] == ' '; i--)
+		name[i - 1] = 0;
+	monitor_printf(m, " name=\"%s\" ", name);
 
-	slen = strlen(s);
-	EXIT_ON(slen > 16, "Maximum bank name length (16) exceeded\n");
+	room = sizeof(m->line) - m->len;
+	m->len += sprint_bank(m->line + m->len, (room > 0) ? room : 0, &b);
+}
+
+static void monitor_event(const struct midi_event *ev, void *arg)
+{
+	static const char *realtime[] = {
+		[0x0] = "clock", [0x2] = "start", [0x3] = "continue",
+		[0x4] = "stop", [0x6] = "active_sensing", [0x7] = "reset",
+	};
+	struct monitor *m = arg;
+	const char *rt;
+	ssize_t n;
+	int off;
+
+	m->len = 0;
+	monitor_printf(m, "%lld.%06lld ", ev->us / 1000000, ev->us % 1000000);
+
+	switch (ev->type) {
+	case MIDI_CHANNEL:
+		monitor_channel(m, ev->data, ev->len);
+		break;
+	case MIDI_SYSEX:
+		monitor_sysex(m, ev->data, ev->len);
+		break;
+	case MIDI_REALTIME:
+		rt = realtime[ev->data[0] - 0xf8];
+		if (rt)
+			monitor_printf(m, "realtime %s", rt);
+		else
+			monitor_printf(m, "realtime %02x", ev->data[0]);
+		break;
+	}
 
-	sysex_get_bank(port_name, &b, bank_n);
-	memset(b.bank_name, 20, BANK_NAME_LEN);
-	memcpy(b.bank_name, s, slen);
-	sysex_set_bank(port_name, &b, bank_n);
+	if (m->len > sizeof(m->line) - 1)
+		m->len = sizeof(m->line) - 1;
+	m->line[m->len++] = '\n';
 
-	fprintf(stderr, "Set bank name to '%s'\n", s);
+	for (off = 0; off < m->len; off += n) {
+		n = write(STDOUT_FILENO, m->line + off, m->len - off);
+		if (n < 0 && errno == EINTR)
+			n = 0;
+		EXIT_ON(n < 0, "Error writing records (errno %d)\n", errno);
+	}
 }
 
-static void set(char *argv[])
+static void monitor(char *argv[])
 {
-	struct bank b;
+	struct monitor *m;
+	int err;
 
 	REQUIRE_MIDI();
-	REQUIRE_BANK();
 
-	sysex_get_bank(port_name, &b, bank_n);
-	set_scaled_bank_param(&b, argv[0], argv[1]);
-	sysex_set_bank(port_name, &b, bank_n);
-	print_bank(&b);
+	m = calloc(1, sizeof(*m));
+	EXIT_ON(m == NULL, "%s: out of memory\n", __func__);
+
+	err = pod_monitor(session(), monitor_event, m);
+	if (err != -EPIPE)
+		info("Monitoring stopped: %s\n", transport_strerror(err));
+
+	free(m);
 }
 
 static void setdirect(char *argv[])
@@ -200,15 +2049,24 @@ static void setdirect(char *argv[])
 	REQUIRE_MIDI();
 	REQUIRE_BANK();
 
-	sysex_get_bank(port_name, &b, bank_n);
+	read_bank(&b);
 	set_direct_bank_param(&b, argv[0], argv[1]);
-	sysex_set_bank(port_name, &b, bank_n);
+	sysex_set_bank(session(), &b, bank_n);
 	print_bank(&b);
 }
 
 static void attr(char *argv[])
 {
-	print_bank_ops();
+	int op;
+
+	if (output_format == FORMAT_TEXT) {
+		print_bank_ops();
+		return;
+	}
+
+	format_write(sprint_bank_ops_header(format_buf, sizeof(format_buf), output_format));
+	for (op = 0; op < bank_op_count(); op++)
+		format_write(sprint_bank_op_fmt(format_buf, sizeof(format_buf), output_format, op));
 }
 
 static void writeb(char *argv[])
@@ -224,9 +2082,9 @@ static void writeb(char *argv[])
 	REQUIRE_MIDI();
 	REQUIRE_BANK();
 
-	sysex_get_bank(port_name, &b, bank_n);
+	read_bank(&b);
 	*((char *)(raw + offset)) = val;
-	sysex_set_bank(port_name, &b, bank_n);
+	sysex_set_bank(session(), &b, bank_n);
 	print_bank(&b);
 }
 
@@ -238,54 +2096,522 @@ static void select(char *argv[])
 	REQUIRE_BANK();
 
 	/* Bank program numbers are one-base */
-	program_change(port_name, bank_n + 1);
+	program_change(session(), bank_n + 1);
 }
 
 static void manual(char *argv[])
 {
 	REQUIRE_MIDI();
 
-	program_change(port_name, PROGRAM_MANUAL);
+	program_change(session(), PROGRAM_MANUAL);
 }
 
 static void tuner(char *argv[])
 {
 	REQUIRE_MIDI();
 
-	program_change(port_name, PROGRAM_TUNER);
+	program_change(session(), PROGRAM_TUNER);
+}
+
+/*
+ * Routing: events from a controller (--control) become program and
+ * control changes on the device, by '<input> <output>' lines:
+ *
+ *   input:  note <n> | pc <n> | cc <n>      (on any channel)
+ *   output: select <bank> | manual | tuner | attr=value | attr
+ *
+ * A note fires on note on, and a controller mapped to a fixed output
+ * once it reaches 64 (a footswitch press). A controller mapped to a
+ * bare attr sweeps it over its whole range. The table is built before
+ * the first event, so an event costs a lookup and a write. Its latency
+ * runs from the read that brought it to the write that handed its
+ * output to the kernel; paced control changes count until all queued
+ * ones are out.
+ */
+#define ROUTE_BUF_SIZE	256
+#define ROUTE_WAIT_MAX	256
+
+enum { ROUTE_NOTE, ROUTE_PC, ROUTE_CC, ROUTE_INPUTS };
+enum { ROUTE_NONE, ROUTE_PROGRAM, ROUTE_FIXED, ROUTE_SWEEP };
+
+struct route {
+	unsigned char action;
+	unsigned char program;	/* ROUTE_PROGRAM */
+	int op;			/* ROUTE_SWEEP */
+	struct bank_cc cc;	/* ROUTE_FIXED */
+};
+
+struct route_input {
+	struct transport *t;
+	unsigned char status;	/* MIDI running status */
+	unsigned char data[2];
+	int ndata;
+};
+
+static const char *route_inputs[ROUTE_INPUTS] = { "note", "pc", "cc" };
+static struct route routes[ROUTE_INPUTS][128];
+static struct bank route_bank;			/* Scratch for sweeps */
+static long long route_wait[ROUTE_WAIT_MAX];	/* Read times of events still queued */
+static int route_nwait;
+static int route_events;
+static struct us_hist route_latency;
+static volatile sig_atomic_t route_stop;
+
+static void route_output(struct route *r, char *tok, char **line, int lineno)
+{
+	char *arg;
+	int n, err;
+
+	if (strcmp(tok, "select") == 0) {
+		r->action = ROUTE_PROGRAM;
+		arg = batch_token(line);
+		n = arg ? bank_strton(arg) : -1;
+		EXIT_ON(n < 0 || n >= BANKS_NR, "line %d: select needs a bank (1A - 9D)\n", lineno);
+		r->program = n + 1;
+	} else if (strcmp(tok, "manual") == 0) {
+		r->action = ROUTE_PROGRAM;
+		r->program = PROGRAM_MANUAL;
+	} else if (strcmp(tok, "tuner") == 0) {
+		r->action = ROUTE_PROGRAM;
+		r->program = PROGRAM_TUNER;
+	} else if ((arg = strchr(tok, '='))) {
+		r->action = ROUTE_FIXED;
+		*arg++ = 0;
+		err = set_cc_bank_param(&route_bank, tok, arg, false, &r->cc);
+		EXIT_ON(err, "line %d: invalid output\n", lineno);
+	} else {
+		r->action = ROUTE_SWEEP;
+		r->op = bank_op_lookup(&route_bank, tok, false);
+		EXIT_ON(r->op < 0, "line %d: unknown output '%s'\n", lineno, tok);
+		EXIT_ON(set_cc_bank_op_pos(&route_bank, r->op, 0, &r->cc) != 0,
+			"line %d: '%s' has no MIDI controller\n", lineno, tok);
+	}
+}
+
+static void route_load(const char *file_name)
+{
+	struct route *r;
+	int lineno = 0, in, n;
+	char *buf, *line, *nl, *tok, *end;
+	FILE *f;
+
+	f = strcmp(file_name, "-") ? fopen(file_name, "r") : stdin;
+	EXIT_ON(f == NULL, "Error reading file: %s (errno %d)\n", file_name, errno);
+	buf = read_all(f);
+	if (f != stdin)
+		fclose(f);
+
+	for (line = buf; line; line = nl ? nl + 1 : NULL) {
+		nl = strchr(line, '\n');
+		if (nl)
+			*nl = 0;
+		lineno++;
+
+		tok = batch_token(&line);
+		if (!tok)
+			continue;
+
+		for (in = 0; in < ROUTE_INPUTS; in++) {
+			if (strcmp(tok, route_inputs[in]) == 0)
+				break;
+		}
+		EXIT_ON(in == ROUTE_INPUTS, "line %d: expected note, pc or cc, got '%s'\n",
+			lineno, tok);
+
+		tok = batch_token(&line);
+		n = tok ? strtol(tok, &end, 0) : -1;
+		EXIT_ON(!tok || *end || n < 0 || n > 127, "line %d: %s needs a number (0 - 127)\n",
+			lineno, route_inputs[in]);
+
+		r = &routes[in][n];
+		EXIT_ON(r->action != ROUTE_NONE, "line %d: %s %d is already mapped\n", lineno,
+			route_inputs[in], n);
+
+		tok = batch_token(&line);
+		EXIT_ON(!tok, "line %d: missing output\n", lineno);
+		route_output(r, tok, &line, lineno);
+		EXIT_ON(r->action == ROUTE_SWEEP && in != ROUTE_CC,
+			"line %d: only a controller can sweep an attribute\n", lineno);
+		EXIT_ON(batch_token(&line), "line %d: one output per line\n", lineno);
+	}
+
+	free(buf);
+}
+
+/* Sends queued control changes; once none are left, the events that queued them are done */
+static int route_flush()
+{
+	int pending = pod_cc_flush(session());
+	long long now;
+	int i;
+
+	if (pending < 0 && route_nwait) {
+		now = now_us();
+		for (i = 0; i < route_nwait; i++)
+			hist_add(&route_latency, now - route_wait[i]);
+		route_nwait = 0;
+	}
+
+	return pending;
+}
+
+/* Sends what an event is mapped to */
+static void route_event(unsigned char status, const unsigned char *data, long long us)
+{
+	struct route *r;
+	struct bank_cc cc;
+	int i;
+
+	switch (status & 0xf0) {
+	case 0x90:
+		r = &routes[ROUTE_NOTE][data[0]];
+		if (!data[1])
+			return;
+		break;
+	case 0xc0:
+		r = &routes[ROUTE_PC][data[0]];
+		break;
+	case 0xb0:
+		r = &routes[ROUTE_CC][data[0]];
+		if (r->action != ROUTE_SWEEP && data[1] < 0x40)
+			return;
+		break;
+	default:
+		return;
+	}
+
+	switch (r->action) {
+	case ROUTE_PROGRAM:
+		/* Changes queued before it are meant for the bank it leaves */
+		while ((i = route_flush()) >= 0)
+			poll(NULL, 0, i);
+		program_change(session(), r->program);
+		hist_add(&route_latency, now_us() - us);
+		route_events++;
+		return;
+	case ROUTE_SWEEP:
+		if (set_cc_bank_op_pos(&route_bank, r->op, data[1], &cc) != 0)
+			return;
+		break;
+	case ROUTE_FIXED:
+		cc = r->cc;
+		break;
+	default:
+		return;
+	}
+
+	for (i = 0; i < cc.n; i++)
+		pod_cc(session(), cc.cc[i], cc.val[i]);
+	if (route_nwait < ROUTE_WAIT_MAX)
+		route_wait[route_nwait++] = us;
+	route_events++;
+}
+
+static void route_midi(struct route_input *in, const unsigned char *buf, size_t len,
+		       long long us)
+{
+	unsigned char c;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		c = buf[i];
+		if (c >= 0xf8)
+			continue;
+
+		if (c & 0x80) {
+			in->status = (c < 0xf0) ? c : 0;
+			in->ndata = 0;
+			continue;
+		}
+
+		if (!in->status)
+			continue;
+
+		in->data[in->ndata++] = c;
+		if (in->ndata < (((in->status & 0xe0) == 0xc0) ? 1 : 2))
+			continue;
+		in->ndata = 0;
+
+		route_event(in->status, in->data, us);
+	}
+}
+
+static void route_sig(int sig)
+{
+	route_stop = 1;
+}
+
+static void route(char *argv[])
+{
+	struct sigaction sa = { .sa_handler = route_sig };
+	struct route_input in = { 0 };
+	unsigned char buf[ROUTE_BUF_SIZE];
+	struct pollfd pfds[8];
+	unsigned short revents;
+	int npfds, pending = -1, n, err;
+	bool eof = false;
+	ssize_t len;
+
+	REQUIRE_MIDI();
+	EXIT_ON(!control_port, "route needs the controller's port (--control)\n");
+
+	route_load(argv[0]);
+
+	err = transport_open(&in.t, control_port);
+	EXIT_ON(err < 0, "Error opening %s: %s\n", control_port, transport_strerror(err));
+	npfds = transport_nfds(in.t, TRANSPORT_IN);
+	EXIT_ON(npfds <= 0 || npfds > lengthof(pfds), "%s: cannot poll\n", control_port);
+	transport_pollfds(in.t, TRANSPORT_IN, pfds, npfds);
+
+	/* The handshake is done before the first event, not on it */
+	session();
+
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	while (!eof && !route_stop) {
+		n = poll(pfds, npfds, pending);
+		EXIT_ON(n < 0 && errno != EINTR, "%s: poll error (errno %d)\n", __func__, errno);
+
+		if (n > 0) {
+			err = transport_revents(in.t, TRANSPORT_IN, pfds, npfds, &revents);
+			EXIT_ON(err < 0, "Error reading %s: %s\n", control_port, transport_strerror(err));
+			while ((len = transport_read(in.t, buf, sizeof(buf))) > 0)
+				route_midi(&in, buf, len, now_us());
+
+			if (len == -EPIPE || (revents & POLLERR))
+				eof = true;
+			else
+				EXIT_ON(len != -EAGAIN, "Error reading %s: %s\n", control_port,
+					transport_strerror(len));
+		}
+
+		pending = route_flush();
+	}
+
+	while ((pending = route_flush()) >= 0)
+		poll(NULL, 0, pending);
+
+	transport_close(in.t);
+
+	info("Routed %d events.\n", route_events);
+	if (route_latency.n)
+		info("Latency: 50%% < %ld us, 90%% < %ld us, 99%% < %ld us, max < %ld us\n",
+		     hist_pct(&route_latency, 50), hist_pct(&route_latency, 90),
+		     hist_pct(&route_latency, 99), hist_pct(&route_latency, 100));
+}
+
+/*
+ * Patch library: 'library index dir ...' indexes the banks of the save
+ * files found under the directories, 'library search term ...' lists
+ * those that match all terms.
+ */
+static void library(char *argv[])
+{
+	long long start = now_us();
+	int n;
+
+	if (strcmp(argv[0], "index") == 0) {
+		EXIT_ON(!argv[1], "library index needs a directory\n");
+		n = library_index(index_path(), &argv[1]);
+		info("Indexed %d banks in %s\n", n, index_path());
+	} else if (strcmp(argv[0], "search") == 0) {
+		n = library_search(index_path(), &argv[1]);
+		if (verbose)
+			info("%d banks in %lld us\n", n, now_us() - start);
+		exit(n ? 0 : 1);
+	} else {
+		EXIT_ON(true, "Unknown library command '%s' (index or search)\n", argv[0]);
+	}
+}
+
+static void parse_options(const int argc, char *argv[]);
+
+/* Runs a command received by the daemon, in a child holding the session */
+static int serve_exec(int argc, char *argv[])
+{
+	nodaemon = true;
+	nports = 0;
+	optind = 0;
+
+	parse_options(argc, argv);
+	pod_flush(pod);
+
+	return 0;
+}
+
+static void serve(char *argv[])
+{
+	REQUIRE_MIDI();
+	EXIT_ON(nports > 1, "The daemon serves a single port\n");
+
+	session();
+	daemon_serve(port_name, serve_exec);
+}
+
+/*
+ * Startup benchmark: a fresh process opens the port and writes the
+ * identity request, as a run does before its first command. A fresh
+ * process pays for whatever the transport loads on first use, such as
+ * alsa-lib's configuration, which is what hw: and raw: differ in.
+ */
+#define BENCH_RUNS	20
+
+static int bench_cmp(const void *a, const void *b)
+{
+	long x = *(const long *)a, y = *(const long *)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Returns the time taken in us, or -1 if the port could not be opened */
+static long bench_once(const char *port)
+{
+	static const unsigned char hello[] = { SYSEX_START, 0x7e, 0x7f, 0x06, 0x01, SYSEX_END };
+	struct transport *t;
+	long long start;
+	long us = -1;
+	int p[2];
+	pid_t pid;
+
+	EXIT_ON(pipe(p) < 0, "Error creating pipe (errno %d)\n", errno);
+	pid = fork();
+	EXIT_ON(pid < 0, "Error forking (errno %d)\n", errno);
+
+	if (pid == 0) {
+		close(p[0]);
+		start = now_us();
+		if (transport_open(&t, port) == 0) {
+			if (transport_write_all(t, hello, sizeof(hello)) == sizeof(hello))
+				us = now_us() - start;
+			transport_close(t);
+		}
+		_exit(write(p[1], &us, sizeof(us)) != sizeof(us));
+	}
+
+	close(p[1]);
+	if (read(p[0], &us, sizeof(us)) != sizeof(us))
+		us = -1;
+	close(p[0]);
+	waitpid(pid, NULL, 0);
+
+	return us;
+}
+
+static void bench(char *argv[])
+{
+	long us[1000];
+	int runs = BENCH_RUNS;
+	int i, n;
+
+	REQUIRE_MIDI();
+	if (argv[0]) {
+		runs = strtol(argv[0], NULL, 0);
+		EXIT_ON(runs < 1 || runs > lengthof(us), "Runs must be 1 - %zu\n", lengthof(us));
+	}
+
+	printf("%-24s %9s %9s %9s %9s  (ms, open to first message written)\n",
+	       "Port", "min", "median", "p90", "max");
+	for (i = 0; i < nports; i++) {
+		for (n = 0; n < runs; n++) {
+			us[n] = bench_once(ports[i]);
+			if (us[n] < 0)
+				break;
+		}
+		if (n < runs) {
+			printf("%-24s cannot be opened\n", ports[i]);
+			continue;
+		}
+
+		qsort(us, runs, sizeof(us[0]), bench_cmp);
+		printf("%-24s %9.3f %9.3f %9.3f %9.3f\n", ports[i], us[0] / 1000.0,
+		       us[runs / 2] / 1000.0, us[runs * 9 / 10] / 1000.0, us[runs - 1] / 1000.0);
+	}
 }
 
+/* Operation flags */
+#define OP_DEVICE	0x01	/* Talks to the device; may be passed to a daemon */
+#define OP_PROGRAM	0x02	/* Program change; queued ones may be coalesced */
+#define OP_VARARGS	0x04	/* argc is the minimum number of arguments */
+
 struct op_desc {
 	const char *name;
 	int argc;
+	int flags;
 	void (*op)(char *[]);
 };
 
-#define OP(op_name, c) {\
+#define OPF(op_name, c, f) {\
 	.name = #op_name,\
 	.op = op_name,\
 	.argc = c,\
+	.flags = f,\
 }
+#define OP(op_name, c) OPF(op_name, c, 0)
 
-#define lengthof(x) ((size_t)(sizeof(x) / sizeof(__typeof__(*x))))
 static struct op_desc ops[] = {
-	OP(query, 0),
-	OP(save, 1),
-	OP(restore, 1),
+	OPF(query, 0, OP_DEVICE),
+	OPF(save, 1, OP_DEVICE),
+	OPF(restore, 1, OP_DEVICE),
+	OPF(diff, 1, OP_DEVICE | OP_VARARGS),
 	OP(list, 1),
-	OP(name, 1),
-	OP(set, 2),
-	OP(setdirect, 2),
+	OPF(name, 1, OP_DEVICE),
+	OPF(set, 1, OP_DEVICE | OP_VARARGS),
+	OPF(batch, 1, OP_DEVICE),
+	OPF(tweak, 1, OP_DEVICE | OP_VARARGS),
+	OPF(automate, 1, OP_DEVICE),
+	OPF(morph, 2, OP_DEVICE),
+	OPF(monitor, 0, OP_DEVICE),
+	OPF(setdirect, 2, OP_DEVICE),
 	OP(attr, 0),
-	OP(writeb, 2),
-	OP(select, 0),
-	OP(manual, 0),
-	OP(tuner, 0),
+	OPF(writeb, 2, OP_DEVICE),
+	OPF(select, 0, OP_DEVICE | OP_PROGRAM),
+	OPF(manual, 0, OP_DEVICE | OP_PROGRAM),
+	OPF(tuner, 0, OP_DEVICE | OP_PROGRAM),
+	OPF(route, 1, OP_DEVICE),
+	OP(serve, 0),
+	OP(discover, 0),
+	OPF(bench, 0, OP_VARARGS),
+	OPF(library, 1, OP_VARARGS),
+	OPF(compile, 2, OP_VARARGS),
+};
+
+enum {
+	OPT_DIFF = 0x100,
+	OPT_VERIFY,
+	OPT_CONTROL,
+	OPT_CC,
+	OPT_THRESHOLD,
+	OPT_TIMEOUT,
+	OPT_CACHE,
+	OPT_INDEX,
+	OPT_STORE,
+	OPT_FORMAT,
+	OPT_BASE,
+};
+
+static const char *verify_policies[] = {
+	[VERIFY_NONE] = "none",
+	[VERIFY_IMMEDIATE] = "immediate",
+	[VERIFY_DEFERRED] = "deferred",
+	[VERIFY_SAMPLED] = "sampled",
 };
 
+static int verify_strton(const char *s)
+{
+	int i;
+
+	for (i = 0; i < lengthof(verify_policies); i++) {
+		if (strcmp(s, verify_policies[i]) == 0)
+			return i;
+	}
+
+	return -EINVAL;
+}
+
 static void parse_options(const int argc, char *argv[])
 {
-	static const char shopts[] = "hp:Dovb:";
+	static const char shopts[] = "hp:Dovb:w:";
 	static const struct option longopts[] = {
 		{
 			.name = "help",
@@ -299,6 +2625,78 @@ static void parse_options(const int argc, char *argv[])
 			.flag = &nohello,
 			.val = true
 		},
+		{
+			.name = "no-daemon",
+			.has_arg = 0,
+			.flag = &nodaemon,
+			.val = true
+		},
+		{
+			.name = "diff",
+			.has_arg = optional_argument,
+			.flag = NULL,
+			.val = OPT_DIFF
+		},
+		{
+			.name = "verify",
+			.has_arg = required_argument,
+			.flag = NULL,
+			.val = OPT_VERIFY
+		},
+		{
+			.name = "control",
+			.has_arg = required_argument,
+			.flag = NULL,
+			.val = OPT_CONTROL
+		},
+		{
+			.name = "cc",
+			.has_arg = required_argument,
+			.flag = NULL,
+			.val = OPT_CC
+		},
+		{
+			.name = "threshold",
+			.has_arg = required_argument,
+			.flag = NULL,
+			.val = OPT_THRESHOLD
+		},
+		{
+			.name = "timeout",
+			.has_arg = required_argument,
+			.flag = NULL,
+			.val = OPT_TIMEOUT
+		},
+		{
+			.name = "cache",
+			.has_arg = optional_argument,
+			.flag = NULL,
+			.val = OPT_CACHE
+		},
+		{
+			.name = "index",
+			.has_arg = required_argument,
+			.flag = NULL,
+			.val = OPT_INDEX
+		},
+		{
+			.name = "store",
+			.has_arg = required_argument,
+			.flag = NULL,
+			.val = OPT_STORE
+		},
+		{
+			.name = "format",
+			.has_arg = required_argument,
+			.flag = NULL,
+			.val = OPT_FORMAT
+		},
+		{
+			.name = "base",
+			.has_arg = required_argument,
+			.flag = NULL,
+			.val = OPT_BASE
+		},
 		{ 0 }
 	};
 	int optskip = 0;
@@ -315,7 +2713,10 @@ static void parse_options(const int argc, char *argv[])
 				print_help();
 				exit(0);
 			case 'p':
-				port_name = optarg;
+				if (strpbrk(optarg, "*?["))
+					add_port_glob(optarg);
+				else
+					add_port(optarg);
 				break;
 			case 'o':
 				overwrite = true;
@@ -329,9 +2730,61 @@ static void parse_options(const int argc, char *argv[])
 			case 'b':
 				bank_n = bank_strton(optarg);
 				break;
+			case OPT_DIFF:
+				restore_diff = true;
+				diff_snapshot = optarg;
+				break;
+			case OPT_VERIFY:
+				verify_policy = verify_strton(optarg);
+				EXIT_ON(verify_policy < 0, "Unknown verification mode '%s'\n", optarg);
+				break;
+			case OPT_CONTROL:
+				control_port = optarg;
+				break;
+			case OPT_CC:
+				control_cc = strtol(optarg, NULL, 0);
+				EXIT_ON(control_cc < 0 || control_cc > 127, "Controller must be 0 - 127\n");
+				break;
+			case OPT_THRESHOLD:
+				morph_threshold = strtol(optarg, NULL, 0);
+				EXIT_ON(morph_threshold < 0 || morph_threshold > 100, "Threshold must be 0 - 100\n");
+				break;
+			case OPT_TIMEOUT:
+				probe_timeout = strtol(optarg, NULL, 0);
+				EXIT_ON(probe_timeout < 1 || probe_timeout > 60000, "Timeout must be 1 - 60000 ms\n");
+				break;
+			case OPT_CACHE:
+				use_cache = true;
+				cache_file = optarg;
+				break;
+			case OPT_INDEX:
+				index_file = optarg;
+				break;
+			case OPT_STORE:
+				store_dir = optarg;
+				break;
+			case OPT_FORMAT:
+				output_format = format_strton(optarg);
+				EXIT_ON(output_format < 0, "Format must be text, json, csv or tsv\n");
+				break;
+			case OPT_BASE:
+				base_file = optarg;
+				break;
+			case 'w':
+				dump_depth = strtol(optarg, NULL, 0);
+				EXIT_ON(dump_depth < 1 || dump_depth > BANKS_NR, "Dump depth must be 1 - %d\n", BANKS_NR);
+				break;
 		}
 	}
 
+	for (n = 0; n < nports; n++) {
+		if (ports[n][0] == '@')
+			ports[n] = port_alias(ports[n] + 1);
+	}
+
+	if (nports)
+		port_name = ports[0];
+
 	if (optind == argc) {
 		printf("Please specify command.\n");
 		print_help();
@@ -343,21 +2796,44 @@ static void parse_options(const int argc, char *argv[])
 			break;
 	}
 
-	if (n >= lengthof(ops) || optind != (argc - ops[n].argc - 1)) {
+	if (n >= lengthof(ops) ||
+	    ((ops[n].flags & OP_VARARGS) ? argc - optind - 1 < ops[n].argc
+					 : optind != (argc - ops[n].argc - 1))) {
 		printf("Invalid invocation (%d : %d).\n", optind, (argc - ops[n].argc));
 		print_help();
 		exit(0);
 	}
 
+	if ((ops[n].flags & OP_DEVICE) && nports == 1 && !nodaemon) {
+		c = daemon_client(port_name, (ops[n].flags & OP_PROGRAM) ? DAEMON_COALESCE : 0,
+				  argc, argv);
+		if (c >= 0)
+			exit(c);
+	}
+
 	ops[n].op(&argv[optind + 1]);
 }
 
 int main(int argc, char *argv[])
 {
+	const char *prog = strrchr(argv[0], '/');
+	char *dargv[argc + 2];
+
+	srand(time(NULL) ^ getpid());
+
+	/* Invoked as pod6ctld: serve the port given with -p */
+	if (strcmp(prog ? prog + 1 : argv[0], CLIENT_NAME "d") == 0) {
+		memcpy(dargv, argv, argc * sizeof(*argv));
+		dargv[argc++] = "serve";
+		dargv[argc] = NULL;
+		argv = dargv;
+	}
+
 	EXIT_ON(sizeof(struct bank) != BANK_SIZE,"struct bank %ld != BANK_SIZE %d\n",
 		sizeof(struct bank), BANK_SIZE);
 
 	parse_options(argc, argv);
+	pod_close(pod);
 	
 	return 0;
 }
@@ -49,5 +49,8 @@ extern bool debug_mode;
 #define info(args...) do { fprintf(stderr, args); } while (0)
 
 extern int nohello;
+extern int dump_depth;
+extern int verify_policy;
+extern int probe_timeout;
 
 #endif
@@ -0,0 +1,751 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  Virtual POD 2.3 (Emulator)
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 600
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <termios.h>
+#include <time.h>
+#include <sys/poll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "pod6ctl.h"
+#include "bank.h"
+#include "transport.h"
+
+/*
+ * Speaks the subset of the POD 2.3 protocol that pod6ctl uses: the
+ * identity request, bank dump and bank store SysEx messages, and program
+ * changes. Replies can be paced at the MIDI wire rate, delayed, jittered,
+ * dropped and reordered, so timing behaviour can be measured without
+ * hardware.
+ */
+
+#define EMU_QUEUE	64
+#define EMU_MSG_MAX	(BANK_SIZE * 2 + 16)
+#define EMU_CHUNK	16	/* Bytes written per paced write */
+#define RX_SLACK_US	2000	/* Wire time an idle link may make up for */
+
+bool debug_mode;
+bool verbose;
+int nohello;
+int dump_depth;
+int verify_policy;
+
+struct reply {
+	long long due;		/* us, monotonic */
+	size_t len;
+	size_t off;
+	unsigned char msg[EMU_MSG_MAX];
+};
+
+static struct {
+	/* Device state */
+	struct bank banks[BANKS_NR];
+	struct bank edit;
+	int program;
+
+	/* Link */
+	struct transport *t;
+	struct pollfd pfds[8];
+	int npfds;
+
+	/* Impairments */
+	long baud;
+	long delay_us;
+	long jitter_us;
+	int reorder_pct;
+	int drop_pct;
+	long store_us;		/* time to process a store; stores arriving meanwhile are lost */
+	long long busy_until;
+
+	/* Receive framing */
+	unsigned char sybuf[EMU_MSG_MAX];
+	size_t sylen;
+	bool sysex;
+	unsigned char status;
+	unsigned char data[2];
+	int ndata;
+	long long rx_wire;	/* when the last received byte was fully on the wire */
+
+	/* Transmit queue, in wire order */
+	struct reply *q[EMU_QUEUE];
+	int nq;
+	struct reply *held;	/* reply held back to be sent out of order */
+	long long tx_wire;
+
+	/* Statistics */
+	long requests;
+	long replies;
+	long dropped;
+	long reordered;
+	long stores;
+	long busy;
+	long tx_bytes;
+	long rx_bytes;
+} emu;
+
+static volatile sig_atomic_t terminate;
+
+static long long now_us()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Wire time of n bytes: 10 bits per byte */
+static long long wire_us(size_t n)
+{
+	return emu.baud ? (long long)n * 10 * 1000000 / emu.baud : 0;
+}
+
+static bool chance(int pct)
+{
+	return pct > 0 && (rand() % 100) < pct;
+}
+
+static void emu_queue(struct reply *r)
+{
+	if (emu.nq == EMU_QUEUE) {
+		info("podemu: transmit queue full, dropping reply\n");
+		free(r);
+		return;
+	}
+
+	emu.q[emu.nq++] = r;
+}
+
+static void emu_reply(const unsigned char *msg, size_t len, long long start)
+{
+	struct reply *r;
+	long jitter = emu.jitter_us ? rand() % (emu.jitter_us + 1) : 0;
+
+	r = calloc(1, sizeof(*r));
+	EXIT_ON(r == NULL, "%s: out of memory\n", __func__);
+	memcpy(r->msg, msg, len);
+	r->len = len;
+	r->due = start + emu.delay_us + jitter;
+	emu.replies++;
+
+	/* Hold one reply back so it goes out after the next one */
+	if (!emu.held && chance(emu.reorder_pct)) {
+		emu.held = r;
+		emu.reordered++;
+		return;
+	}
+
+	emu_queue(r);
+	if (emu.held) {
+		emu.held->due = r->due;
+		emu_queue(emu.held);
+		emu.held = NULL;
+	}
+}
+
+static void emu_hello(long long start)
+{
+	static const unsigned char hello_res[] = { SYSEX_START, 0x7e, 0x7f, 0x06, 0x02, 0x00,
+						   0x01, 0x0c, 0x00, 0x00, 0x00,
+						   0x03, 0x30, 0x32, 0x33, 0x30, SYSEX_END };
+
+	debug("podemu: identity request\n");
+	emu_reply(hello_res, sizeof(hello_res), start);
+}
+
+static void emu_dump(int n, long long start)
+{
+	unsigned char msg[EMU_MSG_MAX] = { SYSEX_START, 0x00, 0x01, 0x0c, 0x01, 0x01, 0x00, n, 0x00 };
+	unsigned char *bytes = (unsigned char *)&emu.banks[n];
+	unsigned char *p = &msg[9];
+	int i;
+
+	debug("podemu: dump bank %s\n", bank_ntostr(n));
+
+	for (i = 0; i < BANK_SIZE; i++) {
+		*p++ = bytes[i] >> 4;
+		*p++ = bytes[i] & 0x0f;
+	}
+	*p++ = SYSEX_END;
+
+	emu_reply(msg, p - msg, start);
+}
+
+static void emu_store(int n, const unsigned char *p, size_t len, long long start)
+{
+	unsigned char *bytes = (unsigned char *)&emu.banks[n];
+	int i;
+
+	if (len != BANK_SIZE * 2) {
+		info("podemu: bank %s store with %ld nibbles ignored\n", bank_ntostr(n), len);
+		return;
+	}
+
+	if (start < emu.busy_until) {
+		debug("podemu: busy, store to bank %s lost\n", bank_ntostr(n));
+		emu.busy++;
+		return;
+	}
+	emu.busy_until = start + emu.store_us;
+
+	for (i = 0; i < BANK_SIZE; i++, p += 2)
+		bytes[i] = (p[0] << 4) | p[1];
+
+	if (n + 1 == emu.program)
+		emu.edit = emu.banks[n];
+
+	emu.stores++;
+	debug("podemu: stored bank %s\n", bank_ntostr(n));
+}
+
+/* Handles a complete SysEx message (without F0/F7) in sybuf */
+static void emu_sysex(long long start)
+{
+	static const unsigned char hello_req[] = { 0x7e, 0x7f, 0x06, 0x01 };
+	static const unsigned char bank_req[] = { 0x00, 0x01, 0x0c, 0x01, 0x00, 0x00 };
+	static const unsigned char bank_store[] = { 0x00, 0x01, 0x0c, 0x01, 0x01, 0x00 };
+	unsigned char *p = emu.sybuf;
+	size_t len = emu.sylen;
+	int n;
+
+	emu.requests++;
+
+	if (chance(emu.drop_pct)) {
+		debug("podemu: dropped request\n");
+		emu.dropped++;
+		return;
+	}
+
+	if (len == sizeof(hello_req) && memcmp(p, hello_req, len) == 0) {
+		emu_hello(start);
+		return;
+	}
+
+	if (len < sizeof(bank_req) + 1) {
+		debug("podemu: unknown message (%ld bytes)\n", len);
+		return;
+	}
+
+	n = p[sizeof(bank_req)];
+	if (n >= BANKS_NR) {
+		debug("podemu: bank %d out of range\n", n);
+		return;
+	}
+
+	if (memcmp(p, bank_req, sizeof(bank_req)) == 0)
+		emu_dump(n, start);
+	else if (len > sizeof(bank_store) + 2 && memcmp(p, bank_store, sizeof(bank_store)) == 0)
+		emu_store(n, p + sizeof(bank_store) + 2, len - sizeof(bank_store) - 2, start);
+	else
+		debug("podemu: unknown message (%ld bytes)\n", len);
+}
+
+static void emu_channel(unsigned char status, unsigned char *data)
+{
+	int op;
+
+	switch (status & 0xf0) {
+	case 0xc0:
+		emu.program = data[0];
+		if (emu.program > 0 && emu.program <= BANKS_NR)
+			emu.edit = emu.banks[emu.program - 1];
+		debug("podemu: program %d\n", emu.program);
+		break;
+	case 0xb0:
+		op = bank_apply_cc(&emu.edit, data[0], data[1]);
+		debug("podemu: control change %d = %d (%s)\n", data[0], data[1],
+		      (op >= 0) ? bank_op_name(op) : "ignored");
+		break;
+	}
+}
+
+/* Bytes following a channel status byte */
+static int channel_len(unsigned char status)
+{
+	switch (status & 0xf0) {
+	case 0xc0:
+	case 0xd0:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+static void emu_rx(const unsigned char *buf, size_t len)
+{
+	long long now = now_us();
+	unsigned char c;
+	size_t i;
+
+	emu.rx_bytes += len;
+
+	for (i = 0; i < len; i++) {
+		c = buf[i];
+
+		/* Bytes cannot arrive faster than the wire carries them */
+		if (emu.rx_wire < now - RX_SLACK_US)
+			emu.rx_wire = now - RX_SLACK_US;
+		emu.rx_wire += wire_us(1);
+
+		if (c >= 0xf8)
+			continue;
+
+		if (c == SYSEX_START) {
+			emu.sylen = 0;
+			emu.sysex = true;
+			emu.status = 0;
+			continue;
+		}
+
+		if (c == SYSEX_END) {
+			if (emu.sysex)
+				emu_sysex(emu.rx_wire);
+			emu.sysex = false;
+			continue;
+		}
+
+		if (c & 0x80) {
+			emu.sysex = false;
+			emu.status = (c < 0xf0) ? c : 0;
+			emu.ndata = 0;
+			continue;
+		}
+
+		if (emu.sysex) {
+			if (emu.sylen < EMU_MSG_MAX)
+				emu.sybuf[emu.sylen++] = c;
+			continue;
+		}
+
+		/* Channel message data, with running status */
+		if (!emu.status)
+			continue;
+
+		emu.data[emu.ndata++] = c;
+		if (emu.ndata == channel_len(emu.status)) {
+			emu_channel(emu.status, emu.data);
+			emu.ndata = 0;
+		}
+	}
+}
+
+/*
+ * Sends what is due from the head of the queue, at most EMU_CHUNK bytes
+ * per wire slot. Returns us until the next write is due, or -1.
+ */
+static long long emu_tx()
+{
+	struct reply *r;
+	long long now = now_us();
+	size_t n;
+	ssize_t err;
+
+	while (emu.nq > 0) {
+		r = emu.q[0];
+
+		if (r->due > now)
+			return r->due - now;
+		if (emu.tx_wire > now)
+			return emu.tx_wire - now;
+
+		n = r->len - r->off;
+		if (emu.baud && n > EMU_CHUNK)
+			n = EMU_CHUNK;
+
+		err = transport_write(emu.t, r->msg + r->off, n);
+		if (err == -EAGAIN || err == 0)
+			return 1000;
+		if (err < 0) {
+			info("podemu: write error %ld\n", (long)err);
+			terminate = 1;
+			return -1;
+		}
+
+		r->off += err;
+		emu.tx_bytes += err;
+		emu.tx_wire = now + wire_us(err);
+
+		if (r->off == r->len) {
+			emu.nq--;
+			memmove(&emu.q[0], &emu.q[1], emu.nq * sizeof(emu.q[0]));
+			free(r);
+		}
+	}
+
+	return -1;
+}
+
+static void emu_loop(pid_t child)
+{
+	unsigned char buf[256];
+	unsigned short revents;
+	long long next, ahead;
+	int timeout, err, i;
+	size_t room;
+	ssize_t n;
+	bool exited = false;
+	int status = 0;
+
+	while (!terminate) {
+		next = emu_tx();
+
+		/* Input is taken no faster than the wire could carry it */
+		room = sizeof(buf);
+		if (emu.baud) {
+			ahead = emu.rx_wire - now_us();
+			room = (ahead >= 0) ? 0 : -ahead / wire_us(1);
+			if (room > sizeof(buf))
+				room = sizeof(buf);
+			if (room == 0 && (next < 0 || ahead + wire_us(1) < next))
+				next = ahead + wire_us(1);
+		}
+
+		timeout = (next < 0) ? -1 : (int)((next + 999) / 1000);
+
+		/* A held reply that nothing follows is released after a while */
+		if (emu.held && timeout < 0)
+			timeout = 50;
+
+		if (child > 0 && (timeout < 0 || timeout > 100))
+			timeout = 100;
+
+		err = poll(emu.pfds, room ? emu.npfds : 0, timeout);
+		if (err < 0 && errno != EINTR)
+			break;
+
+		/* Once the command is done, what it wrote is still taken in */
+		if (child > 0 && !exited && waitpid(child, &i, WNOHANG) == child) {
+			status = WIFEXITED(i) ? WEXITSTATUS(i) + 1 : 2;
+			exited = true;
+		}
+		if (exited && err == 0 && room > 0 && emu.nq == 0)
+			break;
+
+		if (err == 0 && emu.held && emu.nq == 0) {
+			emu_queue(emu.held);
+			emu.held = NULL;
+			continue;
+		}
+
+		if (err <= 0 || room == 0)
+			continue;
+
+		if (transport_revents(emu.t, TRANSPORT_IN, emu.pfds, emu.npfds, &revents) < 0 ||
+		    !(revents & (POLLIN | POLLHUP)))
+			continue;
+
+		n = transport_read(emu.t, buf, room);
+		if (n > 0)
+			emu_rx(buf, n);
+		else if (n != -EAGAIN && n != -EIO)
+			break;
+	}
+
+	if (exited)
+		terminate = status;
+}
+
+/* Returns the master side; the slave's path is stored in path */
+static int open_pty(char *path, size_t len)
+{
+	struct termios t;
+	const char *name;
+	int fd;
+
+	fd = posix_openpt(O_RDWR | O_NOCTTY);
+	EXIT_ON(fd < 0, "Error opening pty (errno %d)\n", errno);
+	EXIT_ON(grantpt(fd) || unlockpt(fd), "Error setting up pty (errno %d)\n", errno);
+
+	name = ptsname(fd);
+	EXIT_ON(name == NULL, "Error getting pty name (errno %d)\n", errno);
+	snprintf(path, len, "%s", name);
+
+	/* Raw bytes in both directions */
+	if (tcgetattr(fd, &t) == 0) {
+		cfmakeraw(&t);
+		tcsetattr(fd, TCSANOW, &t);
+	}
+
+	return fd;
+}
+
+static void open_link(const char *name)
+{
+	int err;
+
+	err = transport_open(&emu.t, name);
+	EXIT_ON(err < 0, "Error opening %s: %s\n", name, transport_strerror(err));
+
+	emu.npfds = transport_nfds(emu.t, TRANSPORT_IN);
+	EXIT_ON(emu.npfds <= 0 || emu.npfds > 8, "Unsupported poll descriptor count %d\n", emu.npfds);
+	ERREXIT(transport_pollfds(emu.t, TRANSPORT_IN, emu.pfds, emu.npfds));
+}
+
+static void load_banks(const char *file_name)
+{
+	int fd;
+	ssize_t err;
+
+	fd = open(file_name, O_RDONLY);
+	EXIT_ON(fd < 0, "Error reading file: %s (errno %d)\n", file_name, errno);
+
+	err = read(fd, emu.banks, sizeof(emu.banks));
+	EXIT_ON(err != sizeof(emu.banks), "Error reading banks (file size mismatch)\n");
+
+	close(fd);
+}
+
+static void store_banks(const char *file_name)
+{
+	int fd;
+	ssize_t err;
+
+	fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	EXIT_ON(fd < 0, "Error creating file: %s (errno %d)\n", file_name, errno);
+
+	err = write(fd, emu.banks, sizeof(emu.banks));
+	EXIT_ON(err != sizeof(emu.banks), "Error writing banks (errno %d)\n", errno);
+
+	close(fd);
+}
+
+static void default_banks()
+{
+	char name[BANK_NAME_LEN + 1];
+	int n;
+
+	for (n = 0; n < BANKS_NR; n++) {
+		snprintf(name, sizeof(name), "Bank %s", bank_ntostr(n));
+		memset(emu.banks[n].bank_name, ' ', BANK_NAME_LEN);
+		memcpy(emu.banks[n].bank_name, name, strlen(name));
+		emu.banks[n].amp_model = n % 32;
+		emu.banks[n].cabinet = n % 16;
+		emu.banks[n].effect_type = n % 16;
+		emu.banks[n].drive = (n * 7) & 0x3f;
+		emu.banks[n].chan_vol = 0x30;
+	}
+}
+
+/* Runs cmd with %s replaced by the pod6ctl port name */
+static pid_t spawn(const char *cmd, const char *port)
+{
+	const char *p = strstr(cmd, "%s");
+	char *buf;
+	pid_t pid;
+
+	buf = malloc(strlen(cmd) + strlen(port) + 1);
+	EXIT_ON(buf == NULL, "%s: out of memory\n", __func__);
+	strcpy(buf, cmd);
+	if (p) {
+		strcpy(buf + (p - cmd), port);
+		strcat(buf, p + 2);
+	}
+
+	pid = fork();
+	EXIT_ON(pid < 0, "fork failed (errno %d)\n", errno);
+
+	if (pid == 0) {
+		execl("/bin/sh", "sh", "-c", buf, (char *)NULL);
+		_exit(127);
+	}
+
+	free(buf);
+	return pid;
+}
+
+static void on_signal(int sig)
+{
+	terminate = 1;
+}
+
+static void print_help()
+{
+	printf("Virtual Line 6 POD 2.3 for pod6ctl\n"
+		"Version " VERSION "\n"
+		"\nUsage: podemu <options>\n"
+		"\nOptions:\n"
+		" -l path       Create a symlink to the pty at path\n"
+		" -a port       Use an ALSA raw MIDI port (example: virtual) instead of a pty\n"
+		" -S            Use a socketpair; the command (-c) gets its end as fd 3\n"
+		" -c command    Run command, replacing %%s with the pod6ctl port, and exit with its status\n"
+		" -f file       Initial banks, as written by 'pod6ctl save'\n"
+		" -o file       Write the banks to file on exit\n"
+		" -B baud       Wire rate (default: 31250; 0 for no pacing)\n"
+		" -d ms         Processing delay before each reply\n"
+		" -j ms         Random extra delay of up to ms per reply\n"
+		" -r percent    Replies sent out of order\n"
+		" -x percent    Requests dropped\n"
+		" -g ms         Time to process a store; stores arriving meanwhile are lost\n"
+		" -s seed       Random seed\n"
+		" -v            Verbose\n"
+		" -D            Debug\n"
+		" -h            Help\n"
+		"\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *link_path = NULL, *alsa_port = NULL, *cmd = NULL, *out_file = NULL;
+	bool socket_mode = false;
+	char port[PATH_MAX + 8], path[PATH_MAX];
+	struct sigaction sa = { .sa_handler = on_signal };
+	pid_t child = 0;
+	int sv[2];
+	int fd, c;
+
+	emu.baud = 31250;
+	srand(1);
+	default_banks();
+
+	while ((c = getopt(argc, argv, "l:a:Sc:f:o:B:d:j:r:x:g:s:vDh")) != -1) {
+		switch (c) {
+		case 'l':
+			link_path = optarg;
+			break;
+		case 'a':
+			alsa_port = optarg;
+			break;
+		case 'S':
+			socket_mode = true;
+			break;
+		case 'c':
+			cmd = optarg;
+			break;
+		case 'f':
+			load_banks(optarg);
+			break;
+		case 'o':
+			out_file = optarg;
+			break;
+		case 'B':
+			emu.baud = strtol(optarg, NULL, 0);
+			break;
+		case 'd':
+			emu.delay_us = strtol(optarg, NULL, 0) * 1000;
+			break;
+		case 'j':
+			emu.jitter_us = strtol(optarg, NULL, 0) * 1000;
+			break;
+		case 'r':
+			emu.reorder_pct = strtol(optarg, NULL, 0);
+			break;
+		case 'x':
+			emu.drop_pct = strtol(optarg, NULL, 0);
+			break;
+		case 'g':
+			emu.store_us = strtol(optarg, NULL, 0) * 1000;
+			break;
+		case 's':
+			srand(strtol(optarg, NULL, 0));
+			break;
+		case 'v':
+			verbose = true;
+			break;
+		case 'D':
+			debug_mode = true;
+			break;
+		case 'h':
+		default:
+			print_help();
+			exit(c != 'h');
+		}
+	}
+
+	EXIT_ON(socket_mode && !cmd, "A socketpair needs a command (-c)\n");
+
+	/* Our end is a transport too; port is the name pod6ctl uses for the other end */
+	if (alsa_port) {
+		open_link(alsa_port);
+		snprintf(port, sizeof(port), "%s", alsa_port);
+	} else if (socket_mode) {
+		EXIT_ON(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), "socketpair failed (errno %d)\n", errno);
+		/* Keep our end clear of fd 3, which the command gets */
+		fd = fcntl(sv[0], F_DUPFD_CLOEXEC, 4);
+		EXIT_ON(fd < 0 || dup2(sv[1], 3) < 0, "dup2 failed (errno %d)\n", errno);
+		if (sv[0] != 3)
+			close(sv[0]);
+		if (sv[1] != 3)
+			close(sv[1]);
+		snprintf(path, sizeof(path), "fd:%d", fd);
+		open_link(path);
+		close(fd);
+		snprintf(port, sizeof(port), "fd:3");
+	} else {
+		fd = open_pty(path, sizeof(path));
+		snprintf(port, sizeof(port), "fd:%d", fd);
+		open_link(port);
+		close(fd);
+		snprintf(port, sizeof(port), "tty:%s", path);
+
+		/* Holding the slave open keeps the master from hanging up between clients */
+		EXIT_ON(open(path, O_RDWR | O_NOCTTY | O_CLOEXEC) < 0, "Error opening %s (errno %d)\n",
+			path, errno);
+
+		if (link_path) {
+			unlink(link_path);
+			EXIT_ON(symlink(path, link_path), "Error linking %s (errno %d)\n", link_path, errno);
+		}
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	if (cmd) {
+		child = spawn(cmd, port);
+		if (socket_mode)
+			close(3);
+	} else {
+		printf("%s\n", port);
+		fflush(stdout);
+	}
+
+	emu_loop(child);
+
+	if (link_path && !alsa_port && !socket_mode)
+		unlink(link_path);
+	transport_close(emu.t);
+	if (out_file)
+		store_banks(out_file);
+
+	if (verbose || debug_mode)
+		info("podemu: %ld requests (%ld dropped), %ld replies (%ld reordered), "
+		     "%ld stores (%ld lost while busy), %ld bytes in, %ld bytes out\n",
+		     emu.requests, emu.dropped, emu.replies, emu.reordered,
+		     emu.stores, emu.busy, emu.rx_bytes, emu.tx_bytes);
+
+	/* With a command, exit with its status */
+	return (child > 0 && terminate > 1) ? terminate - 1 : 0;
+}
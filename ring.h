@@ -0,0 +1,87 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  Received Message Ring
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef RING_H
+#define RING_H
+
+/*
+ * Single-producer, single-consumer ring of framed messages. The producer
+ * fills the slot returned by ring_produce() and publishes it with
+ * ring_publish(); the consumer reads the slot returned by ring_peek() and
+ * frees it with ring_consume(). head is only written by the producer and
+ * tail only by the consumer, so acquire/release ordering on them is all
+ * the synchronization needed.
+ */
+#define RING_SLOTS	64	/* a power of two */
+#define RING_MSG_MAX	192	/* a bank dump is 150 */
+
+struct ring_msg {
+	unsigned char type;
+	unsigned short len;
+	int err;
+	long long us;		/* wall clock time the bytes were read */
+	unsigned char data[RING_MSG_MAX];
+};
+
+struct ring {
+	unsigned int head;
+	unsigned int tail;
+	struct ring_msg slot[RING_SLOTS];
+};
+
+static inline void ring_init(struct ring *r)
+{
+	r->head = r->tail = 0;
+}
+
+/* The slot to fill next, or NULL if the ring is full */
+static inline struct ring_msg *ring_produce(struct ring *r)
+{
+	unsigned int head = r->head;
+
+	if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) == RING_SLOTS)
+		return NULL;
+
+	return &r->slot[head % RING_SLOTS];
+}
+
+static inline void ring_publish(struct ring *r)
+{
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+/* The oldest published slot, or NULL if the ring is empty */
+static inline struct ring_msg *ring_peek(struct ring *r)
+{
+	unsigned int tail = r->tail;
+
+	if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+		return NULL;
+
+	return &r->slot[tail % RING_SLOTS];
+}
+
+static inline void ring_consume(struct ring *r)
+{
+	__atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
+
+#endif
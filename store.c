@@ -0,0 +1,286 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  Content-Addressed Bank Store
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "pod6ctl.h"
+#include "bank.h"
+#include "store.h"
+
+/*
+ * The pack starts with STORE_MAGIC, followed by records of a bank's
+ * hash (64-bit FNV-1a, little endian) and the bank itself. Records are
+ * only ever appended, under an exclusive lock; readers take a shared
+ * one. A manifest is a '<bank> <hash>' line per bank, written to a
+ * temporary file and renamed, so a snapshot is either whole or absent.
+ */
+#define STORE_MAGIC	"P6OB0001"
+#define STORE_PACK	"objects"
+#define STORE_SNAPSHOTS	"snapshots"
+#define STORE_CHUNK	4096	/* Records read at a time */
+
+struct store_rec {
+	unsigned char hash[8];
+	struct bank b;
+} __attribute__ ((__packed__));
+
+static uint64_t store_hash(const struct bank *b)
+{
+	const unsigned char *p = (const unsigned char *)b;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for (i = 0; i < sizeof(*b); i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	return h;
+}
+
+static uint64_t store_rec_hash(const struct store_rec *r)
+{
+	uint64_t h = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		h = h << 8 | r->hash[i];
+
+	return h;
+}
+
+char *store_path(const char *dir, const char *name)
+{
+	size_t len = strlen(dir) + strlen(name) + sizeof(STORE_SNAPSHOTS) + 2;
+	char *path;
+
+	EXIT_ON(!*name || *name == '.' || strchr(name, '/'), "Invalid snapshot name '%s'\n", name);
+
+	path = malloc(len);
+	EXIT_ON(path == NULL, "%s: out of memory\n", __func__);
+
+	snprintf(path, len, "%s/" STORE_SNAPSHOTS, dir);
+	EXIT_ON(mkdir(dir, 0755) != 0 && errno != EEXIST, "Error creating %s (errno %d)\n", dir, errno);
+	EXIT_ON(mkdir(path, 0755) != 0 && errno != EEXIST, "Error creating %s (errno %d)\n", path,
+		errno);
+
+	snprintf(path, len, "%s/" STORE_SNAPSHOTS "/%s", dir, name);
+
+	return path;
+}
+
+/*
+ * Opens and locks the pack; a new one gets its magic. A save that died
+ * mid-write leaves part of a record at the end: a writer cuts it off, so
+ * that what it appends starts on a record boundary. Readers ignore it.
+ */
+static int store_pack(const char *dir, bool append)
+{
+	char path[4096], magic[sizeof(STORE_MAGIC) - 1];
+	struct stat st;
+	off_t size;
+	ssize_t n;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s/" STORE_PACK, dir);
+	fd = open(path, append ? (O_RDWR | O_CREAT | O_APPEND) : O_RDONLY, 0644);
+	EXIT_ON(fd < 0, "Error opening %s (errno %d)\n", path, errno);
+	EXIT_ON(flock(fd, append ? LOCK_EX : LOCK_SH) != 0, "Error locking %s (errno %d)\n", path,
+		errno);
+
+	n = pread(fd, magic, sizeof(magic), 0);
+	EXIT_ON(n < 0, "Error reading %s (errno %d)\n", path, errno);
+
+	if (append && n < sizeof(magic) && memcmp(magic, STORE_MAGIC, n) == 0) {
+		EXIT_ON(ftruncate(fd, 0) != 0 || write(fd, STORE_MAGIC, sizeof(magic)) != sizeof(magic),
+			"Error writing %s (errno %d)\n", path, errno);
+		return fd;
+	}
+
+	EXIT_ON(n != sizeof(magic) || memcmp(magic, STORE_MAGIC, sizeof(magic)) != 0,
+		"%s: not a bank store\n", path);
+
+	if (append) {
+		EXIT_ON(fstat(fd, &st) != 0, "Error reading %s (errno %d)\n", path, errno);
+		size = st.st_size - (st.st_size - sizeof(magic)) % sizeof(struct store_rec);
+		if (size != st.st_size) {
+			info("%s: dropping a partial record (%lld bytes)\n", path,
+			     (long long)(st.st_size - size));
+			EXIT_ON(ftruncate(fd, size) != 0, "Error truncating %s (errno %d)\n", path,
+				errno);
+		}
+	}
+
+	return fd;
+}
+
+/*
+ * Looks the hashes up in the pack. Found banks are copied to b if fill,
+ * else compared with b, where a difference means two banks share a hash.
+ */
+static void store_scan(int fd, const uint64_t hash[], struct bank b[], bool found[], bool fill)
+{
+	static struct store_rec recs[STORE_CHUNK];
+	off_t off = sizeof(STORE_MAGIC) - 1;
+	ssize_t n;
+	uint64_t h;
+	int i, r;
+
+	memset(found, 0, BANKS_NR * sizeof(*found));
+
+	while ((n = pread(fd, recs, sizeof(recs), off)) > 0) {
+		n /= sizeof(*recs);
+		if (n == 0)
+			break;
+		off += n * sizeof(*recs);
+
+		for (r = 0; r < n; r++) {
+			h = store_rec_hash(&recs[r]);
+			for (i = 0; i < BANKS_NR; i++) {
+				if (found[i] || hash[i] != h)
+					continue;
+
+				if (fill)
+					b[i] = recs[r].b;
+				else
+					EXIT_ON(memcmp(&b[i], &recs[r].b, sizeof(b[i])) != 0,
+						"Bank %s collides with a stored bank (hash %016llx)\n",
+						bank_ntostr(i), (unsigned long long)h);
+				found[i] = true;
+			}
+		}
+	}
+	EXIT_ON(n < 0, "Error reading the pack (errno %d)\n", errno);
+}
+
+int store_save(const char *dir, const char *name, struct bank b[], bool overwrite)
+{
+	uint64_t hash[BANKS_NR];
+	bool found[BANKS_NR];
+	struct store_rec rec;
+	char *path, *tmp;
+	int fd, i, j, added = 0;
+	FILE *f;
+
+	for (i = 0; i < BANKS_NR; i++)
+		hash[i] = store_hash(&b[i]);
+
+	/* The pack lock is held until the manifest is in place */
+	path = store_path(dir, name);
+	fd = store_pack(dir, true);
+	EXIT_ON(!overwrite && access(path, F_OK) == 0,
+		"Error creating snapshot (snapshot must not exist): %s\n", path);
+
+	store_scan(fd, hash, b, found, false);
+
+	for (i = 0; i < BANKS_NR; i++) {
+		if (found[i])
+			continue;
+
+		for (j = 0; j < 8; j++)
+			rec.hash[j] = hash[i] >> (8 * j);
+		rec.b = b[i];
+		EXIT_ON(write(fd, &rec, sizeof(rec)) != sizeof(rec), "Error writing the pack (errno %d)\n",
+			errno);
+		added++;
+
+		/* The same bank again in this snapshot */
+		for (j = i + 1; j < BANKS_NR; j++) {
+			if (hash[j] == hash[i])
+				found[j] = true;
+		}
+	}
+
+	EXIT_ON(fsync(fd) != 0, "Error writing the pack (errno %d)\n", errno);
+
+	tmp = malloc(strlen(path) + 5);
+	EXIT_ON(tmp == NULL, "%s: out of memory\n", __func__);
+	sprintf(tmp, "%s.tmp", path);
+
+	f = fopen(tmp, "w");
+	EXIT_ON(f == NULL, "Error creating %s (errno %d)\n", tmp, errno);
+	for (i = 0; i < BANKS_NR; i++)
+		fprintf(f, "%s %016llx\n", bank_ntostr(i), (unsigned long long)hash[i]);
+	EXIT_ON(fflush(f) != 0 || fsync(fileno(f)) != 0 || fclose(f) != 0,
+		"Error writing %s (errno %d)\n", tmp, errno);
+	EXIT_ON(rename(tmp, path) != 0, "Error creating %s (errno %d)\n", path, errno);
+	close(fd);
+
+	free(tmp);
+	free(path);
+
+	return added;
+}
+
+int store_manifest(const char *dir, const char *name, uint64_t hash[])
+{
+	unsigned long long h;
+	char *path, bank[8];
+	int i, err = 0;
+	FILE *f;
+
+	path = store_path(dir, name);
+	f = fopen(path, "r");
+	free(path);
+	if (f == NULL)
+		return -errno;
+
+	for (i = 0; i < BANKS_NR && !err; i++) {
+		if (fscanf(f, "%7s %16llx", bank, &h) != 2 || bank_strton(bank) != i)
+			err = -EINVAL;
+		hash[i] = h;
+	}
+	fclose(f);
+
+	return err;
+}
+
+void store_load(const char *dir, const char *name, struct bank b[])
+{
+	uint64_t hash[BANKS_NR];
+	bool found[BANKS_NR];
+	int fd, i, err;
+
+	err = store_manifest(dir, name, hash);
+	EXIT_ON(err == -ENOENT, "No snapshot '%s' in %s\n", name, dir);
+	EXIT_ON(err, "Error reading snapshot '%s' in %s (%s)\n", name, dir,
+		(err == -EINVAL) ? "damaged manifest" : strerror(-err));
+
+	fd = store_pack(dir, false);
+	store_scan(fd, hash, b, found, true);
+	close(fd);
+
+	for (i = 0; i < BANKS_NR; i++)
+		EXIT_ON(!found[i], "Snapshot '%s': bank %s (%016llx) is missing from the pack\n", name,
+			bank_ntostr(i), (unsigned long long)hash[i]);
+}
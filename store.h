@@ -0,0 +1,50 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  Content-Addressed Bank Store
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef _POD6CTL_STORE_H
+#define _POD6CTL_STORE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * A store is a directory holding each distinct bank once, in the pack
+ * file 'objects', and a manifest per snapshot under 'snapshots': the
+ * hash of each of its BANKS_NR banks.
+ */
+
+/* Path of snapshot name in the store at dir (malloc'ed), creating the store if needed */
+char *store_path(const char *dir, const char *name);
+
+/*
+ * Writes b as snapshot name, adding the banks the store does not have
+ * yet. An existing snapshot is only replaced if overwrite. Returns the
+ * number of banks added.
+ */
+int store_save(const char *dir, const char *name, struct bank b[], bool overwrite);
+
+/* Reads the hashes of snapshot name; returns 0 or -errno */
+int store_manifest(const char *dir, const char *name, uint64_t hash[]);
+
+/* Reads snapshot name into b */
+void store_load(const char *dir, const char *name, struct bank b[]);
+
+#endif
@@ -30,39 +30,316 @@
 #include <signal.h>
 #include <sys/poll.h>
 #include <time.h>
-
-#include <alsa/asoundlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 
 #include "pod6ctl.h"
 #include "rbuf.h"
 #include "bank.h"
+#include "sysex.h"
+#include "transport.h"
+#include "ring.h"
+
+/* Bulk receive buffer, drained by the framer onto the ring */
+#define RX_BUF_SIZE	256
+
+/* Ring message type for a receive error, after the MIDI_* types */
+#define RX_ERROR	(MIDI_REALTIME + 1)
+
+/* Identity reply is 15 bytes for the POD 2.3, ending in the firmware version */
+#define IDENT_MAX	32
+#define IDENT_FW	11
+
+/*
+ * Output scheduler: framed messages are queued in txbuf and handed to the
+ * kernel whenever it has room, while input is being waited for. The
+ * kernel buffer is sized to a few stores, so the link never idles during
+ * a restore, yet anything queued behind it waits at most that long.
+ */
+#define STORE_MSG_LEN	(9 + BANK_SIZE * 2 + 1)
+#define TX_BUF_SIZE	(STORE_MSG_LEN * BANKS_NR)
+#define TX_KERNEL_MSGS	4
+
+/* 31.25 kbaud, 10 bits per byte */
+#define LINE_RATE	3125
+#define STORE_GAP_MAX_MS	1000
+
+/*
+ * Control changes are held back until the wire is about to be free, so
+ * at most CC_AHEAD_US of them sit in the kernel and a newer value for a
+ * controller still waiting here replaces the old one.
+ */
+#define CC_NR		128
+#define CC_MSG_US	(3 * 1000000 / LINE_RATE)
+#define CC_AHEAD_US	CC_MSG_US
+
+/*
+ * Requests awaiting a reply, oldest first, keyed by type and bank: at
+ * most one of each, so a hello and every bank fit.
+ */
+#define REQ_MAX		(BANKS_NR + 1)
+
+enum {
+	REQ_HELLO,
+	REQ_DUMP,
+};
+
+struct request {
+	unsigned char type;
+	unsigned char bank;
+};
+
+struct pod {
+	const char *port_name;
+
+	struct transport *t;
+
+	struct pollfd *pfds;	/* input, then output descriptors */
+	int npfds;
+	struct pollfd *opfds;
+	int nopfds;
+
+	unsigned char txbuf[TX_BUF_SIZE];
+	size_t tx_head;
+	size_t tx_len;
+	long tx_bytes;		/* handed to the kernel */
+
+	/* Minimum interval between stores, raised when the device drops them */
+	long store_gap_ms;
+	long last_store;
+
+	/*
+	 * Receive side. With a receive thread, rxbuf and the framing state
+	 * belong to it and the ring carries framed messages to the main
+	 * thread; without one, both ends run inline.
+	 */
+	unsigned char rxbuf[RX_BUF_SIZE];
+	size_t rx_pos;
+	size_t rx_len;
+	long long rx_us;		/* when rxbuf was read */
+	bool rx_sysex;
+	unsigned char rx_msg[RING_MSG_MAX];
+	int rx_msglen;
+	unsigned char rx_status;	/* channel running status */
+	unsigned char rx_data[3];
+	int rx_ndata;
+	struct ring ring;
+	int rx_err;			/* the receive thread's read error */
+
+	bool rx_threaded;
+	bool rx_running;
+	pthread_t rx_thread;
+	int rx_pipe[2];			/* wakes the main thread */
+	int rx_stop[2];			/* hung up to stop the thread */
+	struct pod *rx_next;
+
+	/* Last complete SysEx message received, without F0/F7 */
+	struct rbuf sybuf;
+	long long sy_us;
+
+	struct request reqs[REQ_MAX];
+	int nreqs;
+
+	/* Replies to outstanding requests that came while awaiting another */
+	struct bank stash[BANKS_NR];
+	bool stashed[BANKS_NR];
+
+	/* Cached identity reply from the hello handshake */
+	unsigned char ident[IDENT_MAX];
+	size_t ident_len;
+
+	/* Controller changes not yet sent: one value per controller, in order */
+	unsigned char cc_val[CC_NR];
+	bool cc_pending[CC_NR];
+	unsigned char cc_queue[CC_NR];
+	int cc_head;
+	int cc_len;
+	long long cc_idle_us;	/* when the wire has sent the last one */
+
+	/* Called as each bank of a save or restore completes */
+	sysex_progress_fn progress;
+	void *progress_arg;
+
+	/* Monitor: all received traffic is passed on, not only SysEx */
+	pod_monitor_fn monitor;
+	void *monitor_arg;
+};
+
+/*
+ * Every reply is awaited with a deadline. A request that times out is
+ * sent again, with the wait doubling each time up to BACKOFF_MAX_MS,
+ * at most DUMP_RETRIES times in a row.
+ */
+#define DUMP_TIMEOUT_MS	500
+#define DUMP_RETRIES	5
+#define BACKOFF_MAX_MS	4000
+#define HELLO_TIMEOUT_MS	1000
+
+/* Pause before rewriting a bank that did not stick, doubling per pass */
+#define WRITE_BACKOFF_MS	50
+
+static long now_ms()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long clock_us(clockid_t clock)
+{
+	struct timespec ts;
+
+	clock_gettime(clock, &ts);
+
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static long long now_us()
+{
+	return clock_us(CLOCK_MONOTONIC);
+}
+
+/* Timeout for the given retry of a request */
+static int backoff_ms(int base, int retry)
+{
+	long ms = (long)base << (retry < 8 ? retry : 8);
+
+	return (ms < BACKOFF_MAX_MS) ? ms : BACKOFF_MAX_MS;
+}
+
+static void backoff_sleep(int pass)
+{
+	struct timespec ts;
+	int ms = backoff_ms(WRITE_BACKOFF_MS, pass);
+
+	ts.tv_sec = ms / 1000;
+	ts.tv_nsec = (ms % 1000) * 1000000L;
+	nanosleep(&ts, NULL);
+}
+
+static void rx_stop(struct pod *pod);
+
+static void midi_close(struct pod *pod)
+{
+	rx_stop(pod);
+	transport_close(pod->t);
+	pod->t = NULL;
+
+	free(pod->pfds);
+	pod->pfds = NULL;
+	pod->opfds = NULL;
+	free(pod->sybuf.head);
+	pod->sybuf.head = NULL;
+}
+
+static int midi_pollfds(struct pod *pod)
+{
+	int err;
+
+	pod->npfds = transport_nfds(pod->t, TRANSPORT_IN);
+	pod->nopfds = transport_nfds(pod->t, TRANSPORT_OUT);
+	if (pod->npfds <= 0 || pod->nopfds <= 0)
+		return -ENODEV;
 
-static struct rbuf sybuf;
+	pod->pfds = calloc(pod->npfds + pod->nopfds, sizeof(*pod->pfds));
+	if (pod->pfds == NULL)
+		return -ENOMEM;
+	pod->opfds = pod->pfds + pod->npfds;
 
-static snd_rawmidi_t *input;
-static snd_rawmidi_t *output;
+	err = transport_pollfds(pod->t, TRANSPORT_IN, pod->pfds, pod->npfds);
+	if (err < 0)
+		return err;
 
-static int hello_rx = 0;
+	return transport_pollfds(pod->t, TRANSPORT_OUT, pod->opfds, pod->nopfds);
+}
 
-static void midi_open(const char *port_name)
+/* Returns 0 or a negative error code; nothing is left open on failure */
+static int midi_open(struct pod *pod)
 {
 	int err;
 
-	rbuf_init(&sybuf);
+	rbuf_init(&pod->sybuf);
+	pod->rx_pos = pod->rx_len = 0;
+	pod->rx_sysex = false;
+	pod->rx_status = 0;
+	pod->rx_err = 0;
+	ring_init(&pod->ring);
+	pod->nreqs = 0;
+	memset(pod->stashed, 0, sizeof(pod->stashed));
+	pod->tx_head = pod->tx_len = 0;
+
+	err = transport_open(&pod->t, pod->port_name);
+	if (err < 0)
+		goto fail;
+
+	err = midi_pollfds(pod);
+	if (err < 0)
+		goto fail;
+
+	/* POLLOUT then means a whole store fits */
+	err = transport_set_buffer(pod->t, STORE_MSG_LEN * TX_KERNEL_MSGS, STORE_MSG_LEN);
+	if (err < 0)
+		debug("cannot size output buffer: %s\n", transport_strerror(err));
+	else if (err > 0)
+		debug("output buffer %d bytes\n", err);
+
+	return 0;
+
+fail:
+	midi_close(pod);
+	return err;
+}
+
+static size_t tx_pending(struct pod *pod)
+{
+	return pod->tx_len - pod->tx_head;
+}
+
+/* Hands queued output to the kernel as far as it has room. Returns 0 or an error */
+static int tx_flush(struct pod *pod)
+{
+	ssize_t n;
+
+	while (tx_pending(pod) > 0) {
+		n = transport_write(pod->t, pod->txbuf + pod->tx_head, tx_pending(pod));
+		if (n == -EAGAIN || n == 0)
+			return 0;
+		if (n < 0)
+			return n;
+
+		pod->tx_head += n;
+		pod->tx_bytes += n;
+	}
+
+	pod->tx_head = pod->tx_len = 0;
 
-	ERREXIT(snd_rawmidi_open(&input, &output, port_name, SND_RAWMIDI_NONBLOCK));
-	ERREXIT(snd_rawmidi_nonblock(output, 0));
+	return 0;
 }
 
-static void midi_close()
+/* Waits for the kernel to take queued output until at most keep bytes remain */
+static void tx_wait(struct pod *pod, size_t keep)
 {
 	int err;
 
-	ERREXIT(snd_rawmidi_close(input));
-	ERREXIT(snd_rawmidi_close(output));
+	for (;;) {
+		ERREXIT(tx_flush(pod));
+		if (tx_pending(pod) <= keep)
+			break;
+
+		err = poll(pod->opfds, pod->nopfds, -1);
+		EXIT_ON(err < 0 && errno != EINTR, "%s: poll error (errno %d)\n", __func__, errno);
+	}
+
+	memmove(pod->txbuf, pod->txbuf + pod->tx_head, tx_pending(pod));
+	pod->tx_len = tx_pending(pod);
+	pod->tx_head = 0;
 }
 
-static void sysex_send(unsigned char *cmd, int len)
+/* Queues a framed message and starts writing it */
+static void sysex_send(struct pod *pod, const unsigned char *cmd, int len)
 {
 	int err, i;
 
@@ -71,217 +348,1657 @@ static void sysex_send(unsigned char *cmd, int len)
 		debug("%02hhx",  *(cmd + i));
 	}
 	debug("\n");
-	ERREXIT(snd_rawmidi_write(output, cmd, len));
+
+	if (pod->tx_len + len > TX_BUF_SIZE)
+		tx_wait(pod, TX_BUF_SIZE - len);
+
+	memcpy(pod->txbuf + pod->tx_len, cmd, len);
+	pod->tx_len += len;
+	ERREXIT(tx_flush(pod));
 }
 
-static int sysex_read()
+static void midi_event(struct pod *pod, int type, long long us,
+		       const unsigned char *data, size_t len)
 {
-	int err;
-	bool sysex = false;
-	unsigned char c = 0;
+	struct midi_event ev = {
+		.type = type,
+		.us = us,
+		.data = data,
+		.len = len,
+	};
 
-	rbuf_rewind(&sybuf);
+	pod->monitor(&ev, pod->monitor_arg);
+}
 
-	for (;;) {
-		debug(".");
-		ERREXIT(snd_rawmidi_read(input, &c, sizeof(c)));
-		if (err == 0)
-			continue;
-		debug("-");
+/* Puts a framed message on the ring; the caller made sure there is room */
+static void rx_publish(struct pod *pod, int type, const unsigned char *data, size_t len)
+{
+	struct ring_msg *m = ring_produce(&pod->ring);
+
+	m->type = type;
+	m->len = len;
+	m->err = 0;
+	m->us = pod->rx_us;
+	memcpy(m->data, data, len);
+	ring_publish(&pod->ring);
+}
+
+/*
+ * Incremental MIDI framer. The framing state survives across reads so a
+ * message may span any number of them. SysEx messages are passed on
+ * without F0/F7; channel messages are framed with running status.
+ * Returns 1 if c completed a message.
+ */
+static int rx_byte(struct pod *pod, unsigned char c)
+{
+	/* Realtime messages may be interleaved anywhere */
+	if (c >= 0xf8) {
+		rx_publish(pod, MIDI_REALTIME, &c, 1);
+		return 1;
+	}
+
+	if (c == SYSEX_START) {
+		pod->rx_sysex = true;
+		pod->rx_msglen = 0;
+		pod->rx_status = 0;
+		return 0;
+	}
+
+	if (pod->rx_sysex) {
+		if (c == SYSEX_END) {
+			pod->rx_sysex = false;
+			if (pod->rx_msglen > RING_MSG_MAX) {
+				debug("(oversized sysex, %d bytes)\n", pod->rx_msglen);
+				return 0;
+			}
+			rx_publish(pod, MIDI_SYSEX, pod->rx_msg, pod->rx_msglen);
+			return 1;
+		}
+
+		if (!(c & 0x80)) {
+			if (pod->rx_msglen < RING_MSG_MAX)
+				pod->rx_msg[pod->rx_msglen] = c;
+			pod->rx_msglen++;
+			return 0;
+		}
+
+		/* Any other status byte terminates the message prematurely */
+		debug("(truncated sysex) %02hhx\n", c);
+		pod->rx_sysex = false;
+	}
+
+	/* System common messages are dropped */
+	if (c & 0x80) {
+		pod->rx_status = (c < 0xf0) ? c : 0;
+		pod->rx_ndata = 0;
+		return 0;
+	}
+
+	if (!pod->rx_status) {
+		debug("(!sysex) %02hhx\n", c);
+		return 0;
+	}
+
+	pod->rx_data[1 + pod->rx_ndata++] = c;
+	if (pod->rx_ndata < (((pod->rx_status & 0xe0) == 0xc0) ? 1 : 2))
+		return 0;
+
+	pod->rx_data[0] = pod->rx_status;
+	rx_publish(pod, MIDI_CHANNEL, pod->rx_data, pod->rx_ndata + 1);
+	pod->rx_ndata = 0;
+
+	return 1;
+}
+
+/*
+ * Frames the bytes in rxbuf onto the ring. Stops early when the ring is
+ * full, leaving the rest in rxbuf. Returns the number of messages framed.
+ */
+static int rx_frame(struct pod *pod)
+{
+	int n = 0;
+
+	while (pod->rx_pos < pod->rx_len && ring_produce(&pod->ring))
+		n += rx_byte(pod, pod->rxbuf[pod->rx_pos++]);
 
-		if (!sysex) {
-			if (c == SYSEX_START)
-				sysex = true;
+	return n;
+}
 
-			if (!sysex)
-				debug("(!sysex) %02hhx\n", c);
+/*
+ * Takes messages off the ring until a SysEx message is in sybuf. Channel
+ * and realtime messages go to the monitor, if any, and a receive error
+ * is kept in rx_err. Returns true on a SysEx message, false once the
+ * ring is empty.
+ */
+static bool sysex_frame(struct pod *pod)
+{
+	struct ring_msg *m;
+	int i;
 
+	for (;;) {
+		m = ring_peek(&pod->ring);
+		if (m == NULL) {
+			/* Without a receive thread, input is framed here */
+			if (pod->rx_running || pod->rx_pos == pod->rx_len)
+				return false;
+			rx_frame(pod);
 			continue;
 		}
 
-		if (c == SYSEX_END) {
+		switch (m->type) {
+		case MIDI_SYSEX:
+			rbuf_rewind(&pod->sybuf);
+			debug("Received: ");
+			for (i = 0; i < m->len; i++) {
+				rbuf_append(&pod->sybuf, m->data[i]);
+				debug("%02hhx", m->data[i]);
+			}
 			debug("\n");
+			pod->sy_us = m->us;
+			ring_consume(&pod->ring);
+			return true;
+		case RX_ERROR:
+			pod->rx_err = m->err;
+			break;
+		default:
+			if (pod->monitor)
+				midi_event(pod, m->type, m->us, m->data, m->len);
+			else
+				debug("(!sysex) %02hhx, %d bytes\n", m->data[0], m->len);
 			break;
 		}
 
-		rbuf_append(&sybuf, c);
-		debug("0x%02hhx, ", c);
+		ring_consume(&pod->ring);
 	}
+}
+
+/* Drains pending input with a single read. Returns bytes read or a negative error */
+static int sysex_drain(struct pod *pod)
+{
+	int err;
+
+	err = transport_read(pod->t, pod->rxbuf, sizeof(pod->rxbuf));
+	if (err == -EAGAIN)
+		return 0;
+	if (err < 0)
+		return err;
 
-	return rbuf_curlen(&sybuf);
+	debug("(rx %d) ", err);
+	pod->rx_us = clock_us(CLOCK_REALTIME);
+	pod->rx_pos = 0;
+	pod->rx_len = err;
+
+	return err;
 }
 
-static void sysex_wait_on(unsigned char *sysex_msg, size_t cmpn)
+/* Wakes the consumer; a full pipe already does */
+static void rx_notify(struct pod *pod)
 {
-	int n;
+	ssize_t n;
+
+	n = write(pod->rx_pipe[1], "", 1);
+	(void)n;
+}
+
+/* Sleeps up to ms, returning true if the thread is being stopped */
+static bool rx_stopping(struct pod *pod, int ms)
+{
+	struct pollfd pfd = { .fd = pod->rx_stop[0], .events = POLLIN };
+
+	return poll(&pfd, 1, ms) > 0;
+}
+
+/*
+ * Receive thread: reads the device as soon as input arrives, so nothing
+ * waits in the kernel while the main thread is busy, and frames it onto
+ * the ring. It only ever waits for the consumer when the ring is full.
+ * On a read error it queues RX_ERROR behind what was received and exits.
+ */
+static void *rx_thread(void *arg)
+{
+	struct pod *pod = arg;
+	struct pollfd pfds[pod->npfds + 1];
+	unsigned short revents;
+	struct ring_msg *m;
+	int err;
+
+	memcpy(pfds, pod->pfds, pod->npfds * sizeof(*pfds));
+	pfds[pod->npfds].fd = pod->rx_stop[0];
+	pfds[pod->npfds].events = POLLIN;
 
 	for (;;) {
-		int i;
-		n = sysex_read();
-		if (n == 0)
+		while (pod->rx_pos < pod->rx_len) {
+			if (rx_frame(pod) > 0)
+				rx_notify(pod);
+			if (pod->rx_pos < pod->rx_len && rx_stopping(pod, 1))
+				return NULL;
+		}
+
+		err = poll(pfds, pod->npfds + 1, -1);
+		if (err < 0 && errno == EINTR)
 			continue;
+		if (err < 0) {
+			err = -errno;
+			break;
+		}
+		if (pfds[pod->npfds].revents)
+			return NULL;
 
-		if (memcmp(sysex_msg, sybuf.head, cmpn) == 0)
+		err = transport_revents(pod->t, TRANSPORT_IN, pfds, pod->npfds, &revents);
+		if (err < 0)
 			break;
 
-		if (debug_mode) {
-			printf("unexpected message rx\n");
-			for (i = 0; i < cmpn; i++) {
-				if (sysex_msg[i] != sybuf.head[i])
-					debug("idx %d wanted %02hhx got %02hhx\n", i, 
-						sysex_msg[i], sybuf.head[i]);
-			}
+		if (revents & POLLIN) {
+			err = sysex_drain(pod);
+			if (err < 0)
+				break;
+		} else if (revents & (POLLERR | POLLHUP)) {
+			err = -EPIPE;
+			break;
 		}
 	}
+
+	while ((m = ring_produce(&pod->ring)) == NULL) {
+		if (rx_stopping(pod, 1))
+			return NULL;
+	}
+
+	m->type = RX_ERROR;
+	m->len = 0;
+	m->err = err;
+	m->us = clock_us(CLOCK_REALTIME);
+	ring_publish(&pod->ring);
+	rx_notify(pod);
+
+	return NULL;
 }
 
-static void sysex_hello()
+/* Sessions with a running receive thread */
+static struct pod *rx_pods;
+
+static int rx_start(struct pod *pod)
 {
-	unsigned char hello_req[] = { SYSEX_START, 0x7e, 0x7f, 0x06, 0x01, SYSEX_END };
-	unsigned char hello_res[] = { 	0x7e, 0x7f, 0x06, 0x02, 0x00,
-					0x01, 0x0c, 0x00, 0x00, 0x00,
-					0x03, 0x30, 0x32, 0x33, 0x30 };
+	sigset_t all, old;
+	int err;
 
-	if (nohello)
-		info("WARNING: Skipping device discovery!\n");
+	if (pipe(pod->rx_pipe) < 0)
+		return -errno;
+	if (pipe(pod->rx_stop) < 0) {
+		err = -errno;
+		goto close_pipe;
+	}
+	fcntl(pod->rx_pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(pod->rx_pipe[1], F_SETFL, O_NONBLOCK);
 
-	debug("Probing... ");
-	sysex_send(hello_req, sizeof(hello_req));
-	debug("Waiting... ");
-	sysex_wait_on(hello_res, sizeof(hello_res));
+	/* Signals are left to the main thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	err = -pthread_create(&pod->rx_thread, NULL, rx_thread, pod);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err < 0)
+		goto close_stop;
 
-	if (hello_rx++ == 0)
-		info("Found Line 6 POD 2.3\n");
+	pod->rx_running = true;
+	pod->rx_next = rx_pods;
+	rx_pods = pod;
+
+	return 0;
+
+close_stop:
+	close(pod->rx_stop[0]);
+	close(pod->rx_stop[1]);
+close_pipe:
+	close(pod->rx_pipe[0]);
+	close(pod->rx_pipe[1]);
+
+	return err;
 }
 
-static void sysex_to_bank(struct bank *b, int n)
+static void rx_stop(struct pod *pod)
 {
-	unsigned char bank_req[] = { SYSEX_START, 0x00, 0x01, 0x0c, 0x01, 0x00, 0x00, n, SYSEX_END };
-	unsigned char bank_res[] = { 0x00, 0x01, 0x0c, 0x01, 0x01, 0x00, n , 0x00};
-	unsigned char buf[BANK_SIZE];
-	unsigned char *p;
-	int i;
+	struct pod **p;
 
-	sysex_send(bank_req, sizeof(bank_req));
-	sysex_wait_on(bank_res, sizeof(bank_res));
-	debug("Got bank (%d) %ld bytes\n", n, rbuf_curlen(&sybuf));
+	if (!pod->rx_running)
+		return;
 
-	EXIT_ON(rbuf_curlen(&sybuf) != (BANK_SIZE * 2 + sizeof(bank_res)), "unexpected bank length\n");
+	/* Hanging up the stop pipe wakes the thread */
+	close(pod->rx_stop[1]);
+	pthread_join(pod->rx_thread, NULL);
+	close(pod->rx_stop[0]);
+	close(pod->rx_pipe[0]);
+	close(pod->rx_pipe[1]);
+	pod->rx_running = false;
 
-	p = &sybuf.head[sizeof(bank_res)];
-	for (i = 0; i < BANK_SIZE; i++) {
-		buf[i] = (*p << 4) | *(p + 1);
-		p += 2;
-	}
+	for (p = &rx_pods; *p != pod; p = &(*p)->rx_next)
+		;
+	*p = pod->rx_next;
+}
 
-	memcpy(b, buf, sizeof(struct bank));
+/*
+ * A forked process gets no threads, and a parent reading on behalf of a
+ * child would take its replies: the threads are stopped across fork()
+ * and either side starts its own again when it next waits for input.
+ */
+static void rx_atfork(void)
+{
+	while (rx_pods)
+		rx_stop(rx_pods);
 }
 
-static void bank_to_sysex(struct bank *b, int n)
+/*
+ * Waits up to timeout ms (-1: forever) for input, keeping queued output
+ * flowing meanwhile. With a receive thread that is a wakeup from it;
+ * otherwise input is read here. Returns 0 if the timeout expired, 1 if
+ * not, or a negative error.
+ */
+static int rx_wait(struct pod *pod, int timeout)
 {
-	unsigned char bank_req_hdr[] = { SYSEX_START, 0x00, 0x01, 0x0c, 0x01, 0x01, 0x00, n , 0x00};
-	unsigned char *bytes = (unsigned char *)b;
-	unsigned char *p;
-	struct bank cur_b;
-	int i;
+	struct pollfd pfds[1 + pod->npfds + pod->nopfds];
+	unsigned short revents;
+	bool tx = tx_pending(pod) > 0;
+	char wakeups[64];
+	int n, err;
 
-	rbuf_rewind(&sybuf);
-	for (i = 0; i < sizeof(bank_req_hdr); i++) {
-		rbuf_append(&sybuf, bank_req_hdr[i]);
+	if (pod->rx_threaded && !pod->rx_running && rx_start(pod) < 0) {
+		debug("no receive thread, reading inline\n");
+		pod->rx_threaded = false;
 	}
 
-	for (i = 0; i < sizeof(struct bank); i++) {
-		rbuf_append(&sybuf, (*bytes & 0xf0) >> 4);
-		rbuf_append(&sybuf, (*bytes & 0x0f));
-		bytes++;
+	if (pod->rx_running) {
+		pfds[0].fd = pod->rx_pipe[0];
+		pfds[0].events = POLLIN;
+		n = 1;
+	} else {
+		memcpy(pfds, pod->pfds, pod->npfds * sizeof(*pfds));
+		n = pod->npfds;
 	}
+	if (tx)
+		memcpy(pfds + n, pod->opfds, pod->nopfds * sizeof(*pfds));
 
-	rbuf_append(&sybuf, SYSEX_END);
-	sysex_send(sybuf.head, rbuf_curlen(&sybuf));
+	err = poll(pfds, n + (tx ? pod->nopfds : 0), timeout);
+	if (err < 0 && errno == EINTR)
+		return 1;
+	if (err < 0)
+		return -errno;
+	if (err == 0)
+		return 0;
 
-	if (debug_mode) {
-		printf("sybuf size %ld:", rbuf_curlen(&sybuf));
-		for (p = sybuf.head; p < sybuf.cur; p++) {
-			printf(" %02hhx", *p);
+	if (tx) {
+		err = transport_revents(pod->t, TRANSPORT_OUT, pfds + n, pod->nopfds, &revents);
+		if (err < 0)
+			return err;
+		if (revents & POLLOUT) {
+			err = tx_flush(pod);
+			if (err < 0)
+				return err;
 		}
-		printf("\n");
 	}
 
-	sysex_to_bank(&cur_b, n);
-	if (memcmp(&b[n], &cur_b, sizeof(struct bank) != 0))
-		info("Error writing bank %s\n", bank_ntostr(n));
+	if (pod->rx_running) {
+		if (pfds[0].revents & POLLIN) {
+			while (read(pod->rx_pipe[0], wakeups, sizeof(wakeups)) > 0)
+				;
+		}
+		return 1;
+	}
+
+	err = transport_revents(pod->t, TRANSPORT_IN, pfds, pod->npfds, &revents);
+	if (err < 0)
+		return err;
+	if (revents & POLLIN) {
+		err = sysex_drain(pod);
+		return (err < 0) ? err : 1;
+	}
+	if (revents & (POLLERR | POLLHUP))
+		return -EPIPE;
+
+	return 1;
 }
 
-void sysex_set_all(const char *port_name, struct bank b[])
+/* Waits up to timeout ms (-1: forever) for input; false if the timeout expired */
+static bool sysex_fill(struct pod *pod, int timeout)
 {
-	int n;
-	time_t start;
-	time_t end;
+	int err = pod->rx_err;
 
-	midi_open(port_name);
-	sysex_hello();
+	if (err == 0)
+		err = rx_wait(pod, timeout);
+	EXIT_ON(err < 0, "%s: device error: %s\n", pod->port_name, transport_strerror(err));
 
-	start = time(NULL);
-	for (n = 0; n < BANKS_NR; n++) {
-		bank_to_sysex(&b[n], n);
-		info("Writing bank %s\r", bank_ntostr(n));
+	return err > 0;
+}
+
+/*
+ * Returns the length of the next message in sybuf, or -1 if none is
+ * complete within timeout ms (-1: forever). Input that does not complete
+ * a message does not extend the wait.
+ */
+static int sysex_read_timeout(struct pod *pod, int timeout)
+{
+	long deadline = now_ms() + timeout;
+	long left = timeout;
+
+	while (!sysex_frame(pod)) {
+		if (left == 0 || !sysex_fill(pod, left))
+			return -1;
+
+		if (timeout >= 0) {
+			left = deadline - now_ms();
+			if (left < 0)
+				left = 0;
+		}
 	}
-	end = time(NULL);
 
-	info("Done writing banks (%ld sec).\n", end - start);
+	return rbuf_curlen(&pod->sybuf);
+}
+
+static const unsigned char hello_req[] = { SYSEX_START, 0x7e, 0x7f, 0x06, 0x01, SYSEX_END };
+static const unsigned char hello_res[] = { 0x7e, 0x7f, 0x06, 0x02, 0x00,
+					   0x01, 0x0c, 0x00, 0x00, 0x00,
+					   0x03, 0x30, 0x32, 0x33, 0x30 };
+
+static void sysex_ident(struct pod *pod)
+{
+	pod->ident_len = rbuf_curlen(&pod->sybuf);
+	if (pod->ident_len > IDENT_MAX)
+		pod->ident_len = IDENT_MAX;
+	memcpy(pod->ident, pod->sybuf.head, pod->ident_len);
+}
+
+/* The firmware version from the identity reply, four ASCII digits, as "02.30" */
+static void sysex_firmware(struct pod *pod, char *s, size_t len)
+{
+	const unsigned char *v = pod->ident + IDENT_FW;
 
-	midi_close();
+	snprintf(s, len, "%c%c.%c%c", v[0], v[1], v[2], v[3]);
 }
 
-void sysex_get_all(const char *port_name, struct bank b[])
+/*
+ * Decodes a bank dump reply in sybuf into b.
+ * Returns the bank number, or -1 if sybuf holds no valid bank dump.
+ */
+static int sysex_decode_bank(struct pod *pod, struct bank *b)
 {
-	int n;
-	struct bank *p;
+	unsigned char bank_res[] = { 0x00, 0x01, 0x0c, 0x01, 0x01, 0x00 };
+	unsigned char *p = pod->sybuf.head;
+	int i, n;
 
-	midi_open(port_name);
-	sysex_hello();
+	if (rbuf_curlen(&pod->sybuf) < sizeof(bank_res) + 2 ||
+	    memcmp(p, bank_res, sizeof(bank_res)) != 0)
+		return -1;
 
-	for (n = 0; n < BANKS_NR; n++) {
-		sysex_to_bank(&b[n], n);
-		info("Read bank %s\r", bank_ntostr(n));
-		p++;
+	n = p[sizeof(bank_res)];
+	if (n >= BANKS_NR ||
+	    rbuf_curlen(&pod->sybuf) != (BANK_SIZE * 2 + sizeof(bank_res) + 2)) {
+		debug("unexpected bank (%d) length %ld\n", n, rbuf_curlen(&pod->sybuf));
+		return -1;
 	}
 
-	info("Done reading banks.\n");
+	p += sizeof(bank_res) + 2;
+	for (i = 0; i < BANK_SIZE; i++) {
+		((unsigned char *)b)[i] = (*p << 4) | *(p + 1);
+		p += 2;
+	}
 
-	midi_close();
+	return n;
 }
 
-int sysex_get_bank(const char *port_name, struct bank *b, int n)
+static void sysex_req_bank(struct pod *pod, int n)
 {
-	EXIT_ON(b == NULL,"NULL dereference @ %s", __func__);
+	unsigned char bank_req[] = { SYSEX_START, 0x00, 0x01, 0x0c, 0x01, 0x00, 0x00, n, SYSEX_END };
+
+	sysex_send(pod, bank_req, sizeof(bank_req));
+}
+
+static int req_find(struct pod *pod, int type, int n)
+{
+	int i;
 
-	midi_open(port_name);
-	sysex_hello();
-	sysex_to_bank(b, n);
-	midi_close();
+	for (i = 0; i < pod->nreqs; i++) {
+		if (pod->reqs[i].type == type && pod->reqs[i].bank == n)
+			return i;
+	}
 
-	return 0; // For now
+	return -1;
 }
 
-int sysex_set_bank(const char *port_name, struct bank *b, int n)
+static void req_retire(struct pod *pod, int i)
 {
-	EXIT_ON(b == NULL,"NULL dereference @ %s", __func__);
+	pod->nreqs--;
+	memmove(&pod->reqs[i], &pod->reqs[i + 1], (pod->nreqs - i) * sizeof(pod->reqs[0]));
+}
+
+/* Sends a request; one already outstanding is sent again and becomes the newest */
+static void req_send(struct pod *pod, int type, int n)
+{
+	int i;
 
-	midi_open(port_name);
-	sysex_hello();
-	bank_to_sysex(b, n);
-	midi_close();
+	i = req_find(pod, type, n);
+	if (i >= 0)
+		req_retire(pod, i);
 
-	return 0; // For now
+	pod->reqs[pod->nreqs].type = type;
+	pod->reqs[pod->nreqs].bank = n;
+	pod->nreqs++;
+
+	if (type == REQ_HELLO)
+		sysex_send(pod, hello_req, sizeof(hello_req));
+	else
+		sysex_req_bank(pod, n);
 }
 
-void program_change(const char *port_name, unsigned char n)
+/*
+ * Matches the message in sybuf to its outstanding request and retires
+ * it; a bank dump is decoded into b. Returns the request's position in
+ * the table (0: the oldest), or -1 if the message answers none.
+ */
+static int req_reply(struct pod *pod, struct request *r, struct bank *b)
 {
-	unsigned char program_change_req[] = { 0xb0, 0xc0, n };
+	int i, n;
+
+	/* Any firmware version of the device will do */
+	if (rbuf_curlen(&pod->sybuf) >= sizeof(hello_res) &&
+	    memcmp(pod->sybuf.head, hello_res, IDENT_FW) == 0) {
+		r->type = REQ_HELLO;
+		r->bank = 0;
+	} else {
+		n = sysex_decode_bank(pod, b);
+		if (n < 0) {
+			debug("unexpected message rx\n");
+			return -1;
+		}
+		r->type = REQ_DUMP;
+		r->bank = n;
+	}
+
+	i = req_find(pod, r->type, r->bank);
+	if (i < 0) {
+		debug("unsolicited reply (%d, %d)\n", r->type, r->bank);
+		return -1;
+	}
+
+	req_retire(pod, i);
+
+	return i;
+}
+
+/* Keeps a bank that came while something else was awaited */
+static void req_stash(struct pod *pod, int n, const struct bank *b)
+{
+	memcpy(&pod->stash[n], b, sizeof(struct bank));
+	pod->stashed[n] = true;
+}
+
+static bool req_unstash(struct pod *pod, int n, struct bank *b)
+{
+	if (!pod->stashed[n])
+		return false;
+
+	memcpy(b, &pod->stash[n], sizeof(struct bank));
+	pod->stashed[n] = false;
+
+	return true;
+}
+
+/*
+ * Waits up to timeout ms for the reply to a request, matching anything
+ * else that arrives meanwhile to its own. A bank dump is decoded into b.
+ * Returns false if the reply did not come.
+ */
+static bool req_wait(struct pod *pod, int type, int n, struct bank *b, int timeout)
+{
+	long deadline = now_ms() + timeout;
+	struct request r;
+	struct bank tmp;
+	long left;
+
+	for (;;) {
+		left = deadline - now_ms();
+		if (sysex_read_timeout(pod, (left > 0) ? left : 0) < 0)
+			return false;
+
+		if (req_reply(pod, &r, &tmp) < 0)
+			continue;
+
+		if (r.type == type && r.bank == n) {
+			if (b)
+				memcpy(b, &tmp, sizeof(tmp));
+			return true;
+		}
+
+		if (r.type == REQ_DUMP)
+			req_stash(pod, r.bank, &tmp);
+	}
+}
+
+static void sysex_hello(struct pod *pod)
+{
+	int retry;
+
+	if (nohello) {
+		info("WARNING: Skipping device discovery!\n");
+		return;
+	}
+
+	for (retry = 0; retry < 3; retry++) {
+		debug("Probing... ");
+		req_send(pod, REQ_HELLO, 0);
+		debug("Waiting... ");
+		if (req_wait(pod, REQ_HELLO, 0, NULL, backoff_ms(HELLO_TIMEOUT_MS, retry)))
+			break;
+	}
+	EXIT_ON(retry == 3, "No reply from a POD 2.3 on %s\n", pod->port_name);
+	sysex_ident(pod);
+
+	info("Found Line 6 POD 2.3\n");
+}
+
+/* Reads one bank, retrying lost replies. Returns 0 or -ETIMEDOUT */
+static int sysex_to_bank(struct pod *pod, struct bank *b, int n)
+{
+	int retry;
+
+	if (req_unstash(pod, n, b))
+		return 0;
+
+	for (retry = 0; retry <= DUMP_RETRIES; retry++) {
+		req_send(pod, REQ_DUMP, n);
+		if (req_wait(pod, REQ_DUMP, n, b, backoff_ms(DUMP_TIMEOUT_MS, retry))) {
+			debug("Got bank (%d)\n", n);
+			return 0;
+		}
+
+		debug("bank %d timed out (retry %d)\n", n, retry);
+	}
+
+	return -ETIMEDOUT;
+}
+
+/* Write verification */
+#define VERIFY_PASSES		3
+#define VERIFY_SAMPLE_PCT	25
+
+/*
+ * Pipelined bank dump: up to depth requests are kept in flight in the
+ * session's request table. A reply that overtakes an older request, or
+ * a request that times out, halves the depth; a timed out request is
+ * sent again under the same key, so a late reply still counts.
+ */
+struct dump {
+	struct bank *b;
+	bool want[BANKS_NR];
+	bool done[BANKS_NR];
+	int remaining;
+	int depth;
+	int timeouts;		/* consecutive, since the last reply */
+	bool failed;
+	long last;		/* time of the last request or reply */
+	struct pod *report;	/* progress is reported to this session's callback */
+};
+
+static bool dump_pending(struct dump *d, struct request *r)
+{
+	return r->type == REQ_DUMP && d->want[r->bank] && !d->done[r->bank];
+}
+
+/* Position of the dump's oldest request in the table, or -1 if none is in flight */
+static int dump_oldest(struct pod *pod, struct dump *d)
+{
+	int i;
+
+	for (i = 0; i < pod->nreqs; i++) {
+		if (dump_pending(d, &pod->reqs[i]))
+			return i;
+	}
+
+	return -1;
+}
+
+static int dump_inflight(struct pod *pod, struct dump *d)
+{
+	int i, nr = 0;
+
+	for (i = 0; i < pod->nreqs; i++)
+		nr += dump_pending(d, &pod->reqs[i]);
+
+	return nr;
+}
+
+static void dump_fallback(struct dump *d, const char *why)
+{
+	if (d->depth == 1)
+		return;
+
+	d->depth /= 2;
+	info("%s, reducing dump depth to %d\n", why, d->depth);
+}
+
+static void dump_start(struct dump *d, struct bank b[], const bool *want, int depth)
+{
+	int n;
+
+	memset(d, 0, sizeof(*d));
+	d->b = b;
+	d->depth = (depth < 1) ? 1 : depth;
+	d->last = now_ms();
+
+	for (n = 0; n < BANKS_NR; n++) {
+		d->want[n] = want ? want[n] : true;
+		if (d->want[n])
+			d->remaining++;
+	}
+}
+
+static void dump_accept(struct dump *d, int n, const struct bank *b)
+{
+	memcpy(&d->b[n], b, sizeof(struct bank));
+	d->done[n] = true;
+	d->remaining--;
+	d->timeouts = 0;
+	d->last = now_ms();
+
+	if (d->report && d->report->progress)
+		d->report->progress(n, &d->b[n], d->report->progress_arg);
+
+	info("Read bank %s\r", bank_ntostr(n));
+}
+
+/* Fills the window with requests for banks neither done nor in flight */
+static void dump_pump(struct pod *pod, struct dump *d)
+{
+	struct bank tmp;
+	int n;
+
+	for (n = 0; n < BANKS_NR && dump_inflight(pod, d) < d->depth; n++) {
+		if (!d->want[n] || d->done[n] || req_find(pod, REQ_DUMP, n) >= 0)
+			continue;
+
+		if (req_unstash(pod, n, &tmp)) {
+			dump_accept(d, n, &tmp);
+			continue;
+		}
+
+		req_send(pod, REQ_DUMP, n);
+		d->last = now_ms();
+	}
+}
+
+/* Handles the message in sybuf */
+static void dump_frame(struct pod *pod, struct dump *d)
+{
+	struct request r;
+	struct bank tmp;
+	int i, oldest;
+
+	i = req_reply(pod, &r, &tmp);
+	if (i < 0 || r.type != REQ_DUMP)
+		return;
+
+	if (!d->want[r.bank] || d->done[r.bank]) {
+		req_stash(pod, r.bank, &tmp);
+		return;
+	}
+
+	oldest = dump_oldest(pod, d);
+	if (oldest >= 0 && oldest < i)
+		dump_fallback(d, "Out of order reply");
+
+	dump_accept(d, r.bank, &tmp);
+}
+
+/* When the oldest request in flight is overdue, backing off after timeouts */
+static long dump_deadline(struct dump *d)
+{
+	return d->last + backoff_ms(DUMP_TIMEOUT_MS, d->timeouts);
+}
+
+/* Returns ms until the oldest request is overdue, asking again if it is */
+static int dump_expire(struct pod *pod, struct dump *d)
+{
+	long left;
+	int i;
+
+	i = dump_oldest(pod, d);
+	if (i < 0)
+		return -1;
+
+	left = dump_deadline(d) - now_ms();
+	if (left > 0)
+		return left;
+
+	debug("bank %d timed out\n", pod->reqs[i].bank);
+	if (++d->timeouts > DUMP_RETRIES) {
+		d->failed = true;
+		return 0;
+	}
+
+	req_send(pod, REQ_DUMP, pod->reqs[i].bank);
+	dump_fallback(d, "Reply timed out");
+	d->last = now_ms();
+
+	return 0;
+}
+
+/* Returns the number of banks that could not be read */
+static int dump_run(struct pod *pod, struct dump *d)
+{
+	int timeout;
+
+	while (d->remaining > 0) {
+		dump_pump(pod, d);
+		if (d->remaining == 0)
+			break;
+
+		timeout = dump_expire(pod, d);
+		if (d->failed) {
+			info("%s: device stopped responding\n", pod->port_name);
+			break;
+		}
+		if (timeout == 0)
+			continue;
+
+		if (sysex_read_timeout(pod, timeout) >= 0)
+			dump_frame(pod, d);
+	}
+
+	return d->remaining;
+}
+
+/* Waits out the store interval, letting queued output go meanwhile */
+static void store_pace(struct pod *pod)
+{
+	long left;
+
+	if (pod->store_gap_ms == 0)
+		return;
+
+	for (;;) {
+		left = pod->last_store + pod->store_gap_ms - now_ms();
+		if (left <= 0)
+			break;
+
+		if (tx_pending(pod) > 0)
+			tx_wait(pod, 0);
+		else
+			poll(NULL, 0, left);
+	}
+}
+
+static void sysex_store_bank(struct pod *pod, struct bank *b, int n)
+{
+	unsigned char bank_req_hdr[] = { SYSEX_START, 0x00, 0x01, 0x0c, 0x01, 0x01, 0x00, n , 0x00};
+	unsigned char msg[sizeof(bank_req_hdr) + BANK_SIZE * 2 + 1];
+	unsigned char *bytes = (unsigned char *)b;
+	unsigned char *p;
+	int i;
+
+	/* Built apart from sybuf, which may hold a partially received message */
+	memcpy(msg, bank_req_hdr, sizeof(bank_req_hdr));
+	p = &msg[sizeof(bank_req_hdr)];
+
+	for (i = 0; i < sizeof(struct bank); i++) {
+		*p++ = (*bytes & 0xf0) >> 4;
+		*p++ = (*bytes & 0x0f);
+		bytes++;
+	}
+
+	*p = SYSEX_END;
+	pod->stashed[n] = false;
+	store_pace(pod);
+	sysex_send(pod, msg, sizeof(msg));
+	pod->last_store = now_ms();
+
+	if (debug_mode) {
+		printf("msg size %ld:", sizeof(msg));
+		for (p = msg; p < msg + sizeof(msg); p++) {
+			printf(" %02hhx", *p);
+		}
+		printf("\n");
+	}
+}
+
+/* Writes a bank; with immediate verification, reads it back and rewrites it until it sticks */
+static bool bank_to_sysex(struct pod *pod, struct bank *b, int n)
+{
+	struct bank cur_b;
+	int pass;
+
+	for (pass = 0; pass < VERIFY_PASSES; pass++) {
+		if (pass > 0)
+			backoff_sleep(pass - 1);
+
+		sysex_store_bank(pod, b, n);
+
+		if (verify_policy != VERIFY_IMMEDIATE)
+			return true;
+
+		if (sysex_to_bank(pod, &cur_b, n) < 0) {
+			debug("bank %d readback timed out (pass %d)\n", n, pass);
+			continue;
+		}
+		if (memcmp(b, &cur_b, sizeof(struct bank)) == 0)
+			return true;
+
+		debug("bank %d readback mismatch (pass %d)\n", n, pass);
+	}
+
+	info("Error writing bank %s\n", bank_ntostr(n));
+
+	return false;
+}
+
+/* Picks roughly VERIFY_SAMPLE_PCT percent (at least one) of the written banks */
+static void verify_sample(bool check[], const bool written[])
+{
+	int idx[BANKS_NR];
+	int i, j, t, nr = 0, k;
+
+	for (i = 0; i < BANKS_NR; i++) {
+		check[i] = false;
+		if (written[i])
+			idx[nr++] = i;
+	}
+
+	k = (nr * VERIFY_SAMPLE_PCT + 99) / 100;
+	for (i = 0; i < k; i++) {
+		j = i + rand() % (nr - i);
+		t = idx[i];
+		idx[i] = idx[j];
+		idx[j] = t;
+		check[idx[i]] = true;
+	}
+}
+
+/* Waits until all queued output has left the host; returns the time taken */
+static long tx_drain(struct pod *pod)
+{
+	long start = now_ms();
+
+	tx_wait(pod, 0);
+	transport_drain(pod->t);
+
+	return now_ms() - start;
+}
+
+/*
+ * Adapts the store interval to what the device accepted: nr stores went
+ * out over ms, and lost of the checked ones did not stick. Spacing them
+ * by the time taken per accepted store keeps the device's pace.
+ */
+static void store_rate(struct pod *pod, long ms, int nr, int checked, int lost)
+{
+	long wire = STORE_MSG_LEN * 1000 / LINE_RATE;
+	long gap;
+
+	if (lost == 0 || nr == 0)
+		return;
+
+	/* A transport that buffers beyond the host returns before the wire is done */
+	if (ms < nr * wire)
+		ms = nr * wire;
+
+	if (lost < checked)
+		gap = ms * checked / ((long)nr * (checked - lost));
+	else
+		gap = pod->store_gap_ms * 2;
+
+	if (gap < wire)
+		gap = wire;
+	if (gap <= pod->store_gap_ms)
+		gap = pod->store_gap_ms + wire;
+	if (gap > STORE_GAP_MAX_MS)
+		gap = STORE_GAP_MAX_MS;
+
+	pod->store_gap_ms = gap;
+	info("Device dropped %d of %d stores, pacing stores %ld ms apart\n", lost, checked, gap);
+}
+
+/*
+ * Deferred verification: all banks were streamed out already, nr of them
+ * over ms; dump the banks to check in one pipelined pass and rewrite any
+ * that differ, until they all match or VERIFY_PASSES is exhausted. A
+ * mismatch in a sample escalates to checking every written bank.
+ * Returns the number of banks that still differ.
+ */
+static int verify_deferred(struct pod *pod, struct bank b[], const bool written[], bool check[],
+			   long ms, int nr)
+{
+	struct bank cur[BANKS_NR];
+	struct dump d;
+	bool sampled = (verify_policy == VERIFY_SAMPLED);
+	int pass, n, bad = 0, checked;
+	long start;
+
+	for (pass = 0; pass < VERIFY_PASSES; pass++) {
+		dump_start(&d, cur, check, dump_depth);
+		dump_run(pod, &d);
+
+		/* Banks that could not be read back count as mismatches */
+		bad = checked = 0;
+		for (n = 0; n < BANKS_NR; n++) {
+			if (!check[n])
+				continue;
+
+			checked++;
+			if (d.done[n] && memcmp(&b[n], &cur[n], sizeof(struct bank)) == 0) {
+				check[n] = false;
+				continue;
+			}
+
+			debug("bank %d verify mismatch (pass %d)\n", n, pass);
+			bad++;
+		}
+
+		if (bad == 0)
+			break;
+
+		info("%d banks differ, rewriting\n", bad);
+		store_rate(pod, ms, nr, checked, bad);
+		backoff_sleep(pass);
+
+		start = now_ms();
+		for (n = 0; n < BANKS_NR; n++) {
+			if (check[n])
+				sysex_store_bank(pod, &b[n], n);
+		}
+		tx_drain(pod);
+		ms = now_ms() - start;
+		nr = bad;
+
+		if (sampled) {
+			sampled = false;
+			memcpy(check, written, sizeof(bool) * BANKS_NR);
+		}
+	}
+
+	for (n = 0; n < BANKS_NR && bad; n++) {
+		if (check[n])
+			info("Error writing bank %s\n", bank_ntostr(n));
+	}
+
+	return bad;
+}
+
+/*
+ * A session opened here reads the device from its own thread; fleet
+ * sessions are all read from the one poll loop instead.
+ */
+struct pod *pod_open(const char *port_name)
+{
+	static bool atfork;
+	struct pod *pod;
+	int err;
+
+	pod = calloc(1, sizeof(*pod));
+	EXIT_ON(pod == NULL, "%s: out of memory\n", __func__);
+
+	if (!atfork) {
+		pthread_atfork(rx_atfork, NULL, NULL);
+		atfork = true;
+	}
+
+	pod->port_name = port_name;
+	pod->rx_threaded = true;
+	err = midi_open(pod);
+	EXIT_ON(err < 0, "Error opening %s: %s\n", port_name, transport_strerror(err));
+	sysex_hello(pod);
+
+	return pod;
+}
+
+void pod_close(struct pod *pod)
+{
+	if (!pod)
+		return;
+
+	/* Let queued writes (e.g. a program change) leave before closing */
+	tx_drain(pod);
+	midi_close(pod);
+	free(pod);
+}
+
+const unsigned char *pod_ident(struct pod *pod, size_t *len)
+{
+	*len = pod->ident_len;
+
+	return pod->ident;
+}
+
+void pod_flush(struct pod *pod)
+{
+	tx_drain(pod);
+}
+
+int pod_monitor(struct pod *pod, pod_monitor_fn fn, void *arg)
+{
+	int err;
+
+	pod->monitor = fn;
+	pod->monitor_arg = arg;
+
+	for (;;) {
+		while (sysex_frame(pod)) {
+			midi_event(pod, MIDI_SYSEX, pod->sy_us,
+				   pod->sybuf.head, rbuf_curlen(&pod->sybuf));
+		}
+
+		err = pod->rx_err;
+		if (err < 0)
+			break;
+
+		err = rx_wait(pod, -1);
+		if (err < 0)
+			break;
+	}
+
+	pod->monitor = NULL;
+
+	return err;
+}
+
+void pod_progress(struct pod *pod, sysex_progress_fn fn, void *arg)
+{
+	pod->progress = fn;
+	pod->progress_arg = arg;
+}
+
+int sysex_set_banks(struct pod *pod, struct bank b[], const bool want[])
+{
+	bool written[BANKS_NR];
+	bool check[BANKS_NR];
+	int n, nr = 0, bad = 0;
+	long start, end, ms, bytes;
+
+	start = now_ms();
+	bytes = pod->tx_bytes;
+	for (n = 0; n < BANKS_NR; n++) {
+		written[n] = !want || want[n];
+		if (!written[n])
+			continue;
+
+		nr++;
+		if (!bank_to_sysex(pod, &b[n], n))
+			bad++;
+		else if (pod->progress && verify_policy != VERIFY_DEFERRED &&
+			 verify_policy != VERIFY_SAMPLED)
+			pod->progress(n, &b[n], pod->progress_arg);
+		info("Writing bank %s\r", bank_ntostr(n));
+	}
+
+	/* Throughput of the writes, up to the last byte reaching the wire */
+	tx_drain(pod);
+	ms = now_ms() - start;
+	bytes = pod->tx_bytes - bytes;
+	if (ms <= 0 || bytes * 1000 / LINE_RATE > ms)
+		info("Sent %ld bytes in %ld ms (buffered past the host, wire rate unknown)\n",
+		     bytes, ms);
+	else
+		info("Sent %ld bytes in %ld ms: %ld bytes/s, %ld%% of line rate\n", bytes, ms,
+		     bytes * 1000 / ms, bytes * 1000 * 100 / ms / LINE_RATE);
+
+	switch (verify_policy) {
+	case VERIFY_DEFERRED:
+	case VERIFY_SAMPLED:
+		if (verify_policy == VERIFY_SAMPLED)
+			verify_sample(check, written);
+		else
+			memcpy(check, written, sizeof(check));
+		bad = verify_deferred(pod, b, written, check, ms, nr);
+
+		/* Only now is it known which banks stuck */
+		for (n = 0; n < BANKS_NR && pod->progress; n++) {
+			if (written[n] && !check[n])
+				pod->progress(n, &b[n], pod->progress_arg);
+		}
+		break;
+	}
+	end = now_ms();
+
+	info("Done writing banks (%ld sec).\n", (end - start + 500) / 1000);
+
+	return bad;
+}
+
+int sysex_set_all(struct pod *pod, struct bank b[])
+{
+	return sysex_set_banks(pod, b, NULL);
+}
+
+int sysex_get_banks(struct pod *pod, struct bank b[], const bool want[])
+{
+	struct dump d;
+	int missing;
+
+	dump_start(&d, b, want, dump_depth);
+	d.report = pod;
+	missing = dump_run(pod, &d);
+
+	if (missing == 0)
+		info("Done reading banks.\n");
+
+	return missing;
+}
+
+int sysex_get_all(struct pod *pod, struct bank b[])
+{
+	return sysex_get_banks(pod, b, NULL);
+}
+
+int sysex_get_bank(struct pod *pod, struct bank *b, int n)
+{
+	EXIT_ON(b == NULL,"NULL dereference @ %s", __func__);
+
+	return sysex_to_bank(pod, b, n);
+}
+
+int sysex_set_bank(struct pod *pod, struct bank *b, int n)
+{
+	EXIT_ON(b == NULL,"NULL dereference @ %s", __func__);
+
+	return bank_to_sysex(pod, b, n) ? 0 : -EIO;
+}
+
+void program_change(struct pod *pod, unsigned char n)
+{
+	unsigned char program_change_req[] = { 0xb0, 0xc0, n };
+
+	sysex_send(pod, program_change_req, sizeof(program_change_req));
+}
+
+bool pod_cc(struct pod *pod, int cc, int val)
+{
+	bool pending = pod->cc_pending[cc];
+
+	pod->cc_val[cc] = val;
+	if (!pending) {
+		pod->cc_queue[(pod->cc_head + pod->cc_len++) % CC_NR] = cc;
+		pod->cc_pending[cc] = true;
+	}
+
+	return pending;
+}
+
+int pod_cc_flush(struct pod *pod)
+{
+	long long now = now_us();
+	unsigned char msg[3] = { 0xb0 };
+	int cc;
+
+	if (pod->cc_idle_us < now)
+		pod->cc_idle_us = now;
+
+	while (pod->cc_len > 0 && pod->cc_idle_us - now <= CC_AHEAD_US) {
+		cc = pod->cc_queue[pod->cc_head];
+		pod->cc_head = (pod->cc_head + 1) % CC_NR;
+		pod->cc_len--;
+		pod->cc_pending[cc] = false;
+
+		msg[1] = cc;
+		msg[2] = pod->cc_val[cc];
+		sysex_send(pod, msg, sizeof(msg));
+		pod->cc_idle_us += CC_MSG_US;
+	}
+
+	if (pod->cc_len == 0)
+		return -1;
+
+	return (pod->cc_idle_us - now - CC_AHEAD_US + 999) / 1000;
+}
+
+/*
+ * Fleet mode: one operation on many devices at once. Every device runs
+ * its own job state machine, and a single poll() loop over all their
+ * descriptors feeds received messages and timeouts to the jobs, so the
+ * whole run takes as long as the slowest device.
+ */
+enum {
+	JOB_HELLO,
+	JOB_DUMP,
+	JOB_STORE,
+	JOB_DONE,
+};
+
+struct job {
+	struct fleet_dev *dev;
+	struct pod pod;
+	int op;
+	int state;
+	long start;
+	long deadline;
+	long long sent_us;	/* when the identity request was sent */
+	int pfd;		/* first descriptor in the fleet pollfd array */
+
+	struct dump d;
+	struct bank cur[BANKS_NR];
+	bool written[BANKS_NR];
+	bool check[BANKS_NR];
+	bool store[BANKS_NR];
+	bool sampled;
+	int pass;
+};
+
+static void job_finish(struct job *job, int err, const char *status)
+{
+	/* The last stores may still be on their way out */
+	if (err == 0 && job->op == FLEET_RESTORE)
+		tx_drain(&job->pod);
+
+	job->dev->err = err;
+	job->dev->status = status;
+	job->dev->ms = now_ms() - job->start;
+	job->state = JOB_DONE;
+
+	midi_close(&job->pod);
+}
+
+static void job_begin(struct job *job)
+{
+	struct fleet_dev *dev = job->dev;
+	bool want[BANKS_NR] = { false };
+
+	switch (job->op) {
+	case FLEET_QUERY:
+		want[dev->bank] = true;
+		dump_start(&job->d, dev->b, want, 1);
+		dump_pump(&job->pod, &job->d);
+		job->state = JOB_DUMP;
+		break;
+	case FLEET_SAVE:
+		dump_start(&job->d, dev->b, NULL, dump_depth);
+		dump_pump(&job->pod, &job->d);
+		job->state = JOB_DUMP;
+		break;
+	case FLEET_RESTORE:
+		memset(job->written, true, sizeof(job->written));
+		memcpy(job->store, job->written, sizeof(job->store));
+		if (verify_policy == VERIFY_SAMPLED)
+			verify_sample(job->check, job->written);
+		else
+			memcpy(job->check, job->written, sizeof(job->check));
+		job->sampled = (verify_policy == VERIFY_SAMPLED);
+		job->state = JOB_STORE;
+		break;
+	case FLEET_PROBE:
+		job_finish(job, 0, "ok");
+		break;
+	}
+}
+
+/* Opens the device and sends the identity request, to be answered by deadline */
+static void job_start(struct job *job, long deadline)
+{
+	int err;
+
+	job->start = now_ms();
+	job->pod.port_name = job->dev->port_name;
+
+	err = midi_open(&job->pod);
+	if (err < 0) {
+		job->state = JOB_DONE;
+		job->dev->err = err;
+		job->dev->status = transport_strerror(err);
+		return;
+	}
+
+	if (nohello && job->op != FLEET_PROBE) {
+		job_begin(job);
+		return;
+	}
+
+	req_send(&job->pod, REQ_HELLO, 0);
+	job->sent_us = now_us();
+	job->deadline = deadline;
+	job->state = JOB_HELLO;
+}
+
+/* A verification dump of a restore completed: rewrite what differs */
+static void job_verified(struct job *job)
+{
+	int n, bad = 0;
+
+	for (n = 0; n < BANKS_NR; n++) {
+		job->store[n] = false;
+		if (!job->check[n])
+			continue;
+
+		if (memcmp(&job->dev->b[n], &job->cur[n], sizeof(struct bank)) == 0) {
+			job->check[n] = false;
+			continue;
+		}
+
+		job->store[n] = true;
+		bad++;
+	}
+
+	if (bad == 0) {
+		job_finish(job, 0, "ok");
+		return;
+	}
+
+	if (++job->pass >= VERIFY_PASSES) {
+		job_finish(job, -EIO, "verification failed");
+		return;
+	}
+
+	if (job->sampled) {
+		job->sampled = false;
+		memcpy(job->check, job->written, sizeof(job->check));
+	}
+
+	job->state = JOB_STORE;
+}
+
+/* The dump has read every bank it wanted */
+static void job_dumped(struct job *job)
+{
+	if (job->op == FLEET_RESTORE)
+		job_verified(job);
+	else
+		job_finish(job, 0, "ok");
+}
+
+static void job_frame(struct job *job)
+{
+	struct pod *pod = &job->pod;
+	struct request r;
+	struct bank tmp;
+
+	switch (job->state) {
+	case JOB_HELLO:
+		if (req_reply(pod, &r, &tmp) < 0 || r.type != REQ_HELLO)
+			return;
+
+		job->dev->rtt_us = now_us() - job->sent_us;
+		sysex_ident(pod);
+		sysex_firmware(pod, job->dev->firmware, sizeof(job->dev->firmware));
+		job_begin(job);
+		break;
+	case JOB_DUMP:
+		dump_frame(pod, &job->d);
+		if (job->d.remaining == 0)
+			job_dumped(job);
+		break;
+	}
+}
+
+/* Output has room: send the next pending store */
+static void job_store(struct job *job)
+{
+	int n;
+
+	for (n = 0; n < BANKS_NR; n++) {
+		if (!job->store[n])
+			continue;
+
+		sysex_store_bank(&job->pod, &job->dev->b[n], n);
+		job->store[n] = false;
+		return;
+	}
+
+	if (verify_policy == VERIFY_NONE) {
+		job_finish(job, 0, "ok");
+		return;
+	}
+
+	dump_start(&job->d, job->cur, job->check, dump_depth);
+	job->state = JOB_DUMP;
+}
+
+/* Handles expired deadlines and keeps the dump window full */
+static void job_timer(struct job *job)
+{
+	switch (job->state) {
+	case JOB_HELLO:
+		if (now_ms() >= job->deadline)
+			job_finish(job, -ETIMEDOUT, "no identity reply");
+		break;
+	case JOB_DUMP:
+		dump_expire(&job->pod, &job->d);
+		if (job->d.failed) {
+			job_finish(job, -ETIMEDOUT, "device stopped responding");
+			break;
+		}
+		dump_pump(&job->pod, &job->d);
+		if (job->d.remaining == 0)
+			job_dumped(job);
+		break;
+	}
+}
+
+/*
+ * Returns ms until the job's next deadline, or -1 if it has none. A dump
+ * always has requests in flight while banks remain: its window is filled
+ * when it starts and after every reply or timeout.
+ */
+static int job_timeout(struct job *job)
+{
+	long left;
+
+	switch (job->state) {
+	case JOB_HELLO:
+		left = job->deadline - now_ms();
+		break;
+	case JOB_DUMP:
+		if (dump_oldest(&job->pod, &job->d) < 0)
+			return -1;
+		left = dump_deadline(&job->d) - now_ms();
+		break;
+	default:
+		return -1;
+	}
+
+	return (left > 0) ? left : 0;
+}
+
+static void job_poll(struct job *job, struct pollfd *pfds)
+{
+	struct pod *pod = &job->pod;
+	unsigned short revents;
+	int err;
+
+	err = transport_revents(pod->t, TRANSPORT_IN, &pfds[job->pfd], pod->npfds, &revents);
+	if (err < 0 || (revents & (POLLERR | POLLHUP))) {
+		job_finish(job, -EIO, "device error");
+		return;
+	}
+
+	if (revents & POLLIN) {
+		err = sysex_drain(pod);
+		if (err < 0) {
+			job_finish(job, err, transport_strerror(err));
+			return;
+		}
+
+		while (job->state != JOB_DONE && sysex_frame(pod))
+			job_frame(job);
+
+		/* The device is closed once its job is done */
+		if (job->state == JOB_DONE)
+			return;
+	}
+
+	err = transport_revents(pod->t, TRANSPORT_OUT, &pfds[job->pfd + pod->npfds],
+				pod->nopfds, &revents);
+	if (err >= 0 && (revents & POLLOUT)) {
+		err = tx_flush(pod);
+		if (err < 0) {
+			job_finish(job, err, transport_strerror(err));
+			return;
+		}
+
+		/* The next store is queued once the previous one is with the kernel */
+		if (job->state == JOB_STORE && tx_pending(pod) == 0)
+			job_store(job);
+	}
+
+	if (job->state != JOB_DONE)
+		job_timer(job);
+}
+
+void sysex_fleet(int op, struct fleet_dev devs[], int nr)
+{
+	struct job *jobs;
+	struct pollfd *pfds;
+	int i, n, npfds = 0, active, timeout, t, err;
+	long deadline;
+
+	jobs = calloc(nr, sizeof(*jobs));
+	EXIT_ON(jobs == NULL, "%s: out of memory\n", __func__);
+
+	/* All identity requests go out together and share one deadline */
+	deadline = now_ms() + ((op == FLEET_PROBE) ? probe_timeout : HELLO_TIMEOUT_MS);
+	for (i = 0; i < nr; i++) {
+		jobs[i].dev = &devs[i];
+		jobs[i].op = op;
+		job_start(&jobs[i], deadline);
+		npfds += jobs[i].pod.npfds + jobs[i].pod.nopfds;
+	}
+
+	pfds = calloc(npfds + 1, sizeof(*pfds));
+	EXIT_ON(pfds == NULL, "%s: out of memory\n", __func__);
+
+	for (;;) {
+		active = 0;
+		timeout = -1;
+		n = 0;
+
+		for (i = 0; i < nr; i++) {
+			struct job *job = &jobs[i];
+			struct pod *pod = &job->pod;
+
+			if (job->state == JOB_DONE)
+				continue;
+
+			active++;
+			job->pfd = n;
+			memcpy(&pfds[n], pod->pfds, pod->npfds * sizeof(*pfds));
+			n += pod->npfds;
+
+			memcpy(&pfds[n], pod->opfds, pod->nopfds * sizeof(*pfds));
+			if (job->state != JOB_STORE && tx_pending(pod) == 0) {
+				for (t = 0; t < pod->nopfds; t++)
+					pfds[n + t].events = 0;
+			}
+			n += pod->nopfds;
+
+			t = job_timeout(job);
+			if (t >= 0 && (timeout < 0 || t < timeout))
+				timeout = t;
+		}
+
+		if (active == 0)
+			break;
+
+		err = poll(pfds, n, timeout);
+		if (err < 0 && errno == EINTR)
+			continue;
+		EXIT_ON(err < 0, "%s: poll error (errno %d)\n", __func__, errno);
+
+		for (i = 0; i < nr; i++) {
+			if (jobs[i].state != JOB_DONE)
+				job_poll(&jobs[i], pfds);
+		}
+	}
 
-	midi_open(port_name);
-	sysex_hello();
-	sysex_send(program_change_req, sizeof(program_change_req));
-	midi_close();
+	free(pfds);
+	free(jobs);
 }
@@ -22,10 +22,93 @@
 #ifndef _POD6CTL_SYSEX_H
 #define _POD6CTL_SYSEX_H
 
-void sysex_get_all(const char *port_name, struct bank b[]);
-void sysex_set_all(const char *port_name, struct bank b[]);
-int sysex_get_bank(const char *port_name, struct bank *b, int n);
-int sysex_set_bank(const char *port_name, struct bank *b, int n);
-void program_change(const char *port_name, unsigned char n);
+/*
+ * A device session: the port is opened and the identity handshake done
+ * once in pod_open(); any number of operations may then use it.
+ */
+struct pod;
+
+/* How writes are read back and checked (verify_policy) */
+enum {
+	VERIFY_NONE,		/* Fire and forget */
+	VERIFY_IMMEDIATE,	/* Read back each bank right after writing it */
+	VERIFY_DEFERRED,	/* Stream all writes, then verify in one dump */
+	VERIFY_SAMPLED,		/* Like deferred, for a random subset of banks */
+};
+
+struct pod *pod_open(const char *port_name);
+void pod_close(struct pod *pod);
+const unsigned char *pod_ident(struct pod *pod, size_t *len);
+/* Waits until everything queued for the device has been sent */
+void pod_flush(struct pod *pod);
+
+/*
+ * Called for each bank as a multi-bank read completes it, or once a
+ * multi-bank write of it has been verified (or sent, with VERIFY_NONE).
+ */
+typedef void (*sysex_progress_fn)(int n, const struct bank *b, void *arg);
+void pod_progress(struct pod *pod, sysex_progress_fn fn, void *arg);
+
+/*
+ * Monitoring: everything the device sends is passed to fn as it arrives,
+ * until the port is closed (-EPIPE) or fails. Channel messages come with
+ * running status filled in, SysEx without F0/F7. The data is only valid
+ * during the call; us is the wall clock time it was read.
+ */
+enum {
+	MIDI_CHANNEL,
+	MIDI_SYSEX,
+	MIDI_REALTIME,
+};
+
+struct midi_event {
+	int type;
+	long long us;
+	const unsigned char *data;
+	size_t len;
+};
+
+typedef void (*pod_monitor_fn)(const struct midi_event *ev, void *arg);
+int pod_monitor(struct pod *pod, pod_monitor_fn fn, void *arg);
+
+/* Multi-bank reads return the number of banks that could not be read */
+int sysex_get_all(struct pod *pod, struct bank b[]);
+int sysex_get_banks(struct pod *pod, struct bank b[], const bool want[]);
+int sysex_set_all(struct pod *pod, struct bank b[]);
+int sysex_set_banks(struct pod *pod, struct bank b[], const bool want[]);
+int sysex_get_bank(struct pod *pod, struct bank *b, int n);
+int sysex_set_bank(struct pod *pod, struct bank *b, int n);
+void program_change(struct pod *pod, unsigned char n);
+
+/*
+ * Live edits of the edit buffer. pod_cc() queues a control change; a
+ * value for a controller that has not been sent yet replaces the queued
+ * one (and true is returned). pod_cc_flush() sends as many as the wire
+ * takes right now and returns the ms until it takes more, or -1 when
+ * nothing is left to send.
+ */
+bool pod_cc(struct pod *pod, int cc, int val);
+int pod_cc_flush(struct pod *pod);
+
+/* Fleet mode: one operation on many devices, driven by one event loop */
+enum {
+	FLEET_QUERY,
+	FLEET_SAVE,
+	FLEET_RESTORE,
+	FLEET_PROBE,		/* Identity handshake only */
+};
+
+struct fleet_dev {
+	const char *port_name;
+	struct bank b[BANKS_NR];	/* Image read (save, query) or written (restore) */
+	int bank;			/* Bank to query */
+	int err;			/* 0 or a negative error code */
+	const char *status;
+	long ms;			/* Time taken */
+	char firmware[8];		/* From the identity reply, e.g. "02.30" */
+	long rtt_us;			/* Identity request to reply */
+};
+
+void sysex_fleet(int op, struct fleet_dev devs[], int nr);
 
 #endif
@@ -0,0 +1,457 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  MIDI Transports
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+
+#include <alsa/asoundlib.h>
+
+#include "pod6ctl.h"
+#include "transport.h"
+
+struct transport_ops {
+	const char *prefix;
+	int (*open)(struct transport *t, const char *name);
+	void (*close)(struct transport *t);
+	int (*nfds)(struct transport *t, int dir);
+	int (*pollfds)(struct transport *t, int dir, struct pollfd *pfds, int n);
+	int (*revents)(struct transport *t, int dir, struct pollfd *pfds, int n,
+		       unsigned short *revents);
+	ssize_t (*read)(struct transport *t, unsigned char *buf, size_t len);
+	ssize_t (*write)(struct transport *t, const unsigned char *buf, size_t len);
+	int (*drain)(struct transport *t);
+	int (*set_buffer)(struct transport *t, size_t size, size_t avail_min);
+};
+
+struct transport {
+	const struct transport_ops *ops;
+
+	/* ALSA raw MIDI */
+	snd_rawmidi_t *input;
+	snd_rawmidi_t *output;
+
+	/* Descriptor based transports */
+	int rfd;
+	int wfd;
+	bool tty;
+};
+
+/* ALSA raw MIDI */
+
+static int rawmidi_open(struct transport *t, const char *name)
+{
+	/* Both directions are non-blocking; transport_write_all() waits for room */
+	return snd_rawmidi_open(&t->input, &t->output, name, SND_RAWMIDI_NONBLOCK);
+}
+
+static void rawmidi_close(struct transport *t)
+{
+	if (t->input)
+		snd_rawmidi_close(t->input);
+	if (t->output)
+		snd_rawmidi_close(t->output);
+}
+
+static snd_rawmidi_t *rawmidi_dir(struct transport *t, int dir)
+{
+	return (dir == TRANSPORT_IN) ? t->input : t->output;
+}
+
+static int rawmidi_nfds(struct transport *t, int dir)
+{
+	return snd_rawmidi_poll_descriptors_count(rawmidi_dir(t, dir));
+}
+
+static int rawmidi_pollfds(struct transport *t, int dir, struct pollfd *pfds, int n)
+{
+	return snd_rawmidi_poll_descriptors(rawmidi_dir(t, dir), pfds, n);
+}
+
+static int rawmidi_revents(struct transport *t, int dir, struct pollfd *pfds, int n,
+			   unsigned short *revents)
+{
+	return snd_rawmidi_poll_descriptors_revents(rawmidi_dir(t, dir), pfds, n, revents);
+}
+
+static ssize_t rawmidi_read(struct transport *t, unsigned char *buf, size_t len)
+{
+	return snd_rawmidi_read(t->input, buf, len);
+}
+
+static ssize_t rawmidi_write(struct transport *t, const unsigned char *buf, size_t len)
+{
+	return snd_rawmidi_write(t->output, buf, len);
+}
+
+static int rawmidi_drain(struct transport *t)
+{
+	return snd_rawmidi_drain(t->output);
+}
+
+static int rawmidi_set_buffer(struct transport *t, size_t size, size_t avail_min)
+{
+	snd_rawmidi_params_t *params;
+	int err;
+
+	snd_rawmidi_params_alloca(&params);
+
+	err = snd_rawmidi_params_current(t->output, params);
+	if (err < 0)
+		return err;
+
+	err = snd_rawmidi_params_set_buffer_size(t->output, params, size);
+	if (err < 0)
+		return err;
+
+	err = snd_rawmidi_params_set_avail_min(t->output, params, avail_min);
+	if (err < 0)
+		return err;
+
+	err = snd_rawmidi_params(t->output, params);
+	if (err < 0)
+		return err;
+
+	return snd_rawmidi_params_get_buffer_size(params);
+}
+
+/* File descriptors: tty, fd and loop */
+
+static int fd_setup(struct transport *t)
+{
+	if (fcntl(t->rfd, F_SETFL, fcntl(t->rfd, F_GETFL) | O_NONBLOCK) < 0 ||
+	    fcntl(t->wfd, F_SETFL, fcntl(t->wfd, F_GETFL) | O_NONBLOCK) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int tty_open(struct transport *t, const char *name)
+{
+	struct termios tio;
+
+	t->rfd = t->wfd = open(name, O_RDWR | O_NOCTTY);
+	if (t->rfd < 0)
+		return -errno;
+
+	/* Raw 8-bit bytes; the line rate is whatever the adapter is set to */
+	if (tcgetattr(t->rfd, &tio) == 0) {
+		cfmakeraw(&tio);
+		tcsetattr(t->rfd, TCSANOW, &tio);
+		t->tty = true;
+	}
+
+	return fd_setup(t);
+}
+
+static int fdnum_open(struct transport *t, const char *name)
+{
+	char *end;
+	long fd;
+
+	fd = strtol(name, &end, 10);
+	if (*name == '\0' || *end != '\0' || fd < 0)
+		return -EINVAL;
+
+	/* Duplicated so that closing the transport leaves the original alone */
+	t->rfd = t->wfd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (t->rfd < 0)
+		return -errno;
+
+	return fd_setup(t);
+}
+
+static int loop_open(struct transport *t, const char *name)
+{
+	int p[2];
+
+	if (pipe(p) < 0)
+		return -errno;
+
+	t->rfd = p[0];
+	t->wfd = p[1];
+
+	return fd_setup(t);
+}
+
+static void fd_close(struct transport *t)
+{
+	if (t->rfd >= 0)
+		close(t->rfd);
+	if (t->wfd >= 0 && t->wfd != t->rfd)
+		close(t->wfd);
+}
+
+static int fd_nfds(struct transport *t, int dir)
+{
+	return 1;
+}
+
+static int fd_pollfds(struct transport *t, int dir, struct pollfd *pfds, int n)
+{
+	if (n < 1)
+		return -EINVAL;
+
+	pfds->fd = (dir == TRANSPORT_IN) ? t->rfd : t->wfd;
+	pfds->events = (dir == TRANSPORT_IN) ? POLLIN : POLLOUT;
+	pfds->revents = 0;
+
+	return 1;
+}
+
+static int fd_revents(struct transport *t, int dir, struct pollfd *pfds, int n,
+		      unsigned short *revents)
+{
+	*revents = pfds->revents;
+
+	return 0;
+}
+
+static ssize_t fd_read(struct transport *t, unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	n = read(t->rfd, buf, len);
+	if (n < 0)
+		return (errno == EWOULDBLOCK) ? -EAGAIN : -errno;
+	if (n == 0)
+		return -EPIPE;
+
+	return n;
+}
+
+static ssize_t fd_write(struct transport *t, const unsigned char *buf, size_t len)
+{
+	ssize_t n;
+
+	n = write(t->wfd, buf, len);
+	if (n < 0)
+		return (errno == EWOULDBLOCK || errno == EINTR) ? -EAGAIN : -errno;
+
+	return n;
+}
+
+static int fd_drain(struct transport *t)
+{
+	if (t->tty && tcdrain(t->wfd) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* The kernel buffers of ttys, sockets and pipes are left as they are */
+static int fd_set_buffer(struct transport *t, size_t size, size_t avail_min)
+{
+	return 0;
+}
+
+/*
+ * Kernel raw MIDI device node, read and written directly: nothing of
+ * alsa-lib runs, so its configuration is never loaded. <sound/asound.h>
+ * clashes with alsa-lib's headers; the two ioctls used are spelled out
+ * here as the kernel defines them.
+ */
+struct raw_params {
+	int stream;
+	size_t buffer_size;
+	size_t avail_min;
+	unsigned int no_active_sensing: 1;
+	unsigned int mode;
+	unsigned char reserved[12];
+};
+
+#define RAW_STREAM_OUTPUT	0
+#define RAW_IOCTL_PARAMS	_IOWR('W', 0x10, struct raw_params)
+#define RAW_IOCTL_DRAIN		_IOW('W', 0x31, int)
+
+/* Takes a device node, or hw:card,device for /dev/snd/midiC<card>D<device> */
+static int raw_open(struct transport *t, const char *name)
+{
+	char path[64];
+	int card, dev = 0;
+
+	if (sscanf(name, "hw:%d,%d", &card, &dev) >= 1) {
+		snprintf(path, sizeof(path), "/dev/snd/midiC%dD%d", card, dev);
+		name = path;
+	}
+
+	t->rfd = t->wfd = open(name, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if (t->rfd < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int raw_drain(struct transport *t)
+{
+	int stream = RAW_STREAM_OUTPUT;
+
+	if (ioctl(t->wfd, RAW_IOCTL_DRAIN, &stream) < 0)
+		return -errno;
+
+	return 0;
+}
+
+static int raw_set_buffer(struct transport *t, size_t size, size_t avail_min)
+{
+	struct raw_params params = {
+		.stream = RAW_STREAM_OUTPUT,
+		.buffer_size = size,
+		.avail_min = avail_min,
+		.no_active_sensing = 1,
+	};
+
+	if (ioctl(t->wfd, RAW_IOCTL_PARAMS, &params) < 0)
+		return -errno;
+
+	return size;
+}
+
+static const struct transport_ops transports[] = {
+	{ "tty:", tty_open, fd_close, fd_nfds, fd_pollfds, fd_revents,
+	  fd_read, fd_write, fd_drain, fd_set_buffer },
+	{ "fd:", fdnum_open, fd_close, fd_nfds, fd_pollfds, fd_revents,
+	  fd_read, fd_write, fd_drain, fd_set_buffer },
+	{ "loop:", loop_open, fd_close, fd_nfds, fd_pollfds, fd_revents,
+	  fd_read, fd_write, fd_drain, fd_set_buffer },
+	{ "raw:", raw_open, fd_close, fd_nfds, fd_pollfds, fd_revents,
+	  fd_read, fd_write, raw_drain, raw_set_buffer },
+	/* Default, must be last */
+	{ "", rawmidi_open, rawmidi_close, rawmidi_nfds, rawmidi_pollfds, rawmidi_revents,
+	  rawmidi_read, rawmidi_write, rawmidi_drain, rawmidi_set_buffer },
+};
+
+int transport_open(struct transport **tp, const char *name)
+{
+	const struct transport_ops *ops;
+	struct transport *t;
+	int err;
+
+	for (ops = transports; *ops->prefix; ops++) {
+		if (strncmp(name, ops->prefix, strlen(ops->prefix)) == 0)
+			break;
+	}
+
+	t = calloc(1, sizeof(*t));
+	if (t == NULL)
+		return -ENOMEM;
+
+	t->ops = ops;
+	t->rfd = t->wfd = -1;
+
+	err = ops->open(t, name + strlen(ops->prefix));
+	if (err < 0) {
+		transport_close(t);
+		return err;
+	}
+
+	*tp = t;
+	return 0;
+}
+
+void transport_close(struct transport *t)
+{
+	if (!t)
+		return;
+
+	t->ops->close(t);
+	free(t);
+}
+
+int transport_nfds(struct transport *t, int dir)
+{
+	return t->ops->nfds(t, dir);
+}
+
+int transport_pollfds(struct transport *t, int dir, struct pollfd *pfds, int n)
+{
+	return t->ops->pollfds(t, dir, pfds, n);
+}
+
+int transport_revents(struct transport *t, int dir, struct pollfd *pfds, int n,
+		      unsigned short *revents)
+{
+	return t->ops->revents(t, dir, pfds, n, revents);
+}
+
+ssize_t transport_read(struct transport *t, unsigned char *buf, size_t len)
+{
+	return t->ops->read(t, buf, len);
+}
+
+ssize_t transport_write(struct transport *t, const unsigned char *buf, size_t len)
+{
+	return t->ops->write(t, buf, len);
+}
+
+ssize_t transport_write_all(struct transport *t, const unsigned char *buf, size_t len)
+{
+	struct pollfd pfds[8];
+	size_t done = 0;
+	ssize_t n;
+	int nfds;
+
+	nfds = transport_nfds(t, TRANSPORT_OUT);
+	if (nfds <= 0 || nfds > 8)
+		return -ENODEV;
+
+	while (done < len) {
+		n = transport_write(t, buf + done, len - done);
+		if (n > 0) {
+			done += n;
+			continue;
+		}
+		if (n != -EAGAIN && n != 0)
+			return n;
+
+		n = transport_pollfds(t, TRANSPORT_OUT, pfds, nfds);
+		if (n < 0)
+			return n;
+		if (poll(pfds, nfds, -1) < 0 && errno != EINTR)
+			return -errno;
+	}
+
+	return len;
+}
+
+int transport_drain(struct transport *t)
+{
+	return t->ops->drain(t);
+}
+
+int transport_set_buffer(struct transport *t, size_t size, size_t avail_min)
+{
+	return t->ops->set_buffer(t, size, avail_min);
+}
+
+const char *transport_strerror(int err)
+{
+	return snd_strerror(err);
+}
@@ -0,0 +1,74 @@
+/*
+ *  Line 6 Pod 2.3 MIDI Editing Tool
+ *  MIDI Transports
+ *
+ *  Copyright (c) 2013 Eldad Zack <eldad@fogrefinery.com>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef _POD6CTL_TRANSPORT_H
+#define _POD6CTL_TRANSPORT_H
+
+#include <sys/types.h>
+#include <sys/poll.h>
+
+/*
+ * A byte stream to the device. The port name selects the implementation:
+ *
+ *   tty:<path>  serial tty or pty (for example one opened by podemu)
+ *   fd:<n>      an already open descriptor, such as a socketpair end
+ *   loop:       in-process loopback; whatever is written is read back
+ *   raw:<path>  kernel raw MIDI node (/dev/snd/midiC1D0, or raw:hw:1,0),
+ *               opened without alsa-lib
+ *   <other>     ALSA raw MIDI port (hw:1, virtual, ...)
+ */
+struct transport;
+
+/* Poll directions */
+enum {
+	TRANSPORT_IN,
+	TRANSPORT_OUT,
+};
+
+/* Returns 0 or a negative error code */
+int transport_open(struct transport **t, const char *name);
+void transport_close(struct transport *t);
+
+/* Number of poll descriptors for a direction, and filling them in */
+int transport_nfds(struct transport *t, int dir);
+int transport_pollfds(struct transport *t, int dir, struct pollfd *pfds, int n);
+/* Translates poll results on those descriptors into POLLIN/POLLOUT/POLLERR */
+int transport_revents(struct transport *t, int dir, struct pollfd *pfds, int n,
+		      unsigned short *revents);
+
+/* Non-blocking bulk read: bytes read, -EAGAIN if there are none, or an error */
+ssize_t transport_read(struct transport *t, unsigned char *buf, size_t len);
+/* Non-blocking bulk write: bytes accepted, -EAGAIN if there is no room, or an error */
+ssize_t transport_write(struct transport *t, const unsigned char *buf, size_t len);
+/* Writes all of buf, waiting for room: len or a negative error code */
+ssize_t transport_write_all(struct transport *t, const unsigned char *buf, size_t len);
+/* Waits until everything written has left the host */
+int transport_drain(struct transport *t);
+/*
+ * Sizes the kernel output buffer; POLLOUT is then reported once avail_min
+ * bytes are free. Returns the size in effect, 0 if the transport keeps
+ * its own, or a negative error code.
+ */
+int transport_set_buffer(struct transport *t, size_t size, size_t avail_min);
+
+const char *transport_strerror(int err);
+
+#endif